@@ -0,0 +1,98 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static void *mapSlots(size_t size, int huge, int *pages){
+    void *p;
+
+    *pages = ARENA_PAGES_SMALL;
+    if (huge){
+#ifdef MAP_HUGETLB
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED){
+            *pages = ARENA_PAGES_HUGETLB;
+            return p;
+        }
+#endif
+    }
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (huge && madvise(p, size, MADV_HUGEPAGE) == 0)
+        *pages = ARENA_PAGES_TRANSPARENT;
+#endif
+    return p;
+}
+
+// point the machine in `slot` at its own registers and memory
+static void fixPointers(ArenaSlot *slot, const ArenaSlot *from){
+    slot->state.memory = slot->memory;
+    slot->machine.state = &slot->state;
+    if (slot->state.io == &from->machine)
+        slot->state.io = &slot->machine;
+    slot->machine.input_hook = NULL;
+    slot->machine.interrupt_hook = NULL;
+    slot->machine.hook_ctx = NULL;
+}
+
+Arena *arenaCreate(uint32_t count, int huge){
+    Arena *arena = (Arena *)calloc(1, sizeof(Arena));
+    size_t size = (count + 1) * sizeof(ArenaSlot);
+
+    // MAP_HUGETLB needs whole huge pages
+    size = (size + ARENA_HUGE_PAGE - 1) & ~(size_t)(ARENA_HUGE_PAGE - 1);
+    arena->slots = (ArenaSlot *)mapSlots(size, huge, &arena->pages);
+    if (!arena->slots){
+        free(arena);
+        return NULL;
+    }
+    arena->count = count;
+    arena->size = size;
+
+    for (uint32_t i = 0; i <= count; i++){
+        resetState(&arena->slots[i].state, arena->slots[i].memory);
+        machineInit(&arena->slots[i].machine, &arena->slots[i].state);
+    }
+    return arena;
+}
+
+void arenaFree(Arena *arena){
+    if (!arena)
+        return;
+    munmap(arena->slots, arena->size);
+    free(arena);
+}
+
+void arenaClone(Arena *arena, uint32_t i){
+    ArenaSlot *slot = &arena->slots[i];
+    const ArenaSlot *from = &arena->slots[arena->count];
+
+    // hash the template once, so its instances start with a valid hash
+    syncMemoryHash(&arena->slots[arena->count].state);
+    memcpy(slot, from, sizeof(ArenaSlot));
+    fixPointers(slot, from);
+    memset(slot->state.dirty, 0, sizeof(slot->state.dirty));
+}
+
+void arenaReset(Arena *arena, uint32_t i){
+    ArenaSlot *slot = &arena->slots[i];
+    const ArenaSlot *from = &arena->slots[arena->count];
+
+    for (int word = 0; word < MEMORY_PAGES / 64; word++){
+        uint64_t bits = slot->state.dirty[word];
+        while (bits){
+            int start = (word * 64 + __builtin_ctzll(bits)) << MEMORY_PAGE_SHIFT;
+            bits &= bits - 1;
+            memcpy(&slot->memory[start], &from->memory[start], MEMORY_PAGE_SIZE);
+        }
+    }
+
+    syncMemoryHash(&arena->slots[arena->count].state);
+    slot->state = from->state;
+    slot->machine = from->machine;
+    fixPointers(slot, from);
+    memset(slot->state.dirty, 0, sizeof(slot->state.dirty));
+}
@@ -0,0 +1,81 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <stdint.h>
+#include <stddef.h>
+#include "emulator.h"
+#include "machine.h"
+
+/*
+ * Instance arena: one mapping holding many machines, each in one contiguous
+ * slot (its 64 KB of memory, then its registers, then its board). Slots are
+ * cache-line aligned, so two threads working on neighbouring instances never
+ * share a line. A slot is 64 KB plus a few hundred bytes, so its memory does
+ * not start on the same 4 KB offset as the next one's.
+ *
+ * With `huge` the mapping asks for 2 MB pages (MAP_HUGETLB, falling back to
+ * transparent huge pages), so a thousand instances need tens of TLB entries
+ * instead of tens of thousands.
+ *
+ * One extra slot is the template: set it up (load the ROM, machineInit, a
+ * snapshot...) and arenaClone copies it into an instance with a single
+ * memcpy. arenaReset takes an instance back to the template by copying only
+ * the pages it has stored to since its clone or last reset, so it uses the
+ * instance's dirty page bits; do not mix it with snapshot checkpoints on the
+ * same instance. With -DSTATEHASH the template's memory hash is computed at
+ * the first clone or reset, so call invalidateMemoryHash() on it if its
+ * memory changes after that.
+ */
+
+#define ARENA_HUGE_PAGE (2 << 20)
+
+typedef struct ArenaSlot {
+    uint8_t    memory[0x10000];
+    State8080  state __attribute__((aligned(64)));
+    Machine    machine __attribute__((aligned(64)));
+} __attribute__((aligned(64))) ArenaSlot;
+
+enum {
+    ARENA_PAGES_SMALL,
+    ARENA_PAGES_TRANSPARENT,    // madvise(MADV_HUGEPAGE); the kernel may or may not use them
+    ARENA_PAGES_HUGETLB
+};
+
+typedef struct Arena {
+    ArenaSlot  *slots;          // count instances, then the template
+    uint32_t   count;
+    size_t     size;            // of the mapping
+    int        pages;           // ARENA_PAGES_*
+} Arena;
+
+/*
+ * Map `count` instance slots and the template, all zero. Every slot gets
+ * resetState and machineInit.
+ * @param huge Ask for huge pages
+ * @return NULL if the memory cannot be mapped
+ */
+Arena *arenaCreate(uint32_t count, int huge);
+void arenaFree(Arena *arena);
+
+static inline State8080 *arenaState(Arena *arena, uint32_t i){
+    return &arena->slots[i].state;
+}
+
+static inline Machine *arenaMachine(Arena *arena, uint32_t i){
+    return &arena->slots[i].machine;
+}
+
+// the template's machine, to set up before cloning
+static inline Machine *arenaTemplate(Arena *arena){
+    return &arena->slots[arena->count].machine;
+}
+
+/*
+ * Make instance i a copy of the template. Pointers into the template's slot
+ * are moved to i's own; movie hooks are not copied.
+ */
+void arenaClone(Arena *arena, uint32_t i);
+
+// take instance i back to the template, copying only the pages it has stored to
+void arenaReset(Arena *arena, uint32_t i);
+
+#endif
@@ -0,0 +1,218 @@
+#include "callgraph.h"
+#include <stdlib.h>
+#include <string.h>
+
+static int32_t newNode(CallGraph *cg, uint32_t routine, int32_t parent){
+    if (cg->nnodes == cg->capacity){
+        cg->capacity = cg->capacity ? cg->capacity * 2 : 1024;
+        cg->nodes = (CallNode *)realloc(cg->nodes, cg->capacity * sizeof(CallNode));
+    }
+
+    int32_t id = cg->nnodes++;
+    CallNode *node = &cg->nodes[id];
+    node->routine = routine;
+    node->parent = parent;
+    node->child = -1;
+    node->sibling = -1;
+    node->cycles = 0;
+
+    if (parent >= 0){
+        node->sibling = cg->nodes[parent].child;
+        cg->nodes[parent].child = id;
+    }
+
+    return id;
+}
+
+static int32_t childNode(CallGraph *cg, int32_t parent, uint32_t routine){
+    for (int32_t id = cg->nodes[parent].child; id >= 0; id = cg->nodes[id].sibling)
+        if (cg->nodes[id].routine == routine)
+            return id;
+
+    return newNode(cg, routine, parent);
+}
+
+CallGraph *callgraphCreate(void){
+    CallGraph *cg = (CallGraph *)calloc(1, sizeof(CallGraph));
+    cg->current = newNode(cg, CALLGRAPH_ROOT, -1);
+    cg->routines[CALLGRAPH_ROOT].calls = 1;
+
+    return cg;
+}
+
+void callgraphFree(CallGraph *cg){
+    if (!cg)
+        return;
+    for (int i = 0; i <= CALLGRAPH_ROOT; i++)
+        free(cg->names[i]);
+    free(cg->nodes);
+    free(cg);
+}
+
+int callgraphLoadSymbols(CallGraph *cg, const char *path){
+    FILE *f = fopen(path, "r");
+    char line[256], name[200];
+    unsigned addr;
+    int loaded = 0;
+
+    if (!f)
+        return -1;
+
+    while (fgets(line, sizeof(line), f)){
+        char *p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+        if (*p == '$')
+            p++;
+        if (sscanf(p, "%x %199s", &addr, name) != 2 || addr > 0xffff)
+            continue;
+
+        free(cg->names[addr]);
+        cg->names[addr] = strdup(name);
+        loaded++;
+    }
+
+    fclose(f);
+    return loaded;
+}
+
+static void enter(CallGraph *cg, uint16_t routine, uint16_t slot){
+    if (cg->depth == CALLGRAPH_MAX_DEPTH){
+        cg->dropped++;
+        return;
+    }
+
+    RoutineStats *rs = &cg->routines[routine];
+    CallFrame *frame = &cg->stack[cg->depth++];
+
+    cg->current = childNode(cg, cg->current, routine);
+    frame->node = cg->current;
+    frame->slot = slot;
+    frame->entry = cg->cycles;
+    // with recursion only the outermost activation adds to inclusive time
+    frame->counted = (rs->active++ == 0);
+    rs->calls++;
+}
+
+static void leave(CallGraph *cg){
+    CallFrame *frame = &cg->stack[--cg->depth];
+    RoutineStats *rs = &cg->routines[cg->nodes[frame->node].routine];
+
+    rs->active--;
+    if (frame->counted)
+        rs->inclusive += cg->cycles - frame->entry;
+    cg->current = cg->nodes[frame->node].parent;
+}
+
+void callgraphCall(CallGraph *cg, const State8080 *state){
+    enter(cg, state->pc, state->sp);
+}
+
+void callgraphStep(CallGraph *cg, const State8080 *state, uint8_t opcode, uint16_t sp_before, uint32_t cycles){
+    // the instruction ran in the context of whatever was on top before it
+    cg->cycles += cycles;
+    cg->nodes[cg->current].cycles += cycles;
+    cg->routines[cg->nodes[cg->current].routine].exclusive += cycles;
+
+    // drop every frame whose return address slot is now above SP
+    while (cg->depth > 0 && cg->stack[cg->depth - 1].slot < state->sp)
+        leave(cg);
+
+    // CALL, Ccc and RST push the return address only when they are taken
+    int is_call = opcode == 0xcd || (opcode & 0xc7) == 0xc4 || (opcode & 0xc7) == 0xc7;
+    if (is_call && state->sp == (uint16_t)(sp_before - 2))
+        enter(cg, state->pc, state->sp);
+}
+
+static const char *routineName(CallGraph *cg, uint32_t routine, char *buf){
+    if (routine == CALLGRAPH_ROOT)
+        return "(top)";
+    if (cg->names[routine])
+        return cg->names[routine];
+    sprintf(buf, "sub_%04x", routine);
+    return buf;
+}
+
+typedef struct RoutineEntry {
+    uint32_t   routine;
+    uint64_t   inclusive;
+} RoutineEntry;
+
+static int moreInclusiveFirst(const void *x, const void *y){
+    const RoutineEntry *i = (const RoutineEntry *)x, *j = (const RoutineEntry *)y;
+
+    if (i->inclusive != j->inclusive)
+        return i->inclusive < j->inclusive ? 1 : -1;
+    return (i->routine > j->routine) - (i->routine < j->routine);
+}
+
+void callgraphReport(CallGraph *cg, FILE *out){
+    RoutineEntry *order = (RoutineEntry *)malloc((CALLGRAPH_ROOT + 1) * sizeof(RoutineEntry));
+    uint64_t total = cg->cycles ? cg->cycles : 1;
+    char buf[16];
+    int n = 0;
+
+    for (uint32_t r = 0; r <= CALLGRAPH_ROOT; r++){
+        RoutineStats *rs = &cg->routines[r];
+        if (!rs->calls)
+            continue;
+
+        // routines still on the stack have not been charged for their open activation yet
+        uint64_t inclusive = rs->inclusive;
+        for (int d = 0; d < cg->depth; d++)
+            if (cg->stack[d].counted && cg->nodes[cg->stack[d].node].routine == r)
+                inclusive += cg->cycles - cg->stack[d].entry;
+        if (r == CALLGRAPH_ROOT)
+            inclusive = cg->cycles;
+
+        order[n].routine = r;
+        order[n].inclusive = inclusive;
+        n++;
+    }
+    qsort(order, n, sizeof(RoutineEntry), moreInclusiveFirst);
+
+    fprintf(out, "# %llu cycles, %llu calls not tracked (shadow stack full)\n",
+            (unsigned long long)cg->cycles, (unsigned long long)cg->dropped);
+    fprintf(out, "#     calls    inclusive   incl%%    exclusive   excl%%  routine\n");
+    for (int i = 0; i < n; i++){
+        RoutineStats *rs = &cg->routines[order[i].routine];
+        fprintf(out, "%11llu %12llu %6.2f%% %12llu %6.2f%%  %s\n",
+                (unsigned long long)rs->calls,
+                (unsigned long long)order[i].inclusive, 100.0 * order[i].inclusive / total,
+                (unsigned long long)rs->exclusive, 100.0 * rs->exclusive / total,
+                routineName(cg, order[i].routine, buf));
+    }
+
+    free(order);
+}
+
+// every frame plus the root, each name at most 199 characters and a ';'
+#define FOLDED_PATH_MAX  ((CALLGRAPH_MAX_DEPTH + 1) * 200 + 1)
+
+static void foldedNode(CallGraph *cg, int32_t id, char *path, size_t len, FILE *out){
+    char buf[16];
+    const char *name = routineName(cg, cg->nodes[id].routine, buf);
+    size_t n = strlen(name);
+
+    if (len + n + 2 > FOLDED_PATH_MAX)
+        return;
+    if (len)
+        path[len++] = ';';
+    memcpy(path + len, name, n + 1);
+    len += n;
+
+    if (cg->nodes[id].cycles)
+        fprintf(out, "%s %llu\n", path, (unsigned long long)cg->nodes[id].cycles);
+
+    for (int32_t c = cg->nodes[id].child; c >= 0; c = cg->nodes[c].sibling)
+        foldedNode(cg, c, path, len, out);
+}
+
+void callgraphFolded(CallGraph *cg, FILE *out){
+    char *path = (char *)malloc(FOLDED_PATH_MAX);
+
+    foldedNode(cg, 0, path, 0, out);
+    free(path);
+}
@@ -0,0 +1,89 @@
+#ifndef CALLGRAPH_H
+#define CALLGRAPH_H
+#include <stdio.h>
+#include <stdint.h>
+#include "emulator.h"
+
+/*
+ * Guest call-graph profiler.
+ *
+ * A shadow stack follows CALL/Ccc/RST (and interrupts) into routines. A frame is
+ * dropped as soon as SP rises above the slot its return address was pushed to,
+ * so RET/Rcc, POP of a return address, XTHL tricks and SPHL all unwind it the
+ * same way without trusting the return address itself.
+ *
+ * Build with -DCALLGRAPH to hook it into the run loop (see CALLGRAPH_STEP).
+ */
+
+#define CALLGRAPH_MAX_DEPTH  256
+#define CALLGRAPH_ROOT       0x10000    // pseudo routine for code outside any call
+
+typedef struct CallNode {
+    uint32_t   routine;     // entry address, or CALLGRAPH_ROOT
+    int32_t    parent;
+    int32_t    child;       // first child
+    int32_t    sibling;     // next child of the same parent
+    uint64_t   cycles;      // exclusive cycles spent at exactly this stack
+} CallNode;
+
+typedef struct CallFrame {
+    int32_t    node;
+    uint16_t   slot;        // SP right after the call: where the return address lives
+    uint8_t    counted;     // outermost activation of its routine (for inclusive time)
+    uint64_t   entry;       // cycle count at entry
+} CallFrame;
+
+typedef struct RoutineStats {
+    uint64_t   calls;
+    uint64_t   inclusive;
+    uint64_t   exclusive;
+    uint32_t   active;      // activations currently on the shadow stack
+} RoutineStats;
+
+typedef struct CallGraph {
+    CallFrame  stack[CALLGRAPH_MAX_DEPTH];
+    int        depth;
+    uint64_t   dropped;     // calls not tracked because the shadow stack was full
+    uint64_t   cycles;      // total cycles seen
+    CallNode   *nodes;
+    int32_t    nnodes;
+    int32_t    capacity;
+    int32_t    current;
+    RoutineStats  routines[CALLGRAPH_ROOT + 1];
+    char       *names[CALLGRAPH_ROOT + 1];
+} CallGraph;
+
+CallGraph *callgraphCreate(void);
+void callgraphFree(CallGraph *cg);
+
+/*
+ * Load "<hex address> <name>" lines; '#' starts a comment
+ * @return number of symbols loaded, -1 if the file cannot be opened
+ */
+int callgraphLoadSymbols(CallGraph *cg, const char *path);
+
+/*
+ * Account one executed instruction
+ * @param state The state after the instruction executed
+ * @param opcode The opcode that was executed
+ * @param sp_before SP before the instruction executed
+ * @param cycles Clock states the instruction took
+ */
+void callgraphStep(CallGraph *cg, const State8080 *state, uint8_t opcode, uint16_t sp_before, uint32_t cycles);
+
+// a call just happened outside an instruction (an interrupt): return address at SP, routine at PC
+void callgraphCall(CallGraph *cg, const State8080 *state);
+
+// per-routine calls, inclusive and exclusive cycles, most expensive first
+void callgraphReport(CallGraph *cg, FILE *out);
+
+// one "outer;inner;leaf cycles" line per distinct stack, for flamegraph.pl
+void callgraphFolded(CallGraph *cg, FILE *out);
+
+#ifdef CALLGRAPH
+#define CALLGRAPH_STEP(cg, state, opcode, sp_before, cycles)  callgraphStep((cg), (state), (opcode), (sp_before), (cycles))
+#else
+#define CALLGRAPH_STEP(cg, state, opcode, sp_before, cycles)  ((void)(sp_before))
+#endif
+
+#endif
@@ -0,0 +1,646 @@
+#include "cpm.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "machine.h"
+
+void cpmInit(Cpm *cpm, State8080 *state, FILE *console, int keep){
+    uint8_t *memory = state->memory;
+
+    memset(cpm, 0, sizeof(Cpm));
+    cpm->state = state;
+    cpm->console = console;
+    cpm->keep = keep;
+    cpm->dir = ".";
+    cpm->dma = CPM_DMA;
+    cpm->out_cap = CPM_FLUSH;
+    cpm->out = (char *)malloc(cpm->out_cap + 1);
+    cpm->out[0] = '\0';
+
+    // 0x0000 is the warm boot jump, trapped before it runs
+    memory[0x0000] = 0xc3;
+    memory[0x0001] = (CPM_BIOS + 3) & 0xff;
+    memory[0x0002] = (CPM_BIOS + 3) >> 8;
+    // programs find the top of memory in the BDOS jump at 0x0005
+    memory[CPM_BDOS_ENTRY] = 0xc3;
+    memory[CPM_BDOS_ENTRY + 1] = CPM_BDOS & 0xff;
+    memory[CPM_BDOS_ENTRY + 2] = CPM_BDOS >> 8;
+    memory[CPM_BDOS] = 0xc9;
+    // every BIOS entry is trapped; each jumps to itself should the trap be bypassed
+    for (int i = 0; i < CPM_BIOS_CALLS; i++){
+        uint16_t entry = CPM_BIOS + 3 * i;
+        memory[entry] = 0xc3;
+        memory[entry + 1] = entry & 0xff;
+        memory[entry + 2] = entry >> 8;
+    }
+
+    memset(&memory[CPM_FCB1], 0, 36);
+    memset(&memory[CPM_FCB1 + 1], ' ', 11);
+    memset(&memory[CPM_FCB2 + 1], ' ', 11);
+    memset(&memory[CPM_DMA], 0, CPM_RECORD);
+
+    state->sp = CPM_BDOS;
+    state->pc = CPM_TPA;
+}
+
+void cpmFree(Cpm *cpm){
+    cpmFlush(cpm);
+    for (int i = 0; i < CPM_MAX_FILES; i++)
+        if (cpm->files[i].f)
+            fclose(cpm->files[i].f);
+    if (cpm->search)
+        closedir(cpm->search);
+    free(cpm->out);
+    cpm->out = NULL;
+}
+
+long cpmLoad(Cpm *cpm, const char *path){
+    cpm->state->pc = CPM_TPA;
+    return machineLoadROM(cpm->state->memory, path, CPM_TPA);
+}
+
+/*
+ * Parse "[d:]name[.ext]" into the drive and 11 name bytes of an FCB; '*' fills
+ * the rest of the field with '?'
+ * @return where parsing stopped
+ */
+static const char *fcbParse(const char *s, uint8_t *fcb){
+    memset(fcb + 1, ' ', 11);
+    fcb[0] = 0;
+
+    if (s[0] && s[1] == ':'){
+        fcb[0] = toupper((unsigned char)s[0]) - 'A' + 1;
+        s += 2;
+    }
+    for (int i = 0; *s && *s != '.' && *s != ' '; s++){
+        if (*s == '*')
+            for (; i < 8; i++)
+                fcb[1 + i] = '?';
+        else if (i < 8)
+            fcb[1 + i++] = toupper((unsigned char)*s);
+    }
+    if (*s == '.'){
+        s++;
+        for (int i = 0; *s && *s != ' '; s++){
+            if (*s == '*')
+                for (; i < 3; i++)
+                    fcb[9 + i] = '?';
+            else if (i < 3)
+                fcb[9 + i++] = toupper((unsigned char)*s);
+        }
+    }
+    return s;
+}
+
+void cpmSetArgs(Cpm *cpm, const char *tail){
+    uint8_t *memory = cpm->state->memory;
+    int len = 0;
+
+    // the CCP passes the tail upper-cased, with the space after the program name
+    if (*tail)
+        memory[CPM_DMA + 1 + len++] = ' ';
+    for (const char *c = tail; *c && len < CPM_RECORD - 2; c++)
+        memory[CPM_DMA + 1 + len++] = toupper((unsigned char)*c);
+    memory[CPM_DMA] = len;
+    memory[CPM_DMA + 1 + len] = 0;
+
+    while (*tail == ' ')
+        tail++;
+    if (*tail)
+        tail = fcbParse(tail, &memory[CPM_FCB1]);
+    while (*tail == ' ')
+        tail++;
+    if (*tail)
+        fcbParse(tail, &memory[CPM_FCB2]);
+}
+
+void cpmFlush(Cpm *cpm){
+    if (cpm->console && cpm->out_len > cpm->flushed){
+        fwrite(cpm->out + cpm->flushed, 1, cpm->out_len - cpm->flushed, cpm->console);
+        fflush(cpm->console);
+    }
+    cpm->flushed = cpm->out_len;
+
+    if (!cpm->keep){
+        cpm->out_len = 0;
+        cpm->flushed = 0;
+    }
+}
+
+static void cpmPutc(Cpm *cpm, char c){
+    if (cpm->out_len == cpm->out_cap){
+        if (cpm->keep){
+            cpm->out_cap *= 2;
+            cpm->out = (char *)realloc(cpm->out, cpm->out_cap + 1);
+        } else{
+            cpmFlush(cpm);
+        }
+    }
+    cpm->out[cpm->out_len++] = c;
+    cpm->out[cpm->out_len] = '\0';
+
+    if (cpm->out_len - cpm->flushed >= CPM_FLUSH)
+        cpmFlush(cpm);
+}
+
+static uint8_t cpmGetc(Cpm *cpm){
+    int c;
+
+    // a prompt has to be visible before the program waits for an answer
+    cpmFlush(cpm);
+    if (!cpm->input || (c = getc(cpm->input)) == EOF)
+        return 0x1a;
+    return c == '\n' ? '\r' : c;
+}
+
+// a terminal is never reported ready, so programs polling for ^C do not block on it
+static uint8_t cpmConsoleReady(Cpm *cpm){
+    int c;
+
+    if (!cpm->input || isatty(fileno(cpm->input)))
+        return 0;
+    if ((c = getc(cpm->input)) == EOF)
+        return 0;
+    ungetc(c, cpm->input);
+    return 0xff;
+}
+
+/* ---- files ---- */
+
+// characters CP/M allows in a file name; nothing that means something to the host's paths
+static int fcbNameChar(uint8_t c){
+    return c > ' ' && c < 0x7f && !strchr("<>.,;:=?*[]%|()/\\", c);
+}
+
+// host name of the file in an FCB, or 0 if the name is empty or not a CP/M name
+static int fcbHostName(const uint8_t *fcb, char *name){
+    int n = 0;
+
+    for (int i = 1; i <= 8 && (fcb[i] & 0x7f) != ' '; i++){
+        if (!fcbNameChar(fcb[i] & 0x7f))
+            return 0;
+        name[n++] = tolower(fcb[i] & 0x7f);
+    }
+    if (n == 0)
+        return 0;
+    if ((fcb[9] & 0x7f) != ' '){
+        name[n++] = '.';
+        for (int i = 9; i <= 11 && (fcb[i] & 0x7f) != ' '; i++){
+            if (!fcbNameChar(fcb[i] & 0x7f))
+                return 0;
+            name[n++] = tolower(fcb[i] & 0x7f);
+        }
+    }
+    name[n] = '\0';
+    return 1;
+}
+
+// CP/M form of a host name; 0 if it does not fit 8.3
+static int hostFcbName(const char *name, uint8_t *out){
+    const char *dot = strrchr(name, '.');
+    size_t base = dot ? (size_t)(dot - name) : strlen(name);
+    size_t ext = dot ? strlen(dot + 1) : 0;
+
+    if (base == 0 || base > 8 || ext > 3 || (dot && strchr(name, '.') != dot))
+        return 0;
+    memset(out, ' ', 11);
+    for (size_t i = 0; i < base; i++)
+        out[i] = toupper((unsigned char)name[i]);
+    for (size_t i = 0; i < ext; i++)
+        out[8 + i] = toupper((unsigned char)dot[1 + i]);
+    return 1;
+}
+
+static void hostPath(Cpm *cpm, const char *name, char *path, size_t size){
+    snprintf(path, size, "%s/%s", cpm->dir, name);
+}
+
+static void closeFile(Cpm *cpm, const char *name){
+    for (int i = 0; i < CPM_MAX_FILES; i++){
+        if (cpm->files[i].f && strcmp(cpm->files[i].name, name) == 0){
+            fclose(cpm->files[i].f);
+            cpm->files[i].f = NULL;
+        }
+    }
+}
+
+/*
+ * The host file for an FCB, opened on first use and kept open
+ * @param create Truncate or create the file instead of opening an existing one
+ */
+static FILE *fcbFile(Cpm *cpm, const uint8_t *fcb, int create){
+    char name[13], path[4096];
+    CpmFile *slot;
+
+    if (!fcbHostName(fcb, name))
+        return NULL;
+    if (create)
+        closeFile(cpm, name);
+    else
+        for (int i = 0; i < CPM_MAX_FILES; i++)
+            if (cpm->files[i].f && strcmp(cpm->files[i].name, name) == 0)
+                return cpm->files[i].f;
+
+    hostPath(cpm, name, path, sizeof(path));
+    FILE *f = fopen(path, create ? "wb+" : "rb+");
+    if (!f && !create)
+        f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+
+    slot = &cpm->files[cpm->next_file];
+    cpm->next_file = (cpm->next_file + 1) % CPM_MAX_FILES;
+    if (slot->f)
+        fclose(slot->f);
+    strcpy(slot->name, name);
+    slot->f = f;
+    return f;
+}
+
+static long fileRecords(FILE *f){
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0)
+        return 0;
+    return (st.st_size + CPM_RECORD - 1) / CPM_RECORD;
+}
+
+// sequential position: record cr of extent ex of module s2
+static uint32_t seqRecord(const uint8_t *fcb){
+    return ((fcb[14] & 0x3f) * 32 + (fcb[12] & 0x1f)) * CPM_RECORD + (fcb[32] & 0x7f);
+}
+
+static void setSeqRecord(uint8_t *fcb, uint32_t record){
+    fcb[32] = record & 0x7f;
+    fcb[12] = (record >> 7) & 0x1f;
+    fcb[14] = (record >> 12) & 0x3f;
+}
+
+static uint32_t randomRecord(const uint8_t *fcb){
+    return fcb[33] | (fcb[34] << 8) | ((fcb[35] & 0x03) << 16);
+}
+
+static void setRandomRecord(uint8_t *fcb, uint32_t record){
+    fcb[33] = record & 0xff;
+    fcb[34] = (record >> 8) & 0xff;
+    fcb[35] = (record >> 16) & 0xff;
+}
+
+// @return the BDOS result: 0, or 1 at end of file
+static uint8_t readRecord(Cpm *cpm, FILE *f, uint32_t record){
+    uint8_t buf[CPM_RECORD];
+    size_t n;
+
+    if (fseek(f, (long)record * CPM_RECORD, SEEK_SET) != 0)
+        return 1;
+    n = fread(buf, 1, CPM_RECORD, f);
+    if (n == 0)
+        return 1;
+    // the last record of a text file is padded with ^Z
+    memset(buf + n, 0x1a, CPM_RECORD - n);
+    for (int i = 0; i < CPM_RECORD; i++)
+        writeMemory(cpm->state, cpm->dma + i, buf[i]);
+    return 0;
+}
+
+// @return the BDOS result: 0, or 2 if the host write failed
+static uint8_t writeRecord(Cpm *cpm, FILE *f, uint32_t record){
+    uint8_t buf[CPM_RECORD];
+
+    for (int i = 0; i < CPM_RECORD; i++)
+        buf[i] = cpm->state->memory[(uint16_t)(cpm->dma + i)];
+    if (fseek(f, (long)record * CPM_RECORD, SEEK_SET) != 0 ||
+        fwrite(buf, 1, CPM_RECORD, f) != CPM_RECORD)
+        return 2;
+    return 0;
+}
+
+static int patternMatch(const uint8_t *pattern, const uint8_t *name){
+    for (int i = 0; i < 11; i++)
+        if (pattern[i] != '?' && (pattern[i] & 0x7f) != name[i])
+            return 0;
+    return 1;
+}
+
+/*
+ * Next directory entry matching the search pattern, written to the DMA
+ * buffer as entry 0 of a directory record
+ * @return 0, or 0xff when there are no more
+ */
+static uint8_t searchNext(Cpm *cpm){
+    struct dirent *ent;
+
+    if (!cpm->search)
+        return 0xff;
+
+    while ((ent = readdir(cpm->search))){
+        uint8_t name[11];
+        char path[4096];
+        struct stat st;
+
+        if (!hostFcbName(ent->d_name, name) || !patternMatch(cpm->pattern, name))
+            continue;
+        hostPath(cpm, ent->d_name, path, sizeof(path));
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        long records = (st.st_size + CPM_RECORD - 1) / CPM_RECORD;
+        uint8_t entry[CPM_RECORD];
+        memset(entry, 0xe5, sizeof(entry));
+        memset(entry, 0, 32);
+        memcpy(entry + 1, name, 11);
+        entry[15] = records > 128 ? 128 : records;
+        for (int i = 0; i < CPM_RECORD; i++)
+            writeMemory(cpm->state, cpm->dma + i, entry[i]);
+        return 0;
+    }
+
+    closedir(cpm->search);
+    cpm->search = NULL;
+    return 0xff;
+}
+
+/* ---- BDOS and BIOS ---- */
+
+static void cpmReturn(State8080 *state){
+    uint8_t *memory = state->memory;
+
+    state->pc = memory[state->sp] | (memory[(uint16_t)(state->sp + 1)] << 8);
+    state->sp += 2;
+    state->cycles += cycles8080[0xc9];
+}
+
+// BDOS results are in A and L, with B and H clear
+static void bdosResult(State8080 *state, uint8_t a){
+    state->a = state->l = a;
+    state->b = state->h = 0;
+}
+
+static void readLine(Cpm *cpm, uint16_t buf){
+    uint8_t *memory = cpm->state->memory;
+    uint8_t max = memory[buf];
+    uint8_t n = 0;
+
+    while (n < max){
+        uint8_t c = cpmGetc(cpm);
+        if (c == '\r' || c == 0x1a)
+            break;
+        writeMemory(cpm->state, buf + 2 + n, c);
+        n++;
+    }
+    writeMemory(cpm->state, buf + 1, n);
+}
+
+/*
+ * Carry out the BDOS function in C, then return to the caller as the RET at
+ * CPM_BDOS would. Unsupported functions return 0.
+ */
+static void cpmBdos(Cpm *cpm){
+    State8080 *state = cpm->state;
+    uint8_t *memory = state->memory;
+    uint16_t de = (state->d << 8) | state->e;
+    uint8_t fcb[36];
+    char name[13], path[4096];
+    FILE *f;
+    uint8_t result = 0;
+
+    cpm->bdos_calls++;
+    // work on a copy, so an FCB that runs past 0xffff wraps like the guest's own accesses
+    for (int i = 0; i < 36; i++)
+        fcb[i] = memory[(uint16_t)(de + i)];
+    switch (state->c){
+        case 0:     // system reset
+            state->pc = 0;
+            return;
+        case 1:     // console input
+            result = cpmGetc(cpm);
+            break;
+        case 2:     // console output
+            cpmPutc(cpm, state->e);
+            break;
+        case 6:     // direct console I/O
+            if (state->e == 0xff)
+                result = cpmConsoleReady(cpm) ? cpmGetc(cpm) : 0;
+            else if (state->e == 0xfe)
+                result = cpmConsoleReady(cpm);
+            else
+                cpmPutc(cpm, state->e);
+            break;
+        case 9:     // print string, terminated by '$'
+            // a string with no '$' stops after wrapping once around memory
+            for (uint32_t i = 0; i < 0x10000 && memory[(uint16_t)(de + i)] != '$'; i++)
+                cpmPutc(cpm, memory[(uint16_t)(de + i)]);
+            break;
+        case 10:    // read console buffer
+            readLine(cpm, de);
+            break;
+        case 11:    // console status
+            result = cpmConsoleReady(cpm);
+            break;
+        case 12:    // version: CP/M 2.2
+            bdosResult(state, 0x22);
+            cpmReturn(state);
+            return;
+        case 13:    // reset disk system
+            cpm->dma = CPM_DMA;
+            break;
+        case 15:    // open file
+            if (!(f = fcbFile(cpm, fcb, 0))){
+                result = 0xff;
+                break;
+            }
+            {
+                long left = fileRecords(f) - (long)(fcb[12] & 0x1f) * CPM_RECORD;
+                fcb[15] = left > 128 ? 128 : (left < 0 ? 0 : left);
+            }
+            break;
+        case 16:    // close file
+            if (fcbHostName(fcb, name))
+                closeFile(cpm, name);
+            break;
+        case 17:    // search for first
+            if (cpm->search)
+                closedir(cpm->search);
+            if (fcb[0] == '?')
+                memset(cpm->pattern, '?', 11);
+            else
+                memcpy(cpm->pattern, fcb + 1, 11);
+            cpm->search = opendir(cpm->dir);
+            result = searchNext(cpm);
+            break;
+        case 18:    // search for next
+            result = searchNext(cpm);
+            break;
+        case 19:    // delete file
+            if (!fcbHostName(fcb, name)){
+                result = 0xff;
+                break;
+            }
+            closeFile(cpm, name);
+            hostPath(cpm, name, path, sizeof(path));
+            result = remove(path) == 0 ? 0 : 0xff;
+            break;
+        case 20:    // read sequential
+            {
+                uint32_t record = seqRecord(fcb);
+                if (!(f = fcbFile(cpm, fcb, 0))){
+                    result = 1;
+                    break;
+                }
+                result = readRecord(cpm, f, record);
+                if (result == 0)
+                    setSeqRecord(fcb, record + 1);
+                break;
+            }
+        case 21:    // write sequential
+            {
+                uint32_t record = seqRecord(fcb);
+                if (!(f = fcbFile(cpm, fcb, 0))){
+                    result = 2;
+                    break;
+                }
+                result = writeRecord(cpm, f, record);
+                if (result == 0)
+                    setSeqRecord(fcb, record + 1);
+                break;
+            }
+        case 22:    // make file
+            result = fcbFile(cpm, fcb, 1) ? 0 : 0xff;
+            break;
+        case 23:    // rename: new name in the second half of the FCB
+            {
+                char to[13], to_path[4096];
+                if (!fcbHostName(fcb, name) || !fcbHostName(fcb + 16, to)){
+                    result = 0xff;
+                    break;
+                }
+                closeFile(cpm, name);
+                closeFile(cpm, to);
+                hostPath(cpm, name, path, sizeof(path));
+                hostPath(cpm, to, to_path, sizeof(to_path));
+                result = rename(path, to_path) == 0 ? 0 : 0xff;
+                break;
+            }
+        case 25:    // current disk: always A:
+            result = 0;
+            break;
+        case 26:    // set DMA address
+            cpm->dma = de;
+            break;
+        case 33:    // read random
+            if (!(f = fcbFile(cpm, fcb, 0))){
+                result = 6;
+                break;
+            }
+            result = readRecord(cpm, f, randomRecord(fcb));
+            // sequential access carries on from the record just read
+            setSeqRecord(fcb, randomRecord(fcb));
+            break;
+        case 34:    // write random
+        case 40:    // write random with zero fill: the host fills gaps with zeros anyway
+            if (!(f = fcbFile(cpm, fcb, 0))){
+                result = 6;
+                break;
+            }
+            result = writeRecord(cpm, f, randomRecord(fcb));
+            setSeqRecord(fcb, randomRecord(fcb));
+            break;
+        case 35:    // compute file size
+            if (!(f = fcbFile(cpm, fcb, 0))){
+                result = 0xff;
+                break;
+            }
+            setRandomRecord(fcb, fileRecords(f));
+            break;
+        case 36:    // set random record
+            setRandomRecord(fcb, seqRecord(fcb));
+            break;
+        default:    // 3-5, 7-8 (reader, punch, list, I/O byte), 14 and the rest need no action
+            break;
+    }
+
+    // file functions update the FCB: store the bytes that changed
+    if (state->c >= 15)
+        for (int i = 0; i < 36; i++)
+            if (memory[(uint16_t)(de + i)] != fcb[i])
+                writeMemory(state, de + i, fcb[i]);
+    bdosResult(state, result);
+    cpmReturn(state);
+}
+
+// BIOS entry n of the jump table; disk calls fail, since files go through the BDOS
+static void cpmBios(Cpm *cpm, int n){
+    State8080 *state = cpm->state;
+
+    cpm->bios_calls++;
+    switch (n){
+        case 0:     // BOOT
+        case 1:     // WBOOT
+            state->pc = 0;
+            return;
+        case 2:     // CONST
+            state->a = cpmConsoleReady(cpm);
+            break;
+        case 3:     // CONIN
+            state->a = cpmGetc(cpm);
+            break;
+        case 4:     // CONOUT
+            cpmPutc(cpm, state->c);
+            break;
+        case 7:     // READER
+            state->a = 0x1a;
+            break;
+        case 10:    // SELDSK: no disk parameter header
+            state->h = state->l = 0;
+            break;
+        case 13:    // READ
+        case 14:    // WRITE
+            state->a = 1;
+            break;
+        case 15:    // LISTST
+            state->a = 0xff;
+            break;
+        case 16:    // SECTRAN: no skew
+            state->h = state->b;
+            state->l = state->c;
+            break;
+        default:    // LIST, PUNCH, HOME, SETTRK, SETSEC, SETDMA
+            break;
+    }
+    cpmReturn(state);
+}
+
+StopReason cpmRun(Cpm *cpm, uint64_t max_instructions){
+    State8080 *state = cpm->state;
+    uint64_t end = max_instructions ? cpm->instructions + max_instructions : UINT64_MAX;
+
+    if (state->stop == STOP_LIMIT)
+        state->stop = STOP_NONE;
+
+    while (!state->stop){
+        if (state->pc <= CPM_BDOS_ENTRY || state->pc >= CPM_BIOS){
+            if (state->pc == 0){
+                state->stop = STOP_EXIT;
+                break;
+            }
+            if (state->pc == CPM_BDOS_ENTRY){
+                cpmBdos(cpm);
+                continue;
+            }
+            if (state->pc < CPM_BIOS + 3 * CPM_BIOS_CALLS && (state->pc - CPM_BIOS) % 3 == 0){
+                cpmBios(cpm, (state->pc - CPM_BIOS) / 3);
+                continue;
+            }
+        }
+
+        Emulate8080Op(state);
+        if (state->stop)
+            break;
+        if (++cpm->instructions >= end)
+            state->stop = STOP_LIMIT;
+    }
+
+    cpmFlush(cpm);
+    return (StopReason)state->stop;
+}
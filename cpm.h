@@ -0,0 +1,79 @@
+#ifndef CPM_H
+#define CPM_H
+#include <stdio.h>
+#include <stdint.h>
+#include <dirent.h>
+#include "emulator.h"
+
+/*
+ * Just enough CP/M 2.2 to run .COM programs: the program is loaded at 0x100,
+ * and BDOS calls (CALL 5) and the BIOS jump table are handled in the host
+ * instead of by guest code, so there is no disk hardware to emulate. Files
+ * named in FCBs are files in a host directory, all on drive A: user 0.
+ * A jump to 0x0000 (warm boot) ends the program.
+ */
+
+#define CPM_TPA         0x0100  // where .COM files are loaded and started
+#define CPM_BDOS_ENTRY  0x0005
+#define CPM_BDOS        0xfe00  // top of the TPA, as seen by programs that read 0x0006
+#define CPM_BIOS        0xff00  // BIOS jump table, found through the warm boot jump at 0x0000
+#define CPM_BIOS_CALLS  17
+#define CPM_DMA         0x0080  // default DMA buffer, also the command tail
+#define CPM_FCB1        0x005c
+#define CPM_FCB2        0x006c
+#define CPM_RECORD      128
+#define CPM_FLUSH       4096    // console output is written in chunks of this size
+#define CPM_MAX_FILES   16      // host files kept open at once
+
+typedef struct CpmFile {
+    char       name[13];        // host name, "name.ext" in lower case
+    FILE       *f;
+} CpmFile;
+
+typedef struct Cpm {
+    State8080  *state;
+    FILE       *console;        // where guest output goes, NULL to discard it
+    FILE       *input;          // console input, NULL for none (reads return ^Z)
+    const char *dir;            // host directory holding drive A:
+    char       *out;            // console output not yet flushed (or all of it, see keep)
+    size_t     out_len;
+    size_t     out_cap;
+    size_t     flushed;         // bytes of out already written to console
+    int        keep;            // keep all output in out, e.g. to check it afterwards
+    uint16_t   dma;
+    CpmFile    files[CPM_MAX_FILES];
+    int        next_file;       // slot to reuse when all are taken
+    DIR        *search;         // directory scan for search first/next
+    uint8_t    pattern[11];     // name being searched for, '?' matches anything
+    uint64_t   instructions;
+    uint64_t   bdos_calls;
+    uint64_t   bios_calls;
+} Cpm;
+
+// set up the zero page, BDOS entry and BIOS jump table in state->memory
+void cpmInit(Cpm *cpm, State8080 *state, FILE *console, int keep);
+// flush output and close the host files
+void cpmFree(Cpm *cpm);
+
+/*
+ * Load a .COM file at 0x100 and point PC at it
+ * @return the number of bytes loaded, -1 if the file cannot be read
+ */
+long cpmLoad(Cpm *cpm, const char *path);
+
+/*
+ * Fill in the command tail at 0x80 and the two default FCBs, as the CCP does
+ * @param tail Arguments after the program name, e.g. "IN.TXT OUT.TXT"
+ */
+void cpmSetArgs(Cpm *cpm, const char *tail);
+
+/*
+ * Run until the program exits, the core stops, or max_instructions have run (0 for no limit)
+ * @return STOP_EXIT on warm boot, otherwise why the run stopped
+ */
+StopReason cpmRun(Cpm *cpm, uint64_t max_instructions);
+
+// write buffered console output
+void cpmFlush(Cpm *cpm);
+
+#endif
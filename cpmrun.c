@@ -0,0 +1,58 @@
+/*
+ * Run a CP/M .COM program with the host providing the BDOS and BIOS.
+ * Console I/O is stdin/stdout; files are in the given directory (default: the
+ * current one).
+ *
+ * usage: cpmrun [-d dir] <program.com> [arguments...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emulator.h"
+#include "cpm.h"
+
+int main(int argc, char *argv[]) {
+    const char *dir = ".";
+    int first = 1;
+    char tail[128] = "";
+    Cpm cpm;
+
+    if (argc > 2 && strcmp(argv[1], "-d") == 0){
+        dir = argv[2];
+        first = 3;
+    }
+    if (first >= argc){
+        printf("usage: %s [-d dir] <program.com> [arguments...]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = first + 1; i < argc; i++){
+        if (i > first + 1)
+            strncat(tail, " ", sizeof(tail) - strlen(tail) - 1);
+        strncat(tail, argv[i], sizeof(tail) - strlen(tail) - 1);
+    }
+
+    uint8_t *memory = (uint8_t *)calloc(0x10000, 1);
+    State8080 *state = initState(memory);
+    cpmInit(&cpm, state, stdout, 0);
+    cpm.input = stdin;
+    cpm.dir = dir;
+    if (cpmLoad(&cpm, argv[first]) < 0){
+        printf("Cannot read %s\n", argv[first]);
+        exit(EXIT_FAILURE);
+    }
+    cpmSetArgs(&cpm, tail);
+
+    StopReason reason = cpmRun(&cpm, 0);
+    cpmFree(&cpm);
+
+    int status = 0;
+    if (reason == STOP_UNIMPLEMENTED){
+        printf("\nError: Unimplemented instruction %02x at $%04x\n", memory[state->pc], state->pc);
+        status = 1;
+    }
+
+    free(state);
+    free(memory);
+    return status;
+}
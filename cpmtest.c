@@ -0,0 +1,119 @@
+/*
+ * Run the CP/M CPU exercisers (cpudiag, TST8080, 8080PRE, 8080EXM, ...) to
+ * completion and report pass/fail with instruction and cycle counts, host time
+ * and MIPS. 8080EXM runs for billions of instructions, which makes it the main
+ * throughput benchmark.
+ *
+ * A test passes when it returns to CP/M without printing ERROR or FAIL.
+ *
+ * usage: cpmtest [-q] [-n instructions] <program.com> ...
+ *   -q  do not echo the programs' output
+ *   -n  give up on a program after this many instructions (default: no limit)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emulator.h"
+#include "cpm.h"
+
+typedef struct TestResult {
+    const char *name;
+    const char *result;
+    uint64_t   instructions;
+    uint64_t   cycles;
+    double     seconds;
+} TestResult;
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int runTest(const char *path, uint64_t limit, int quiet, TestResult *res){
+    uint8_t *memory = (uint8_t *)calloc(0x10000, 1);
+    State8080 *state = initState(memory);
+    Cpm cpm;
+    int passed = 0;
+
+    memset(res, 0, sizeof(TestResult));
+    res->name = path;
+
+    cpmInit(&cpm, state, quiet ? NULL : stdout, 1);
+    if (cpmLoad(&cpm, path) < 0){
+        res->result = "unreadable";
+        cpmFree(&cpm);
+        free(state);
+        free(memory);
+        return 0;
+    }
+
+    if (!quiet)
+        printf("--- %s\n", path);
+
+    double start = now();
+    StopReason reason = cpmRun(&cpm, limit);
+    res->seconds = now() - start;
+    res->instructions = cpm.instructions;
+    res->cycles = state->cycles;
+
+    if (!quiet && cpm.out_len && cpm.out[cpm.out_len - 1] != '\n')
+        printf("\n");
+
+    if (reason == STOP_UNIMPLEMENTED){
+        printf("%s: unimplemented instruction %02x at $%04x\n", path, memory[state->pc], state->pc);
+        res->result = "unimpl";
+    } else if (reason != STOP_EXIT){
+        res->result = stopReasonName(reason);
+    } else if (strstr(cpm.out, "ERROR") || strstr(cpm.out, "FAIL")){
+        res->result = "FAIL";
+    } else{
+        res->result = "pass";
+        passed = 1;
+    }
+
+    cpmFree(&cpm);
+    free(state);
+    free(memory);
+    return passed;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t limit = 0;
+    int quiet = 0;
+    int first = 1;
+
+    while (first < argc && argv[first][0] == '-'){
+        if (strcmp(argv[first], "-q") == 0)
+            quiet = 1;
+        else if (strcmp(argv[first], "-n") == 0 && first + 1 < argc)
+            limit = strtoull(argv[++first], NULL, 0);
+        else
+            break;
+        first++;
+    }
+    if (first >= argc){
+        printf("usage: %s [-q] [-n instructions] <program.com> ...\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    int count = argc - first;
+    int passed = 0;
+    TestResult *results = (TestResult *)calloc(count, sizeof(TestResult));
+
+    for (int i = 0; i < count; i++)
+        passed += runTest(argv[first + i], limit, quiet, &results[i]);
+
+    printf("\n%-24s %-8s %16s %16s %10s %8s\n", "test", "result", "instructions", "cycles", "seconds", "MIPS");
+    for (int i = 0; i < count; i++){
+        TestResult *res = &results[i];
+        printf("%-24s %-8s %16llu %16llu %10.3f %8.2f\n", res->name, res->result,
+               (unsigned long long)res->instructions, (unsigned long long)res->cycles,
+               res->seconds, res->seconds > 0 ? res->instructions / res->seconds / 1e6 : 0.0);
+    }
+    printf("%d of %d passed\n", passed, count);
+
+    free(results);
+    return passed == count ? 0 : 1;
+}
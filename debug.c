@@ -0,0 +1,511 @@
+#include "debug.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+// jumps, calls, returns, RST, PCHL and HLT: the last instruction of a block
+static const uint8_t ends_block[256] = {
+    [0x76] = 1,
+    [0xc0] = 1, [0xc2] = 1, [0xc3] = 1, [0xc4] = 1, [0xc7] = 1, [0xc8] = 1, [0xc9] = 1, [0xca] = 1,
+    [0xcb] = 1, [0xcc] = 1, [0xcd] = 1, [0xcf] = 1, [0xd0] = 1, [0xd2] = 1, [0xd4] = 1, [0xd7] = 1,
+    [0xd8] = 1, [0xd9] = 1, [0xda] = 1, [0xdc] = 1, [0xdd] = 1, [0xdf] = 1, [0xe0] = 1, [0xe2] = 1,
+    [0xe4] = 1, [0xe7] = 1, [0xe8] = 1, [0xe9] = 1, [0xea] = 1, [0xec] = 1, [0xed] = 1, [0xef] = 1,
+    [0xf0] = 1, [0xf2] = 1, [0xf4] = 1, [0xf7] = 1, [0xf8] = 1, [0xfa] = 1, [0xfc] = 1, [0xfd] = 1,
+    [0xff] = 1,
+};
+
+static inline int bit(const uint64_t *bits, uint16_t address){
+    return (bits[address >> 6] >> (address & 63)) & 1;
+}
+
+static inline void setBit(uint64_t *bits, uint16_t address){
+    bits[address >> 6] |= 1ULL << (address & 63);
+}
+
+static inline void clearBit(uint64_t *bits, uint16_t address){
+    bits[address >> 6] &= ~(1ULL << (address & 63));
+}
+
+/*
+ * Condition bytecode
+ */
+
+typedef enum DebugOp {
+    OP_CONST = 1,   // 16-bit operand, low byte first
+    OP_REGISTER,    // 8-bit operand: a DebugRegister
+    OP_BYTE,        // memory[pop]
+    OP_WORD,        // memory[pop] | memory[pop + 1] << 8
+    OP_NOT, OP_NEGATE, OP_COMPLEMENT,
+    // binary operators pop y, then x, and push x op y
+    OP_ADD, OP_SUB, OP_AND, OP_OR, OP_XOR,
+    OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE,
+    OP_LOGICAL_AND, OP_LOGICAL_OR,
+} DebugOp;
+
+typedef enum DebugRegister {
+    REG_A, REG_B, REG_C, REG_D, REG_E, REG_H, REG_L,
+    REG_SP, REG_PC, REG_BC, REG_DE, REG_HL,
+    REG_Z, REG_S, REG_P, REG_CY, REG_AC,
+} DebugRegister;
+
+static const char *register_names[] = {
+    "a", "b", "c", "d", "e", "h", "l", "sp", "pc", "bc", "de", "hl", "z", "s", "p", "cy", "ac",
+};
+
+typedef struct Compiler {
+    const char *s;
+    uint8_t    *code;
+    int        size;
+    int        length;
+    int        depth;       // of the evaluation stack when the code so far has run
+    const char *error;
+} Compiler;
+
+static void skipSpace(Compiler *c){
+    while (isspace((unsigned char)*c->s))
+        c->s++;
+}
+
+// consume `token` if it comes next (and is not the start of a longer operator)
+static int accept(Compiler *c, const char *token){
+    size_t n = strlen(token);
+
+    skipSpace(c);
+    if (strncmp(c->s, token, n) != 0)
+        return 0;
+    // "<" must not match "<=", nor "&" match "&&"
+    if (n == 1 && c->s[1] == '=' && strchr("<>!", *token))
+        return 0;
+    if (n == 1 && c->s[1] == *token && strchr("&|", *token))
+        return 0;
+    c->s += n;
+    return 1;
+}
+
+static void emit(Compiler *c, uint8_t byte){
+    if (c->length >= c->size){
+        c->error = "condition too long";
+        return;
+    }
+    c->code[c->length++] = byte;
+}
+
+// account for an instruction that pops `pops` values and pushes one
+static void emitOp(Compiler *c, uint8_t op, int pops){
+    emit(c, op);
+    c->depth += 1 - pops;
+    if (c->depth > DEBUG_MAX_DEPTH)
+        c->error = "condition nested too deeply";
+}
+
+static void parseOr(Compiler *c);
+
+static void parsePrimary(Compiler *c){
+    skipSpace(c);
+    if (c->error)
+        return;
+
+    if (accept(c, "(")){
+        parseOr(c);
+        if (!accept(c, ")"))
+            c->error = "missing )";
+        return;
+    }
+    if (accept(c, "w[")){
+        parseOr(c);
+        if (!accept(c, "]"))
+            c->error = "missing ]";
+        emitOp(c, OP_WORD, 1);
+        return;
+    }
+    if (accept(c, "[")){
+        parseOr(c);
+        if (!accept(c, "]"))
+            c->error = "missing ]";
+        emitOp(c, OP_BYTE, 1);
+        return;
+    }
+    if (isdigit((unsigned char)*c->s) || *c->s == '$'){
+        char *end;
+        unsigned long value = *c->s == '$' ? strtoul(c->s + 1, &end, 16) : strtoul(c->s, &end, 0);
+        if (value > 0xffff){
+            c->error = "number out of range";
+            return;
+        }
+        c->s = end;
+        emitOp(c, OP_CONST, 0);
+        emit(c, value & 0xff);
+        emit(c, value >> 8);
+        return;
+    }
+    if (isalpha((unsigned char)*c->s)){
+        char name[4];
+        int n = 0;
+        while (isalpha((unsigned char)c->s[n]) && n < 3){
+            name[n] = tolower((unsigned char)c->s[n]);
+            n++;
+        }
+        name[n] = 0;
+        if (!isalnum((unsigned char)c->s[n])){
+            for (uint8_t r = 0; r < sizeof(register_names) / sizeof(register_names[0]); r++){
+                if (strcmp(name, register_names[r]) == 0){
+                    c->s += n;
+                    emitOp(c, OP_REGISTER, 0);
+                    emit(c, r);
+                    return;
+                }
+            }
+        }
+        c->error = "unknown name";
+        return;
+    }
+    c->error = *c->s ? "unexpected character" : "unexpected end";
+}
+
+static void parseUnary(Compiler *c){
+    if (accept(c, "!")){
+        parseUnary(c);
+        emitOp(c, OP_NOT, 1);
+    } else if (accept(c, "-")){
+        parseUnary(c);
+        emitOp(c, OP_NEGATE, 1);
+    } else if (accept(c, "~")){
+        parseUnary(c);
+        emitOp(c, OP_COMPLEMENT, 1);
+    } else{
+        parsePrimary(c);
+    }
+}
+
+// one precedence level: operands from the next level, joined by any of `tokens`
+typedef struct Level {
+    const char *tokens[4];
+    uint8_t    ops[4];
+} Level;
+
+static const Level levels[] = {
+    {{"||"}, {OP_LOGICAL_OR}},
+    {{"&&"}, {OP_LOGICAL_AND}},
+    {{"==", "!="}, {OP_EQ, OP_NE}},
+    {{"<=", ">=", "<", ">"}, {OP_LE, OP_GE, OP_LT, OP_GT}},
+    {{"|"}, {OP_OR}},
+    {{"^"}, {OP_XOR}},
+    {{"&"}, {OP_AND}},
+    {{"+", "-"}, {OP_ADD, OP_SUB}},
+};
+#define LEVELS  ((int)(sizeof(levels) / sizeof(levels[0])))
+
+static void parseLevel(Compiler *c, int level){
+    if (level == LEVELS){
+        parseUnary(c);
+        return;
+    }
+    parseLevel(c, level + 1);
+    while (!c->error){
+        int found = -1;
+        for (int t = 0; t < 4 && levels[level].tokens[t] && found < 0; t++)
+            if (accept(c, levels[level].tokens[t]))
+                found = t;
+        if (found < 0)
+            return;
+        parseLevel(c, level + 1);
+        emitOp(c, levels[level].ops[found], 2);
+    }
+}
+
+static void parseOr(Compiler *c){
+    parseLevel(c, 0);
+}
+
+int debugCompile(const char *expr, uint8_t *code, int size, const char **error){
+    Compiler c = {expr, code, size, 0, 0, NULL};
+
+    parseOr(&c);
+    skipSpace(&c);
+    if (!c.error && *c.s)
+        c.error = "unexpected text after the expression";
+    if (c.error){
+        *error = c.error;
+        return -1;
+    }
+    return c.length;
+}
+
+static uint32_t registerValue(const State8080 *state, uint8_t r){
+    switch (r){
+        case REG_A:     return state->a;
+        case REG_B:     return state->b;
+        case REG_C:     return state->c;
+        case REG_D:     return state->d;
+        case REG_E:     return state->e;
+        case REG_H:     return state->h;
+        case REG_L:     return state->l;
+        case REG_SP:    return state->sp;
+        case REG_PC:    return state->pc;
+        case REG_BC:    return state->b << 8 | state->c;
+        case REG_DE:    return state->d << 8 | state->e;
+        case REG_HL:    return state->h << 8 | state->l;
+        case REG_Z:     return state->cc.z;
+        case REG_S:     return state->cc.s;
+        case REG_P:     return state->cc.p;
+        case REG_CY:    return state->cc.cy;
+        case REG_AC:    return state->cc.ac;
+    }
+    return 0;
+}
+
+uint32_t debugEval(const uint8_t *code, int length, const State8080 *state){
+    uint32_t stack[DEBUG_MAX_DEPTH];
+    int top = -1;
+
+    // debugCompile checked the depth, so the stack cannot overflow
+    for (int i = 0; i < length; i++){
+        uint32_t y;
+
+        switch (code[i]){
+            case OP_CONST:          stack[++top] = code[i + 1] | code[i + 2] << 8; i += 2; continue;
+            case OP_REGISTER:       stack[++top] = registerValue(state, code[++i]); continue;
+            case OP_BYTE:           stack[top] = state->memory[stack[top] & 0xffff]; continue;
+            case OP_WORD:           stack[top] = state->memory[stack[top] & 0xffff] |
+                                                 state->memory[(stack[top] + 1) & 0xffff] << 8; continue;
+            case OP_NOT:            stack[top] = !stack[top]; continue;
+            case OP_NEGATE:         stack[top] = -stack[top]; continue;
+            case OP_COMPLEMENT:     stack[top] = ~stack[top]; continue;
+        }
+
+        y = stack[top--];
+        switch (code[i]){
+            case OP_ADD:            stack[top] += y; break;
+            case OP_SUB:            stack[top] -= y; break;
+            case OP_AND:            stack[top] &= y; break;
+            case OP_OR:             stack[top] |= y; break;
+            case OP_XOR:            stack[top] ^= y; break;
+            case OP_EQ:             stack[top] = stack[top] == y; break;
+            case OP_NE:             stack[top] = stack[top] != y; break;
+            case OP_LT:             stack[top] = stack[top] < y; break;
+            case OP_LE:             stack[top] = stack[top] <= y; break;
+            case OP_GT:             stack[top] = stack[top] > y; break;
+            case OP_GE:             stack[top] = stack[top] >= y; break;
+            case OP_LOGICAL_AND:    stack[top] = stack[top] && y; break;
+            case OP_LOGICAL_OR:     stack[top] = stack[top] || y; break;
+        }
+    }
+    return top >= 0 ? stack[top] : 0;
+}
+
+/*
+ * Breakpoints
+ */
+
+Debugger *debugCreate(Machine *m){
+    Debugger *d = (Debugger *)calloc(1, sizeof(Debugger));
+    d->m = m;
+    return d;
+}
+
+void debugFree(Debugger *d){
+    if (!d)
+        return;
+#ifdef WATCH
+    if (d->m->state->watch == d->watch_pages)
+        d->m->state->watch = NULL;
+#endif
+    free(d->conditions);
+    free(d);
+}
+
+int debugBreak(Debugger *d, uint16_t address, const char *condition){
+    if (condition){
+        DebugCondition cond = {address, 0, {0}};
+        int length = debugCompile(condition, cond.code, DEBUG_MAX_CODE, &d->error);
+        if (length < 0)
+            return -1;
+        cond.length = length;
+        d->conditions = (DebugCondition *)realloc(d->conditions, (d->condition_count + 1) * sizeof(DebugCondition));
+        d->conditions[d->condition_count++] = cond;
+    } else{
+        setBit(d->unconditional, address);
+    }
+
+    if (!bit(d->breakpoints, address))
+        d->breakpoint_count++;
+    setBit(d->breakpoints, address);
+    memset(d->clean, 0, sizeof(d->clean));
+    return 0;
+}
+
+void debugClear(Debugger *d, uint16_t address){
+    uint32_t kept = 0;
+
+    if (!bit(d->breakpoints, address))
+        return;
+    for (uint32_t i = 0; i < d->condition_count; i++)
+        if (d->conditions[i].address != address)
+            d->conditions[kept++] = d->conditions[i];
+    d->condition_count = kept;
+    clearBit(d->breakpoints, address);
+    clearBit(d->unconditional, address);
+    d->breakpoint_count--;
+    // blocks only become dirty when breakpoints are added, so `clean` stays right
+}
+
+int debugAtBreakpoint(Debugger *d, const State8080 *state){
+    uint16_t pc = state->pc;
+
+    if (!bit(d->breakpoints, pc))
+        return 0;
+    if (bit(d->unconditional, pc))
+        return 1;
+    for (uint32_t i = 0; i < d->condition_count; i++)
+        if (d->conditions[i].address == pc && debugEval(d->conditions[i].code, d->conditions[i].length, state))
+            return 1;
+    return 0;
+}
+
+// does the straight-line run from pc to the end of its block have a breakpoint?
+static int blockHasBreakpoint(Debugger *d, uint16_t pc){
+    const uint8_t *memory = d->m->state->memory;
+    uint16_t rom_size = d->m->rom_size;
+    uint16_t address = pc;
+
+    if (pc < rom_size && bit(d->clean, pc))
+        return 0;
+    for (uint32_t n = 0; n < 0x10000; n++){
+        uint8_t opcode = memory[address];
+        if (bit(d->breakpoints, address))
+            return 1;
+        if (ends_block[opcode])
+            break;
+        address += length8080[opcode];
+    }
+    // RAM can be rewritten under us, so only ROM blocks are remembered
+    if (pc < rom_size && address < rom_size)
+        setBit(d->clean, pc);
+    return 0;
+}
+
+/*
+ * Watchpoints
+ */
+
+#ifdef WATCH
+static void watchHit(void *ctx, State8080 *state, uint16_t address, uint8_t value, int kind){
+    Debugger *d = (Debugger *)ctx;
+
+    // the page is watched, but maybe not this address; the first hit of an instruction wins
+    if (d->hit != DEBUG_NONE)
+        return;
+    for (uint32_t i = 0; i < d->watch_count; i++){
+        const DebugWatch *w = &d->watches[i];
+        if ((w->kind & kind) && address >= w->start && address <= w->end){
+            d->hit = DEBUG_WATCH;
+            d->hit_pc = d->pc;
+            d->hit_address = address;
+            d->hit_value = value;
+            d->hit_kind = kind;
+            state->stop = STOP_BREAK;
+            return;
+        }
+    }
+}
+#endif
+
+// rebuild the page flags from the watch list
+static void flagPages(Debugger *d){
+    memset(d->watch_pages, 0, sizeof(d->watch_pages));
+    for (uint32_t i = 0; i < d->watch_count; i++)
+        for (uint32_t page = d->watches[i].start >> MEMORY_PAGE_SHIFT;
+             page <= (uint32_t)(d->watches[i].end >> MEMORY_PAGE_SHIFT); page++)
+            d->watch_pages[page] |= d->watches[i].kind;
+}
+
+int debugWatch(Debugger *d, uint16_t start, uint16_t end, int kind){
+#ifdef WATCH
+    State8080 *state = d->m->state;
+
+    if (d->watch_count >= DEBUG_MAX_WATCHES || end < start || !(kind & (WATCH_READ | WATCH_WRITE)))
+        return -1;
+    d->watches[d->watch_count++] = (DebugWatch){start, end, kind & (WATCH_READ | WATCH_WRITE)};
+    flagPages(d);
+    state->watch = d->watch_pages;
+    state->watch_hook = watchHit;
+    state->watch_ctx = d;
+    return 0;
+#else
+    (void)d;
+    (void)start;
+    (void)end;
+    (void)kind;
+    return -1;
+#endif
+}
+
+void debugUnwatch(Debugger *d, uint16_t start, uint16_t end){
+    uint32_t kept = 0;
+
+    for (uint32_t i = 0; i < d->watch_count; i++)
+        if (d->watches[i].start != start || d->watches[i].end != end)
+            d->watches[kept++] = d->watches[i];
+    d->watch_count = kept;
+    flagPages(d);
+}
+
+/*
+ * Running
+ */
+
+StopReason debugRun(Debugger *d, uint64_t max_instructions, uint64_t max_cycles, uint64_t max_frames){
+    Machine *m = d->m;
+    State8080 *state = m->state;
+    // resuming from a breakpoint at PC: run that instruction before testing again
+    int first = state->stop == STOP_BREAK && d->hit == DEBUG_BREAKPOINT && d->hit_pc == state->pc;
+
+    d->hit = DEBUG_NONE;
+    if (!d->breakpoint_count && !d->watch_count)
+        return machineRun(m, max_instructions, max_cycles, max_frames);
+
+    uint64_t end_instructions = max_instructions ? m->instructions + max_instructions : UINT64_MAX;
+    uint64_t end_cycles = max_cycles ? state->cycles + max_cycles : UINT64_MAX;
+    uint64_t end_frames = max_frames ? m->frames + max_frames : UINT64_MAX;
+    int exact = blockHasBreakpoint(d, state->pc);
+
+    if (state->stop == STOP_LIMIT || state->stop == STOP_BREAK)
+        state->stop = STOP_NONE;
+
+    while (!state->stop){
+        uint16_t pc = state->pc;
+        uint8_t opcode = state->memory[pc];
+
+        if (exact && !first && debugAtBreakpoint(d, state)){
+            d->hit = DEBUG_BREAKPOINT;
+            d->hit_pc = pc;
+            state->stop = STOP_BREAK;
+            break;
+        }
+        first = 0;
+        d->pc = pc;
+
+        Emulate8080Op(state);
+        if (state->stop){
+            if (state->stop == STOP_HALT)
+                m->instructions++;
+            // a watchpoint: the instruction has run, so finish it like machineRun does
+            if (state->stop == STOP_BREAK){
+                m->instructions++;
+                machineInterrupts(m);
+            }
+            break;
+        }
+        m->instructions++;
+
+        // a block boundary: check the next block once instead of every instruction in it
+        if ((machineInterrupts(m) | ends_block[opcode]) != 0){
+            d->blocks++;
+            exact = d->breakpoint_count && blockHasBreakpoint(d, state->pc);
+        }
+
+        if (m->instructions >= end_instructions || state->cycles >= end_cycles || m->frames >= end_frames)
+            state->stop = STOP_LIMIT;
+    }
+    return (StopReason)state->stop;
+}
@@ -0,0 +1,117 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+#include <stdint.h>
+#include "emulator.h"
+#include "machine.h"
+
+/*
+ * Breakpoints and watchpoints.
+ *
+ * PC breakpoints are a 64K-bit bitmap. debugRun does not test it on every
+ * instruction: at each block boundary (after a jump, call, return, RST,
+ * PCHL or interrupt) it checks whether the straight-line run from PC up to
+ * the next branch has a breakpoint, and only then tests instruction by
+ * instruction until the block ends. Blocks in ROM are remembered once they
+ * are known to be clean.
+ *
+ * A breakpoint can have conditions, e.g. "a == 0x10 && [0x20f8] >= 5".
+ * They are compiled to a small stack bytecode when they are set, and the
+ * breakpoint stops only if one of them holds. Expressions use C operators,
+ * except that &, ^ and | bind tighter than comparisons, so "a & 1 == 0"
+ * means what it says. They can name registers (a b c d e h l sp pc bc de hl),
+ * flags (z s p cy ac) and memory: [x] is a byte and w[x] a little-endian
+ * word.
+ *
+ * Watchpoints stop after an instruction that reads or writes an address
+ * range. They need a build with -DWATCH. That build flags the watched
+ * 256-byte pages, and the core's load and store paths test the flag, so
+ * only accesses to watched pages do any more work. Without the flag the
+ * core is unchanged and debugWatch fails.
+ *
+ * With no breakpoints or watchpoints, debugRun is machineRun.
+ */
+
+#define DEBUG_MAX_CODE      64      // bytecode bytes per condition
+#define DEBUG_MAX_DEPTH     16      // evaluation stack
+#define DEBUG_MAX_WATCHES   64
+
+typedef enum DebugHit {
+    DEBUG_NONE = 0,
+    DEBUG_BREAKPOINT,
+    DEBUG_WATCH,
+} DebugHit;
+
+typedef struct DebugCondition {
+    uint16_t   address;
+    uint8_t    length;
+    uint8_t    code[DEBUG_MAX_CODE];
+} DebugCondition;
+
+typedef struct DebugWatch {
+    uint16_t   start;
+    uint16_t   end;             // inclusive
+    uint8_t    kind;            // WATCH_READ | WATCH_WRITE
+} DebugWatch;
+
+typedef struct Debugger {
+    Machine    *m;
+    uint64_t   breakpoints[0x10000 / 64];   // any breakpoint at this address
+    uint64_t   unconditional[0x10000 / 64]; // one without a condition
+    uint64_t   clean[0x10000 / 64];         // ROM blocks starting here have no breakpoint
+    uint32_t   breakpoint_count;
+    DebugCondition *conditions;
+    uint32_t   condition_count;
+    DebugWatch watches[DEBUG_MAX_WATCHES];
+    uint32_t   watch_count;
+    uint8_t    watch_pages[MEMORY_PAGES];   // WATCH_READ/WATCH_WRITE per page
+    const char *error;          // why the last condition did not compile
+    // the last stop
+    DebugHit   hit;
+    uint16_t   hit_pc;          // the breakpoint, or the instruction that touched a watched address
+    uint16_t   hit_address;     // watchpoints: the address, the value read or written, and which
+    uint8_t    hit_value;
+    uint8_t    hit_kind;
+    uint16_t   pc;              // the instruction running now
+    uint64_t   blocks;          // block boundaries checked
+} Debugger;
+
+Debugger *debugCreate(Machine *m);
+void debugFree(Debugger *d);
+
+/*
+ * Stop before the instruction at `address`
+ * @param condition Expression that has to be true, NULL to always stop
+ * @return 0, or -1 if the condition does not compile (d->error says why)
+ */
+int debugBreak(Debugger *d, uint16_t address, const char *condition);
+
+// remove every breakpoint at `address`, conditional or not
+void debugClear(Debugger *d, uint16_t address);
+
+/*
+ * Stop after an instruction that accesses start..end (inclusive)
+ * @param kind WATCH_READ, WATCH_WRITE or both
+ * @return 0, or -1 if the table is full or the build has no -DWATCH
+ */
+int debugWatch(Debugger *d, uint16_t start, uint16_t end, int kind);
+void debugUnwatch(Debugger *d, uint16_t start, uint16_t end);
+
+/*
+ * Compile an expression to bytecode
+ * @return its length, or -1 with *error set
+ */
+int debugCompile(const char *expr, uint8_t *code, int size, const char **error);
+uint32_t debugEval(const uint8_t *code, int length, const State8080 *state);
+
+/*
+ * Run like machineRun until a limit, a stop, or a breakpoint or watchpoint.
+ * A run that resumes from a breakpoint stop runs that instruction first; any
+ * other run, including one that continues after a limit, stops on it.
+ * @return STOP_BREAK on a hit, with d->hit and the hit_ fields set
+ */
+StopReason debugRun(Debugger *d, uint64_t max_instructions, uint64_t max_cycles, uint64_t max_frames);
+
+// for the stepping run loop: is there a breakpoint at PC that should stop?
+int debugAtBreakpoint(Debugger *d, const State8080 *state);
+
+#endif
@@ -1,7 +1,11 @@
 #ifndef DISASSEMBLER_H
 #define DISASSEMBLER_H
 
+#include <stdio.h>
+
 int Disassemble8080Op(unsigned char *codebuffer, int pc);
+int Disassemble8080OpTo(FILE *out, unsigned char *codebuffer, int pc);
+int Disassemble8080Mnemonic(FILE *out, unsigned char *code);
 
 #endif
 
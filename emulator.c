@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 /*
 What the memory looks like:
@@ -13,6 +14,53 @@ address (16 bits)   content (8 bits)
     0x0004    | 0000 0000 |
 */
 
+/*
+Clock states per opcode, from the data book.
+Conditional CALL/RET are listed with their not-taken cost;
+taking the branch costs 6 more states (CALL 11/17, RET 5/11).
+*/
+const uint8_t cycles8080[256] = {
+    4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5,  7,  4,   // 0x00
+    4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5,  7,  4,   // 0x10
+    4, 10, 16,  5,  5,  5,  7,  4,  4, 10, 16,  5,  5,  5,  7,  4,   // 0x20
+    4, 10, 13,  5, 10, 10, 10,  4,  4, 10, 13,  5,  5,  5,  7,  4,   // 0x30
+    5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,   // 0x40
+    5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,   // 0x50
+    5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,   // 0x60
+    7,  7,  7,  7,  7,  7,  7,  7,  5,  5,  5,  5,  5,  5,  7,  5,   // 0x70
+    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,   // 0x80
+    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,   // 0x90
+    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,   // 0xa0
+    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,   // 0xb0
+    5, 10, 10, 10, 11, 11,  7, 11,  5, 10, 10, 10, 11, 17,  7, 11,   // 0xc0
+    5, 10, 10, 10, 11, 11,  7, 11,  5, 10, 10, 10, 11, 17,  7, 11,   // 0xd0
+    5, 10, 10, 18, 11, 11,  7, 11,  5,  5, 10,  4, 11, 17,  7, 11,   // 0xe0
+    5, 10, 10,  4, 11, 11,  7, 11,  5,  5, 10,  4, 11, 17,  7, 11,   // 0xf0
+};
+
+/*
+Instruction lengths as this core decodes them, which is how far PC moves
+when nothing jumps. CMP r/M take two bytes here, unlike the data book.
+*/
+const uint8_t length8080[256] = {
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1,
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2,
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 3, 3, 3, 2, 1,
+    1, 1, 3, 2, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1,
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1,
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1,
+};
+
 uint8_t parity(uint8_t data){
     // 0 if odd, 1 if even
     // the built-in function returns 1 for odd parity,
@@ -20,14 +68,102 @@ uint8_t parity(uint8_t data){
     return (__builtin_parity(data) ? 0 : 1);
 }
 
+const char *stopReasonName(uint32_t reason){
+    switch (reason){
+        case STOP_NONE:             return "running";
+        case STOP_LIMIT:            return "limit";
+        case STOP_UNIMPLEMENTED:    return "unimplemented";
+        case STOP_HALT:             return "halt";
+        case STOP_EXIT:             return "exit";
+        case STOP_BREAK:            return "break";
+        default:                    return "unknown";
+    }
+}
+
+State8080* initState(uint8_t* memory){
+    State8080 *state = (State8080 *)malloc(sizeof(State8080));
+    resetState(state, memory);
+
+    return state;
+}
+
+void resetState(State8080* state, uint8_t* memory){
+    memset(state, 0, sizeof(State8080));
+    state->sp = 0x2000;
+    state->memory = memory;
+}
+
+uint64_t memoryHash(const uint8_t *memory){
+    uint64_t hash = 0;
+
+    for (uint32_t address = 0; address < 0x10000; address++)
+        hash ^= memoryHashKey(address, memory[address]);
+    return hash;
+}
+
+void syncMemoryHash(State8080 *state){
+#ifdef STATEHASH
+    if (!state->memory_hash_valid){
+        state->memory_hash = memoryHash(state->memory);
+        state->memory_hash_valid = 1;
+    }
+#else
+    (void)state;
+#endif
+}
+
+// splitmix64's finalizer, for the registers packed into words
+static uint64_t mixRegisters(uint64_t x){
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+uint64_t stateFingerprint(State8080 *state){
+    uint64_t registers = (uint64_t)state->a | (uint64_t)state->b << 8 | (uint64_t)state->c << 16 |
+        (uint64_t)state->d << 24 | (uint64_t)state->e << 32 | (uint64_t)state->h << 40 |
+        (uint64_t)state->l << 48 | (uint64_t)state->int_enable << 56;
+    uint64_t pointers = (uint64_t)state->sp | (uint64_t)state->pc << 16 |
+        (uint64_t)state->cc.z << 32 | (uint64_t)state->cc.s << 33 | (uint64_t)state->cc.p << 34 |
+        (uint64_t)state->cc.cy << 35 | (uint64_t)state->cc.ac << 36;
+    uint64_t memory;
+
+#ifdef STATEHASH
+    syncMemoryHash(state);
+    memory = state->memory_hash;
+#else
+    memory = memoryHash(state->memory);
+#endif
+    return memory ^ mixRegisters(registers) ^ mixRegisters(~pointers);
+}
+
 void UnimplementedInstruction(State8080* state) {
-    //pc will have advanced one, so exit
-    printf ("Error: Unimplemented instruction %02x\n", state->memory[state->pc]);
-    exit(1);
+    //pc will have advanced one, so point it back at the opcode
+    //and leave it to the run loop to report and stop
+    state->pc--;
+    state->cycles -= cycles8080[state->memory[state->pc]];
+    state->stop = STOP_UNIMPLEMENTED;
+}
+
+/*
+ * Deliver an interrupt: the device puts RST <interrupt_num> on the bus,
+ * so PC is pushed and execution continues at 8 * interrupt_num.
+ * Interrupts stay disabled until the handler executes EI.
+ */
+void GenerateInterrupt(State8080* state, int interrupt_num) {
+    writeMemory(state, state->sp-1, (state->pc >> 8) & 0xff);
+    writeMemory(state, state->sp-2, (state->pc & 0xff));
+    state->sp = state->sp - 2;
+    state->pc = 8 * interrupt_num;
+    state->int_enable = 0;
+    state->cycles += cycles8080[0xc7];
 }
 
 void Emulate8080Op(State8080* state) {
     unsigned char *opcode = &state->memory[state->pc];
+    state->cycles += cycles8080[*opcode];
     state->pc+=1;  // default
 
     switch(*opcode) {
@@ -237,7 +373,7 @@ void Emulate8080Op(State8080* state) {
         case 0x1a:  // LDAX D (no flags affected)
                    {
                        uint16_t address = (state->d<<8) | (state->e);
-                       state->a = state->memory[address];
+                       state->a = readMemory(state, address);
 
                        break;
                    }
@@ -429,7 +565,7 @@ void Emulate8080Op(State8080* state) {
         case 0x32:  // STA add
                    {
                        uint16_t address = (opcode[2]<<8) | opcode[1];
-                       state->memory[address] = state->a;
+                       writeMemory(state, address, state->a);
                        state->pc += 2;
 
                        break;
@@ -445,12 +581,12 @@ void Emulate8080Op(State8080* state) {
         case 0x34:  // INR M
                    {
                        uint16_t offset = (state->h<<8) | (state->l);
-                       uint8_t answer = state->memory[offset] + 1;
+                       uint8_t answer = readMemory(state, offset) + 1;
                        state->cc.z = ((answer & 0xff) == 0);
                        state->cc.s = ((answer & 0x80) != 0);
                        state->cc.p = parity(answer);
                        state->cc.ac = (answer & 0xf) < (state->memory[offset] & 0xf);
-                       state->memory[offset] = answer;
+                       writeMemory(state, offset, answer);
 
                        break;
                    }
@@ -458,12 +594,12 @@ void Emulate8080Op(State8080* state) {
         case 0x35:  // DCR M
                    {
                        uint16_t offset = (state->h<<8) | (state->l);
-                       uint8_t answer = state->memory[offset] - 1;
+                       uint8_t answer = readMemory(state, offset) - 1;
                        state->cc.z = ((answer & 0xff) == 0);
                        state->cc.s = ((answer & 0x80) != 0);
                        state->cc.p = parity(answer);
                        state->cc.ac = (answer & 0xf) > (state->memory[offset] & 0xf);
-                       state->memory[offset] = answer;
+                       writeMemory(state, offset, answer);
 
                        break;
                    }
@@ -471,7 +607,7 @@ void Emulate8080Op(State8080* state) {
         case 0x36:  // MVI M, D8
                    {
                        uint16_t address = (state->h<<8) | (state->l);
-                       state->memory[address] = opcode[1];
+                       writeMemory(state, address, opcode[1]);
                        state->pc++;
 
                        break;
@@ -497,7 +633,7 @@ void Emulate8080Op(State8080* state) {
         case 0x3a:  // LDA addr (no flags affected)
                    {
                        uint16_t address = (opcode[2]<<8) | opcode[1];
-                       state->a = state->memory[address];
+                       state->a = readMemory(state, address);
                        state->pc += 2;
 
                        break;
@@ -571,7 +707,7 @@ void Emulate8080Op(State8080* state) {
         case 0x56:  // MOV D, M
                    {
                        uint16_t address = (state->h<<8) | state->l;
-                       state->d = state->memory[address];
+                       state->d = readMemory(state, address);
 
                        break;
                    }
@@ -585,7 +721,7 @@ void Emulate8080Op(State8080* state) {
         case 0x5e:  // MOV E, M
                    {
                        uint16_t address = (state->h<<8) | state->l;
-                       state->e = state->memory[address];
+                       state->e = readMemory(state, address);
 
                        break;
                    }
@@ -600,7 +736,7 @@ void Emulate8080Op(State8080* state) {
         case 0x66:  // MOV H, M
                    {
                        uint16_t address = (state->h<<8) | state->l;
-                       state->h = state->memory[address];
+                       state->h = readMemory(state, address);
 
                        break;
                    }
@@ -625,11 +761,11 @@ void Emulate8080Op(State8080* state) {
         case 0x73: UnimplementedInstruction(state); break;
         case 0x74: UnimplementedInstruction(state); break;
         case 0x75: UnimplementedInstruction(state); break;
-        case 0x76: UnimplementedInstruction(state); break;  // HLT - what to do? exit?
+        case 0x76: state->stop = STOP_HALT; break;   // HLT: the run loop decides whether to wait for an interrupt
         case 0x77:  // MOV M, A
                    {
                        uint16_t address = (state->h<<8) | state->l;
-                       state->memory[address] = state->a;
+                       writeMemory(state, address, state->a);
 
                        break;
                    }
@@ -658,7 +794,7 @@ void Emulate8080Op(State8080* state) {
         case 0x7e:  // MOV A, M
                    {
                        uint16_t address = (state->h<<8) | state->l;
-                       state->a = state->memory[address];
+                       state->a = readMemory(state, address);
 
                        break;
                    }
@@ -739,7 +875,7 @@ void Emulate8080Op(State8080* state) {
         case 0x86:  // ADD M
                    {
                        uint16_t offset = (state->h<<8) | (state->l);
-                       uint16_t answer = (uint16_t) state->a + state->memory[offset];
+                       uint16_t answer = (uint16_t) state->a + readMemory(state, offset);
                        state->cc.z = ((answer & 0xff) == 0);
                        state->cc.s = ((answer & 0x80) != 0);
                        state->cc.cy = (answer > 0xff);
@@ -836,7 +972,7 @@ void Emulate8080Op(State8080* state) {
         case 0x8e:  // ADC M
                    {
                        uint16_t offset = (state->h<<8) | (state->l);
-                       uint16_t answer = (uint16_t) state->a + state->memory[offset] + (uint16_t) state->cc.cy;
+                       uint16_t answer = (uint16_t) state->a + readMemory(state, offset) + (uint16_t) state->cc.cy;
                        state->cc.z = ((answer & 0xff) == 0);
                        state->cc.s = ((answer & 0x80) != 0);
                        state->cc.cy = (answer > 0xff);
@@ -933,7 +1069,7 @@ void Emulate8080Op(State8080* state) {
         case 0x96:  // SUB M
                    {
                        uint16_t offset = (state->h<<8) | (state->l);
-                       uint16_t answer = (uint16_t) state->a - state->memory[offset];
+                       uint16_t answer = (uint16_t) state->a - readMemory(state, offset);
                        state->cc.z = ((answer & 0xff) == 0);
                        state->cc.s = ((answer & 0x80) != 0);
                        state->cc.cy = (answer > 0xff);
@@ -1030,7 +1166,7 @@ void Emulate8080Op(State8080* state) {
         case 0x9e:  // SBB M
                    {
                        uint16_t offset = (state->h<<8) | (state->l);
-                       uint16_t answer = (uint16_t) state->a - state->memory[offset] - (uint16_t) state->cc.cy;
+                       uint16_t answer = (uint16_t) state->a - readMemory(state, offset) - (uint16_t) state->cc.cy;
                        state->cc.z = ((answer & 0xff) == 0);
                        state->cc.s = ((answer & 0x80) != 0);
                        state->cc.cy = (answer > 0xff);
@@ -1122,7 +1258,7 @@ void Emulate8080Op(State8080* state) {
         case 0xa6:  // ANA M
                    {    
                        uint16_t offset = (state->h<<8) | (state->l);
-                       uint8_t m = state->memory[offset];
+                       uint8_t m = readMemory(state, offset);
                        uint8_t x = state->a & m;    
                        state->cc.z = (x == 0);    
                        state->cc.s = (0x80 == (x & 0x80));    
@@ -1212,7 +1348,7 @@ void Emulate8080Op(State8080* state) {
         case 0xae:  // XRA M
                    {    
                        uint16_t offset = (state->h<<8) | (state->l);
-                       uint8_t m = state->memory[offset];
+                       uint8_t m = readMemory(state, offset);
                        uint8_t x = state->a & m;  
                        state->cc.z = (x == 0);    
                        state->cc.s = (0x80 == (x & 0x80));    
@@ -1302,7 +1438,7 @@ void Emulate8080Op(State8080* state) {
         case 0xb6:  // ORA M
                    {    
                        uint16_t offset = (state->h<<8) | (state->l);
-                       uint8_t m = state->memory[offset];
+                       uint8_t m = readMemory(state, offset);
                        uint8_t x = state->a | m;  
                        state->cc.z = (x == 0);    
                        state->cc.s = (0x80 == (x & 0x80));    
@@ -1398,7 +1534,7 @@ void Emulate8080Op(State8080* state) {
         case 0xbe:  //CMP M    
                    {    
                        uint16_t offset = (state->h<<8) | (state->l);
-                       uint16_t x = state->a - state->memory[offset];;    
+                       uint16_t x = state->a - readMemory(state, offset);;    
                        state->cc.z = (x == 0);    
                        state->cc.s = (0x80 == (x & 0x80));    
                        //It isn't clear in the data book what to do with p - had to pick    
@@ -1421,16 +1557,17 @@ void Emulate8080Op(State8080* state) {
         case 0xc0:  // RNZ
                    {
                        if (!state->cc.z){
-                           state->pc = state->memory[state->sp] | (state->memory[state->sp+1] << 8);    
+                           state->pc = readMemory(state, state->sp) | (readMemory(state, state->sp+1) << 8);    
                            state->sp += 2;   
+                           state->cycles += 6;
                        }
 
                        break;
                    }
         case 0xc1: // POP stack to BC register pair
                    {
-                       state->c = state->memory[state->sp];
-                       state->b = state->memory[state->sp+1];
+                       state->c = readMemory(state, state->sp);
+                       state->b = readMemory(state, state->sp+1);
                        state->sp += 2;
 
                        break;
@@ -1458,8 +1595,9 @@ void Emulate8080Op(State8080* state) {
                    {
                        if (!state->cc.z){
                            uint16_t ret = state->pc+2;
-                           state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                           state->memory[state->sp-2] = (ret & 0xff);    
+                           state->cycles += 6;
+                           writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                           writeMemory(state, state->sp-2, (ret & 0xff));    
                            state->sp = state->sp - 2;    
                            state->pc = (opcode[2] << 8) | opcode[1]; 
                        }
@@ -1470,8 +1608,8 @@ void Emulate8080Op(State8080* state) {
                    }
         case 0xc5: // PUSH BC register pair to stack
                    {
-                       state->memory[state->sp-1] = state->b;
-                       state->memory[state->sp-2] = state->c;
+                       writeMemory(state, state->sp-1, state->b);
+                       writeMemory(state, state->sp-2, state->c);
                        state->sp = state->sp-2;
 
                        break;
@@ -1491,8 +1629,8 @@ void Emulate8080Op(State8080* state) {
         case 0xc7:  // RST 0
                    {
                        uint16_t ret = state->pc+2;
-                       state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                       state->memory[state->sp-2] = (ret & 0xff);    
+                       writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                       writeMemory(state, state->sp-2, (ret & 0xff));    
                        state->sp = state->sp - 2;    
                        state->pc = 0; 
 
@@ -1501,15 +1639,16 @@ void Emulate8080Op(State8080* state) {
         case 0xc8:  // RZ
                    {
                        if (state->cc.z){
-                           state->pc = state->memory[state->sp] | (state->memory[state->sp+1] << 8);    
+                           state->pc = readMemory(state, state->sp) | (readMemory(state, state->sp+1) << 8);    
                            state->sp += 2;   
+                           state->cycles += 6;
                        }
 
                        break;
                    }
         case 0xc9:  // RET
                    {
-                       state->pc = state->memory[state->sp] | (state->memory[state->sp+1] << 8);    
+                       state->pc = readMemory(state, state->sp) | (readMemory(state, state->sp+1) << 8);    
                        state->sp += 2;    
 
                        break;
@@ -1529,8 +1668,9 @@ void Emulate8080Op(State8080* state) {
                    {
                        if (state->cc.z){
                            uint16_t ret = state->pc+2;
-                           state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                           state->memory[state->sp-2] = (ret & 0xff);    
+                           state->cycles += 6;
+                           writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                           writeMemory(state, state->sp-2, (ret & 0xff));    
                            state->sp = state->sp - 2;    
                            state->pc = (opcode[2] << 8) | opcode[1]; 
                        }
@@ -1547,8 +1687,8 @@ void Emulate8080Op(State8080* state) {
                        // addr - 1     | high 8 bits |
                        // addr         |             | < -- SP
                        uint16_t ret = state->pc+2;
-                       state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                       state->memory[state->sp-2] = (ret & 0xff);    
+                       writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                       writeMemory(state, state->sp-2, (ret & 0xff));    
                        state->sp = state->sp - 2;  // why we do this? Assembly Lanuage Program Manual, Stack Operation section says so
                        state->pc = (opcode[2] << 8) | opcode[1]; 
 
@@ -1569,8 +1709,8 @@ void Emulate8080Op(State8080* state) {
         case 0xcf:  // RST 1
                    {
                        uint16_t ret = state->pc+2;
-                       state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                       state->memory[state->sp-2] = (ret & 0xff);    
+                       writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                       writeMemory(state, state->sp-2, (ret & 0xff));    
                        state->sp = state->sp - 2;    
                        state->pc = 8; // to addr $8
 
@@ -1579,16 +1719,17 @@ void Emulate8080Op(State8080* state) {
         case 0xd0:  // RNC
                    {
                        if (!state->cc.cy){
-                           state->pc = state->memory[state->sp] | (state->memory[state->sp+1] << 8);    
+                           state->pc = readMemory(state, state->sp) | (readMemory(state, state->sp+1) << 8);    
                            state->sp += 2;   
+                           state->cycles += 6;
                        }
 
                        break;
                    }
         case 0xd1: // POP DE
                    {
-                       state->e = state->memory[state->sp];
-                       state->d = state->memory[state->sp+1];
+                       state->e = readMemory(state, state->sp);
+                       state->d = readMemory(state, state->sp+1);
                        state->sp += 2;
 
                        break;
@@ -1605,8 +1746,10 @@ void Emulate8080Op(State8080* state) {
                        break;
                    }
 
-        case 0xd3:  // OUT D8 (TODO)
+        case 0xd3:  // OUT D8
                    {
+                       if (state->port_out)
+                           state->port_out(state, opcode[1], state->a);
                        state->pc++;
 
                        break;
@@ -1615,8 +1758,9 @@ void Emulate8080Op(State8080* state) {
                    {
                        if (!state->cc.cy){
                            uint16_t ret = state->pc+2;
-                           state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                           state->memory[state->sp-2] = (ret & 0xff);    
+                           state->cycles += 6;
+                           writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                           writeMemory(state, state->sp-2, (ret & 0xff));    
                            state->sp = state->sp - 2;    
                            state->pc = (opcode[2] << 8) | opcode[1]; 
                        }
@@ -1627,8 +1771,8 @@ void Emulate8080Op(State8080* state) {
                    }
         case 0xd5: // PUSH DE
                    {
-                       state->memory[state->sp-1] = state->d;
-                       state->memory[state->sp-2] = state->e;
+                       writeMemory(state, state->sp-1, state->d);
+                       writeMemory(state, state->sp-2, state->e);
                        state->sp = state->sp-2;
 
                        break;
@@ -1637,8 +1781,8 @@ void Emulate8080Op(State8080* state) {
         case 0xd7:  // RST 2
                    {
                        uint16_t ret = state->pc+2;
-                       state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                       state->memory[state->sp-2] = (ret & 0xff);    
+                       writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                       writeMemory(state, state->sp-2, (ret & 0xff));    
                        state->sp = state->sp - 2;    
                        state->pc = 10; // to addr $10
 
@@ -1647,8 +1791,9 @@ void Emulate8080Op(State8080* state) {
         case 0xd8:  // RC
                    {
                        if (state->cc.cy){
-                           state->pc = state->memory[state->sp] | (state->memory[state->sp+1] << 8);    
+                           state->pc = readMemory(state, state->sp) | (readMemory(state, state->sp+1) << 8);    
                            state->sp += 2;   
+                           state->cycles += 6;
                        }
 
                        break;
@@ -1665,8 +1810,10 @@ void Emulate8080Op(State8080* state) {
                        break;
                    }
 
-        case 0xdb:  // IN D8 (TODO)
+        case 0xdb:  // IN D8
                    {
+                       if (state->port_in)
+                           state->a = state->port_in(state, opcode[1]);
                        state->pc++;
 
                        break;
@@ -1675,8 +1822,9 @@ void Emulate8080Op(State8080* state) {
                    {
                        if (state->cc.cy){
                            uint16_t ret = state->pc+2;
-                           state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                           state->memory[state->sp-2] = (ret & 0xff);    
+                           state->cycles += 6;
+                           writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                           writeMemory(state, state->sp-2, (ret & 0xff));    
                            state->sp = state->sp - 2;    
                            state->pc = (opcode[2] << 8) | opcode[1]; 
                        }
@@ -1689,8 +1837,8 @@ void Emulate8080Op(State8080* state) {
         case 0xdf:  // RST 3
                    {
                        uint16_t ret = state->pc+2;
-                       state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                       state->memory[state->sp-2] = (ret & 0xff);    
+                       writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                       writeMemory(state, state->sp-2, (ret & 0xff));    
                        state->sp = state->sp - 2;    
                        state->pc = 18; // to addr $18
 
@@ -1699,16 +1847,17 @@ void Emulate8080Op(State8080* state) {
         case 0xe0:  // RPO
                    {
                        if (0 == state->cc.p){
-                           state->pc = state->memory[state->sp] | (state->memory[state->sp+1] << 8);    
+                           state->pc = readMemory(state, state->sp) | (readMemory(state, state->sp+1) << 8);    
                            state->sp += 2;   
+                           state->cycles += 6;
                        }
 
                        break;
                    }
         case 0xe1: // POP HL
                    {
-                       state->l = state->memory[state->sp];
-                       state->h = state->memory[state->sp+1];
+                       state->l = readMemory(state, state->sp);
+                       state->h = readMemory(state, state->sp+1);
                        state->sp += 2;
 
                        break;
@@ -1728,18 +1877,21 @@ void Emulate8080Op(State8080* state) {
         case 0xe3: // exchange stack
                    {
                        uint8_t l_register = state->l;
-                       state->l = state->memory[state->sp];
-                       state->memory[state->sp] = l_register;
+                       state->l = readMemory(state, state->sp);
+                       writeMemory(state, state->sp, l_register);
                        uint8_t h_register = state->h;
-                       state->h = state->memory[state->sp+1];
-                       state->memory[state->sp+1] = h_register;
+                       state->h = readMemory(state, state->sp+1);
+                       writeMemory(state, state->sp+1, h_register);
+
+                       break;
                    }
         case 0xe4: // CPO addr
                    {
                        if (0 == state->cc.p){
                            uint16_t ret = state->pc+2;
-                           state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                           state->memory[state->sp-2] = (ret & 0xff);    
+                           state->cycles += 6;
+                           writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                           writeMemory(state, state->sp-2, (ret & 0xff));    
                            state->sp = state->sp - 2;    
                            state->pc = (opcode[2] << 8) | opcode[1];  
                        }
@@ -1749,8 +1901,8 @@ void Emulate8080Op(State8080* state) {
                    }
         case 0xe5: // PUSH HL
                    {
-                       state->memory[state->sp-1] = state->h;
-                       state->memory[state->sp-2] = state->l;
+                       writeMemory(state, state->sp-1, state->h);
+                       writeMemory(state, state->sp-2, state->l);
                        state->sp = state->sp-2;
 
                        break;
@@ -1772,8 +1924,8 @@ void Emulate8080Op(State8080* state) {
         case 0xe7: // RST 4
                    {
                        uint16_t ret = state->pc+2;
-                       state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                       state->memory[state->sp-2] = (ret & 0xff);    
+                       writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                       writeMemory(state, state->sp-2, (ret & 0xff));    
                        state->sp = state->sp - 2;    
                        state->pc = 20; // to addr $20
 
@@ -1782,8 +1934,9 @@ void Emulate8080Op(State8080* state) {
         case 0xe8: // RPE
                    {
                        if (state->cc.p){
-                           state->pc = state->memory[state->sp] | (state->memory[state->sp+1] << 8);    
+                           state->pc = readMemory(state, state->sp) | (readMemory(state, state->sp+1) << 8);    
                            state->sp += 2;   
+                           state->cycles += 6;
                        }
 
                        break;
@@ -1810,8 +1963,9 @@ void Emulate8080Op(State8080* state) {
                    {
                        if (state->cc.p){
                            uint16_t ret = state->pc+2;
-                           state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                           state->memory[state->sp-2] = (ret & 0xff);    
+                           state->cycles += 6;
+                           writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                           writeMemory(state, state->sp-2, (ret & 0xff));    
                            state->sp = state->sp - 2;    
                            state->pc = (opcode[2] << 8) | opcode[1]; 
                        }
@@ -1825,8 +1979,8 @@ void Emulate8080Op(State8080* state) {
         case 0xef:  // RST 5
                    {
                        uint16_t ret = state->pc+2;
-                       state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                       state->memory[state->sp-2] = (ret & 0xff);    
+                       writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                       writeMemory(state, state->sp-2, (ret & 0xff));    
                        state->sp = state->sp - 2;    
                        state->pc = 28; // to addr $28
 
@@ -1835,16 +1989,17 @@ void Emulate8080Op(State8080* state) {
         case 0xf0:  // RP
                    {
                        if (!state->cc.s){
-                           state->pc = state->memory[state->sp] | (state->memory[state->sp+1] << 8);    
+                           state->pc = readMemory(state, state->sp) | (readMemory(state, state->sp+1) << 8);    
                            state->sp += 2;   
+                           state->cycles += 6;
                        }
 
                        break;
                    }
         case 0xf1: // POP PSW
                    {
-                       state->a = state->memory[state->sp+1];
-                       uint8_t psw = state->memory[state->sp];
+                       state->a = readMemory(state, state->sp+1);
+                       uint8_t psw = readMemory(state, state->sp);
                        state->cc.cy = psw & 0x01;
                        state->cc.p = (0x04 == (psw & 0x04));
                        state->cc.ac = (0x10 == (psw & 0x10));
@@ -1875,8 +2030,9 @@ void Emulate8080Op(State8080* state) {
                    {
                        if (!state->cc.s){
                            uint16_t ret = state->pc+2;
-                           state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                           state->memory[state->sp-2] = (ret & 0xff);    
+                           state->cycles += 6;
+                           writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                           writeMemory(state, state->sp-2, (ret & 0xff));    
                            state->sp = state->sp - 2;    
                            state->pc = (opcode[2] << 8) | opcode[1]; 
                        }
@@ -1887,14 +2043,14 @@ void Emulate8080Op(State8080* state) {
                    }
         case 0xf5: // PUSH PSW
                    {
-                       state->memory[state->sp-1] = state->a;
+                       writeMemory(state, state->sp-1, state->a);
                        uint8_t psw = ( 0x02 |
                                state->cc.cy | 
                                state->cc.p << 2 |
                                state->cc.ac << 4 |
                                state->cc.z << 6 |
                                state->cc.s << 7);
-                       state->memory[state->sp-2] = psw;
+                       writeMemory(state, state->sp-2, psw);
                        state->sp = state->sp-2;
 
                        break;
@@ -1904,8 +2060,8 @@ void Emulate8080Op(State8080* state) {
         case 0xf7:  // RST 6
                    {
                        uint16_t ret = state->pc+2;
-                       state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                       state->memory[state->sp-2] = (ret & 0xff);    
+                       writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                       writeMemory(state, state->sp-2, (ret & 0xff));    
                        state->sp = state->sp - 2;    
                        state->pc = 30; // to addr $30
 
@@ -1914,8 +2070,9 @@ void Emulate8080Op(State8080* state) {
         case 0xf8:  // RM
                    {
                        if (state->cc.s){
-                           state->pc = state->memory[state->sp] | (state->memory[state->sp+1] << 8);    
+                           state->pc = readMemory(state, state->sp) | (readMemory(state, state->sp+1) << 8);    
                            state->sp += 2;   
+                           state->cycles += 6;
                        }
 
                        break;
@@ -1946,8 +2103,9 @@ void Emulate8080Op(State8080* state) {
                    {
                        if (state->cc.s){
                            uint16_t ret = state->pc+2;
-                           state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                           state->memory[state->sp-2] = (ret & 0xff);    
+                           state->cycles += 6;
+                           writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                           writeMemory(state, state->sp-2, (ret & 0xff));    
                            state->sp = state->sp - 2;    
                            state->pc = (opcode[2] << 8) | opcode[1]; 
                        }
@@ -1973,8 +2131,8 @@ void Emulate8080Op(State8080* state) {
         case 0xff:  // RST 7
                    {
                        uint16_t ret = state->pc+2;
-                       state->memory[state->sp-1] = (ret >> 8) & 0xff;    
-                       state->memory[state->sp-2] = (ret & 0xff);    
+                       writeMemory(state, state->sp-1, (ret >> 8) & 0xff);    
+                       writeMemory(state, state->sp-2, (ret & 0xff));    
                        state->sp = state->sp - 2;    
                        state->pc = 38; // to addr $38
 
@@ -1982,3 +2140,84 @@ void Emulate8080Op(State8080* state) {
                   }
     }
 }
+
+/*
+ * Hot pairs from Space Invaders' copy and clear loops, each run with one
+ * dispatch. A pair costs the clock states of its two instructions and leaves
+ * registers, flags and memory as they would. Only pairs whose first
+ * instruction is one byte long and cannot stop the run are fused.
+ */
+#define FUSED(first, second)    ((first) << 8 | (second))
+
+const uint8_t fusable8080[256] = {
+    [0x05] = 1,     // DCR B; JNZ
+    [0x1a] = 1,     // LDAX D; MOV M, A
+    [0x23] = 1,     // INX H; INX D
+    [0x7e] = 1,     // MOV A, M; INX H
+};
+
+int Emulate8080Pair(State8080* state) {
+    uint8_t *opcode = &state->memory[state->pc];
+
+#ifdef WATCH
+    // a watched read in the first half has to stop before the second
+    if (state->watch)
+        return 0;
+#endif
+    switch (FUSED(opcode[0], state->memory[(uint16_t)(state->pc + 1)])){
+        case FUSED(0x05, 0xc2):     // DCR B; JNZ address
+                   {
+                       uint8_t answer = state->b - 1;
+                       state->cc.z = (answer == 0);
+                       state->cc.s = ((answer & 0x80) != 0);
+                       state->cc.p = parity(answer);
+                       state->cc.ac = (answer & 0xf) > (state->b & 0xf);
+                       state->b = answer;
+                       state->cycles += cycles8080[0x05] + cycles8080[0xc2];
+                       if (answer)
+                           state->pc = (opcode[3] << 8) | opcode[2];
+                       else
+                           state->pc += 4;
+
+                       return 2;
+                   }
+        case FUSED(0x7e, 0x23):     // MOV A, M; INX H
+                   {
+                       uint16_t address = (state->h<<8) | state->l;
+                       state->a = readMemory(state, address);
+                       address++;
+                       state->l = address & 0xff;
+                       state->h = address >> 8;
+                       state->cycles += cycles8080[0x7e] + cycles8080[0x23];
+                       state->pc += 2;
+
+                       return 2;
+                   }
+        case FUSED(0x1a, 0x77):     // LDAX D; MOV M, A
+                   {
+                       uint16_t address = (state->d<<8) | state->e;
+                       state->a = readMemory(state, address);
+                       // PC and cycles as MOV M, A has them at its store, for a page watch
+                       state->cycles += cycles8080[0x1a] + cycles8080[0x77];
+                       state->pc += 2;
+                       writeMemory(state, (state->h<<8) | state->l, state->a);
+
+                       return 2;
+                   }
+        case FUSED(0x23, 0x13):     // INX H; INX D
+                   {
+                       uint16_t hl = ((state->h << 8) | state->l) + 1;
+                       uint16_t de = ((state->d << 8) | state->e) + 1;
+                       state->l = hl & 0xff;
+                       state->h = hl >> 8;
+                       state->e = de & 0xff;
+                       state->d = de >> 8;
+                       state->cycles += cycles8080[0x23] + cycles8080[0x13];
+                       state->pc += 2;
+
+                       return 2;
+                   }
+        default:
+            return 0;
+    }
+}
@@ -11,7 +11,29 @@ typedef struct ConditionCodes {
     uint8_t    pad:3;
 } ConditionCodes;
 
-typedef struct State8080 {
+// why a run stopped; the core itself only sets STOP_UNIMPLEMENTED and STOP_HALT
+typedef enum StopReason {
+    STOP_NONE = 0,          // still running
+    STOP_LIMIT,             // the run loop reached its instruction/cycle/frame limit
+    STOP_UNIMPLEMENTED,     // PC points at an opcode the core does not implement
+    STOP_HALT,              // HLT
+    STOP_EXIT,              // a CP/M program returned to the system (warm boot)
+    STOP_BREAK,             // a breakpoint or watchpoint (debug.h); the instruction has run
+} StopReason;
+
+const char *stopReasonName(uint32_t reason);
+
+#define MEMORY_PAGE_SHIFT   8       // 256-byte pages for dirty tracking
+#define MEMORY_PAGE_SIZE    (1 << MEMORY_PAGE_SHIFT)
+#define MEMORY_PAGES        (0x10000 >> MEMORY_PAGE_SHIFT)
+
+// watch flags per memory page, see debug.h
+#define WATCH_READ          0x01
+#define WATCH_WRITE         0x02
+
+typedef struct State8080 State8080;
+
+struct State8080 {
     uint8_t    a;
     uint8_t    b;
     uint8_t    c;
@@ -24,10 +46,117 @@ typedef struct State8080 {
     uint8_t    *memory; // each memory location holds 8-bit data
     struct     ConditionCodes   cc;
     uint8_t    int_enable;
-} State8080;
+    uint64_t   cycles;  // clock states executed so far
+    uint8_t    stop;    // StopReason, STOP_NONE while running
+    uint64_t   dirty[MEMORY_PAGES / 64];    // pages stored to since the bits were last cleared
+#ifdef WATCH
+    // WATCH_READ/WATCH_WRITE per page, NULL for none; accesses to a flagged page call watch_hook
+    const uint8_t *watch;
+    void       (*watch_hook)(void *ctx, State8080 *state, uint16_t address, uint8_t value, int kind);
+    void       *watch_ctx;
+#endif
+#ifdef STATEHASH
+    uint64_t   memory_hash;         // XOR of memoryHashKey() over every address, kept by writeMemory
+    uint8_t    memory_hash_valid;   // 0 after host code changed memory behind its back
+#endif
+    // devices on the I/O ports; with no handler IN leaves A alone and OUT is ignored
+    uint8_t    (*port_in)(State8080 *state, uint8_t port);
+    void       (*port_out)(State8080 *state, uint8_t port, uint8_t value);
+    void       *io;     // the handlers' context, e.g. the Machine
+};
+
+extern const uint8_t cycles8080[256];
+extern const uint8_t length8080[256];
+
+/*
+ * Zobrist-style key of one memory cell: the memory hash is the XOR of the
+ * keys of every (address, value) pair, so a store swaps one key for another.
+ * The keys are mixed from the pair instead of looked up, since a table for
+ * every pair would be 128 MB.
+ */
+static inline uint64_t memoryHashKey(uint16_t address, uint8_t value){
+    uint64_t x = ((uint64_t)address << 8 | value) * 0x9e3779b97f4a7c15ULL;
+    x ^= x >> 29;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    return x ^ (x >> 32);
+}
+
+/*
+ * Data reads by the core; without -DWATCH this is a plain load. The address
+ * is not wrapped, like the core's own reads of SP+1.
+ */
+static inline uint8_t readMemory(State8080 *state, uint32_t address){
+#ifdef WATCH
+    if (state->watch && (state->watch[(address >> MEMORY_PAGE_SHIFT) & (MEMORY_PAGES - 1)] & WATCH_READ))
+        state->watch_hook(state->watch_ctx, state, address, state->memory[address], WATCH_READ);
+#endif
+    return state->memory[address];
+}
+
+// every store to guest memory goes through here, so the dirty bits stay exact
+static inline void writeMemory(State8080 *state, uint16_t address, uint8_t value){
+#ifdef WATCH
+    // before the store, so the hook can still see the old value
+    if (state->watch && (state->watch[address >> MEMORY_PAGE_SHIFT] & WATCH_WRITE))
+        state->watch_hook(state->watch_ctx, state, address, value, WATCH_WRITE);
+#endif
+#ifdef STATEHASH
+    state->memory_hash ^= memoryHashKey(address, state->memory[address]) ^ memoryHashKey(address, value);
+#endif
+    state->memory[address] = value;
+    state->dirty[address >> (MEMORY_PAGE_SHIFT + 6)] |= 1ULL << ((address >> MEMORY_PAGE_SHIFT) & 63);
+}
+
+// the memory hash has to be recomputed; for host code that replaced memory wholesale
+static inline void invalidateMemoryHash(State8080 *state){
+#ifdef STATEHASH
+    state->memory_hash_valid = 0;
+#else
+    (void)state;
+#endif
+}
+
+// for host code that writes guest memory in bulk, e.g. a disk transfer
+static inline void markDirty(State8080 *state, uint16_t address, uint32_t length){
+    for (uint32_t page = address >> MEMORY_PAGE_SHIFT;
+         length && page <= (uint32_t)((address + length - 1) >> MEMORY_PAGE_SHIFT); page++)
+        state->dirty[(page & (MEMORY_PAGES - 1)) >> 6] |= 1ULL << (page & 63);
+    invalidateMemoryHash(state);
+}
+
+static inline int pageDirty(const State8080 *state, int page){
+    return (state->dirty[page >> 6] >> (page & 63)) & 1;
+}
 
 uint8_t parity(uint8_t data);
+State8080* initState(uint8_t* memory);
+// power-on state in caller-owned storage, e.g. an arena slot
+void resetState(State8080* state, uint8_t* memory);
 void Emulate8080Op(State8080* state);
+// opcodes that can start a pair Emulate8080Pair fuses
+extern const uint8_t fusable8080[256];
+/*
+ * Run the instruction at PC and the next one with one dispatch, if they are
+ * one of the hot pairs (DCR B; JNZ and a few more). The caller makes sure
+ * nothing it does between instructions is due after the first one.
+ * @return 2, or 0 if they are not a pair and nothing ran
+ */
+int Emulate8080Pair(State8080* state);
+void GenerateInterrupt(State8080* state, int interrupt_num);
 void UnimplementedInstruction(State8080* state); 
 
+// XOR of memoryHashKey() over all 64K of memory
+uint64_t memoryHash(const uint8_t *memory);
+/*
+ * Recompute the memory hash if host code invalidated it. Without
+ * -DSTATEHASH there is no hash to keep and this does nothing.
+ */
+void syncMemoryHash(State8080 *state);
+/*
+ * Fingerprint of the registers, flags, interrupt enable and all of memory.
+ * With -DSTATEHASH it is O(1) (after a recompute if the memory hash was
+ * invalidated); without it memory is hashed in full. Both give the same value.
+ */
+uint64_t stateFingerprint(State8080 *state);
+
 #endif
@@ -0,0 +1,84 @@
+/*
+ * Print the live statistics of a running emulator (see stats.h).
+ *
+ * usage: emustat <pid | /segment-name> [-j] [-w milliseconds]
+ *   -j  print one JSON object per line instead of text
+ *   -w  keep printing at this interval until the emulator stops
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "stats.h"
+#include "emulator.h"
+
+static void printText(const StatsBlock *block, const StatsSnapshot *s){
+    double mips = s->total_ns ? (double)s->instructions * 1000.0 / s->total_ns : 0.0;
+    double fps = s->frame_ns ? 1e9 / s->frame_ns : 0.0;
+
+    printf("pid %u  %s\n", block->pid, stopReasonName(s->stop_reason));
+    printf("  instructions %llu  cycles %llu  frames %llu  interrupts %llu\n",
+           (unsigned long long)s->instructions, (unsigned long long)s->cycles,
+           (unsigned long long)s->frames, (unsigned long long)s->interrupts);
+    printf("  last frame %llu ns (%.1f fps)  %.2f MIPS over %.3f s\n",
+           (unsigned long long)s->frame_ns, fps, mips, s->total_ns / 1e9);
+}
+
+static void printJson(const StatsBlock *block, const StatsSnapshot *s){
+    printf("{\"pid\":%u,\"instructions\":%llu,\"cycles\":%llu,\"frames\":%llu,\"interrupts\":%llu,"
+           "\"frame_ns\":%llu,\"total_ns\":%llu,\"stop_reason\":\"%s\"}\n",
+           block->pid, (unsigned long long)s->instructions, (unsigned long long)s->cycles,
+           (unsigned long long)s->frames, (unsigned long long)s->interrupts,
+           (unsigned long long)s->frame_ns, (unsigned long long)s->total_ns,
+           stopReasonName(s->stop_reason));
+}
+
+int main(int argc, char *argv[]) {
+    char name[64];
+    int json = 0;
+    long watch_ms = 0;
+    const char *target = NULL;
+
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "-j") == 0)
+            json = 1;
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            watch_ms = atol(argv[++i]);
+        else
+            target = argv[i];
+    }
+    if (!target){
+        printf("usage: %s <pid | /segment-name> [-j] [-w milliseconds]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (target[0] == '/')
+        snprintf(name, sizeof(name), "%s", target);
+    else
+        snprintf(name, sizeof(name), STATS_SHM_PREFIX "%s", target);
+
+    const StatsBlock *block = statsAttach(name);
+    if (!block){
+        printf("no stats segment %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    StatsSnapshot snap;
+    do {
+        if (statsRead(block, &snap) != 0){
+            printf("%s is not an emulator stats segment\n", name);
+            exit(EXIT_FAILURE);
+        }
+        if (json)
+            printJson(block, &snap);
+        else
+            printText(block, &snap);
+        fflush(stdout);
+
+        if (watch_ms > 0 && snap.stop_reason == 0)
+            usleep(watch_ms * 1000);
+    } while (watch_ms > 0 && snap.stop_reason == 0);
+
+    statsDetach(block);
+    return 0;
+}
@@ -0,0 +1,174 @@
+#include "env.h"
+#include <stdlib.h>
+#include <string.h>
+
+// IN 1 bits
+#define PORT1_COIN      0x01
+#define PORT1_START1    0x04
+#define PORT1_FIRE      0x10
+#define PORT1_LEFT      0x20
+#define PORT1_RIGHT     0x40
+
+static const uint8_t action_bits[ENV_ACTIONS] = {
+    [ENV_NOOP] = 0,
+    [ENV_FIRE] = PORT1_FIRE,
+    [ENV_LEFT] = PORT1_LEFT,
+    [ENV_RIGHT] = PORT1_RIGHT,
+    [ENV_LEFT_FIRE] = PORT1_LEFT | PORT1_FIRE,
+    [ENV_RIGHT_FIRE] = PORT1_RIGHT | PORT1_FIRE,
+};
+
+static inline uint8_t bcd(uint8_t value){
+    return (value >> 4) * 10 + (value & 0xf);
+}
+
+uint32_t envScore(const uint8_t *memory, uint16_t address){
+    return bcd(memory[(uint16_t)(address + 1)]) * 100 + bcd(memory[address]);
+}
+
+void envObserve(const uint8_t *memory, uint8_t *observation){
+    const uint8_t *video = &memory[ENV_VIDEO_RAM];
+
+    for (int x = 0; x < ENV_OBS_WIDTH; x++){
+        const uint8_t *left = &video[x * 64];
+        const uint8_t *right = left + 32;
+        // bit 0 of byte 0 is the bottom row, so fill each column from the bottom up
+        uint8_t *cell = &observation[(ENV_OBS_HEIGHT - 1) * ENV_OBS_WIDTH + x];
+
+        for (int j = 0; j < 32; j++){
+            uint8_t bits = left[j] | right[j];
+            bits |= bits >> 1;      // bits 0, 2, 4 and 6 now cover two rows each
+            cell[0] = bits & 1;
+            cell[-ENV_OBS_WIDTH] = (bits >> 2) & 1;
+            cell[-2 * ENV_OBS_WIDTH] = (bits >> 4) & 1;
+            cell[-3 * ENV_OBS_WIDTH] = (bits >> 6) & 1;
+            cell -= 4 * ENV_OBS_WIDTH;
+        }
+    }
+}
+
+// hold `bits` on IN 1 for `frames` frames; @return 0 if the core stopped
+static int holdInput(Machine *m, uint8_t bits, uint32_t frames){
+    m->inputs[1] = 0x08 | bits;
+    StopReason reason = machineRun(m, 0, 0, frames);
+    m->inputs[1] = 0x08;
+    return reason == STOP_LIMIT;
+}
+
+// from power-on to the first frame of a one player game
+static int bootToGame(Machine *m, uint16_t mode_address){
+    const uint8_t *memory = m->state->memory;
+
+    if (!holdInput(m, 0, 120) || !holdInput(m, PORT1_COIN, 4) || !holdInput(m, 0, 60) ||
+        !holdInput(m, PORT1_START1, 4))
+        return 0;
+    for (uint32_t frame = 0; frame < ENV_BOOT_FRAMES && !memory[mode_address]; frame++)
+        if (!holdInput(m, 0, 1))
+            return 0;
+    return memory[mode_address] != 0;
+}
+
+// on a worker thread, once environment i has run its frames
+static void stepDone(void *ctx, uint32_t i){
+    EnvSet *env = (EnvSet *)ctx;
+    const State8080 *state = poolMachine(env->pool, i)->state;
+    const uint8_t *memory = state->memory;
+    uint32_t score = envScore(memory, env->score_address);
+
+    // the score has four digits and wraps at 10000
+    env->rewards[i] = (score + 10000 - env->scores[i]) % 10000;
+    env->scores[i] = score;
+    if (memory[env->mode_address])
+        env->playing[i] = 1;
+    env->dones[i] = (state->stop && state->stop != STOP_LIMIT) ||
+                    (env->playing[i] && !memory[env->mode_address]);
+    envObserve(memory, &env->observations[(size_t)i * ENV_OBS_SIZE]);
+}
+
+EnvSet *envCreate(uint32_t count, const uint8_t *image, int threads, int huge){
+    Pool *pool = poolCreate(count, image, threads, huge);
+    if (!pool)
+        return NULL;
+
+    EnvSet *env = (EnvSet *)calloc(1, sizeof(EnvSet));
+    env->pool = pool;
+    env->count = count;
+    env->score_address = ENV_SCORE_ADDRESS;
+    env->mode_address = ENV_MODE_ADDRESS;
+    env->observations = (uint8_t *)malloc((size_t)count * ENV_OBS_SIZE);
+    env->rewards = (int32_t *)calloc(count, sizeof(int32_t));
+    env->dones = (uint8_t *)calloc(count, 1);
+    env->scores = (uint32_t *)calloc(count, sizeof(uint32_t));
+    env->playing = (uint8_t *)calloc(count, 1);
+    pool->done_hook = stepDone;
+    pool->hook_ctx = env;
+
+    // boot once on the template, then every environment starts from a copy of it
+    env->started = bootToGame(arenaTemplate(pool->arena), env->mode_address);
+    for (uint32_t i = 0; i < count; i++)
+        arenaClone(pool->arena, i);
+    envReset(env);
+    return env;
+}
+
+void envFree(EnvSet *env){
+    if (!env)
+        return;
+    poolFree(env->pool);
+    free(env->observations);
+    free(env->rewards);
+    free(env->dones);
+    free(env->scores);
+    free(env->playing);
+    free(env);
+}
+
+// environment i back to the template
+static void resetOne(EnvSet *env, uint32_t i, const uint8_t *start){
+    arenaReset(env->pool->arena, i);
+    env->scores[i] = envScore(start, env->score_address);
+    env->playing[i] = start[env->mode_address] != 0;
+    env->rewards[i] = 0;
+    env->dones[i] = 0;
+}
+
+void envReset(EnvSet *env){
+    const uint8_t *start = arenaTemplate(env->pool->arena)->state->memory;
+
+    for (uint32_t i = 0; i < env->count; i++){
+        resetOne(env, i, start);
+        // they all look the same, so observe once and copy
+        if (i == 0)
+            envObserve(start, env->observations);
+        else
+            memcpy(&env->observations[(size_t)i * ENV_OBS_SIZE], env->observations, ENV_OBS_SIZE);
+    }
+}
+
+uint32_t envStep(EnvSet *env, const uint8_t *actions, uint32_t frames){
+    const uint8_t *start = arenaTemplate(env->pool->arena)->state->memory;
+    uint32_t done = 0;
+
+    if (!frames)
+        frames = 1;
+    for (uint32_t i = 0; i < env->count; i++){
+        Machine *m = poolMachine(env->pool, i);
+
+        if (env->dones[i])
+            resetOne(env, i, start);
+        m->inputs[1] = 0x08 | action_bits[actions[i] < ENV_ACTIONS ? actions[i] : ENV_NOOP];
+        // the pool skips a core that has stopped for good, so finish its step here
+        if (m->state->stop && m->state->stop != STOP_LIMIT)
+            stepDone(env, i);
+    }
+
+    // one slice per environment: it runs its whole step on one thread
+    poolStart(env->pool, frames, frames);
+    poolWait(env->pool, 0);
+
+    for (uint32_t i = 0; i < env->count; i++)
+        done += env->dones[i];
+    env->steps++;
+    env->frames += (uint64_t)env->count * frames;
+    return done;
+}
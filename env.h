@@ -0,0 +1,86 @@
+#ifndef ENV_H
+#define ENV_H
+#include <stdint.h>
+#include "emulator.h"
+#include "machine.h"
+#include "pool.h"
+
+/*
+ * Space Invaders as a batch of reinforcement-learning environments.
+ *
+ * envCreate boots the ROM once on the pool's template: it inserts a coin,
+ * presses 1P start and runs until the game mode byte is set. Every
+ * environment then starts from that point. envStep holds one action per
+ * environment for `frames` frames, running the environments on the pool's
+ * threads. It then fills in, per environment:
+ *   - observations: the screen read straight from video RAM and max-pooled
+ *     2x2 into ENV_OBS_WIDTH x ENV_OBS_HEIGHT cells of 0 or 1, top row first
+ *   - rewards: points scored during the step, from the BCD score in RAM
+ *   - dones: the game ended (game mode cleared) or the core stopped
+ * An environment that is done goes back to the start of a game at the
+ * beginning of its next step, so the caller never resets single
+ * environments.
+ */
+
+#define ENV_OBS_WIDTH       112     // the screen's 224 columns, two to a cell
+#define ENV_OBS_HEIGHT      128     // its 256 rows, two to a cell
+#define ENV_OBS_SIZE        (ENV_OBS_WIDTH * ENV_OBS_HEIGHT)
+
+#define ENV_VIDEO_RAM       0x2400  // 224 columns of 32 bytes, bit 0 of the first byte at the bottom
+#define ENV_SCORE_ADDRESS   0x20f8  // player 1's score, 4 BCD digits, low byte first
+#define ENV_MODE_ADDRESS    0x20ef  // not 0 while a game is being played
+#define ENV_BOOT_FRAMES     600     // give up waiting for the game to start after this long
+
+typedef enum EnvAction {
+    ENV_NOOP = 0,
+    ENV_FIRE,
+    ENV_LEFT,
+    ENV_RIGHT,
+    ENV_LEFT_FIRE,
+    ENV_RIGHT_FIRE,
+    ENV_ACTIONS
+} EnvAction;
+
+typedef struct EnvSet {
+    Pool       *pool;           // one instance per environment, the template is the start of a game
+    uint32_t   count;
+    uint16_t   score_address;   // ENV_SCORE_ADDRESS, for other ROMs set before envReset
+    uint16_t   mode_address;    // ENV_MODE_ADDRESS
+    int        started;         // the boot saw the game mode set
+    // results of the last envReset or envStep, one entry per environment
+    uint8_t    *observations;   // count * ENV_OBS_SIZE
+    int32_t    *rewards;
+    uint8_t    *dones;
+    // per environment bookkeeping
+    uint32_t   *scores;         // score at the end of the last step
+    uint8_t    *playing;        // the game mode has been set since the last reset
+    uint64_t   steps;
+    uint64_t   frames;          // environment frames run by envStep
+} EnvSet;
+
+/*
+ * @param image 64K memory image with the ROM loaded
+ * @param threads Worker threads, 0 for one per online CPU
+ * @param huge Put the environments on huge pages
+ * @return NULL if the arena cannot be mapped
+ */
+EnvSet *envCreate(uint32_t count, const uint8_t *image, int threads, int huge);
+void envFree(EnvSet *env);
+
+// every environment back to the start of a game; fills in the observations
+void envReset(EnvSet *env);
+
+/*
+ * Run every environment for `frames` frames with its action held
+ * @param actions One EnvAction per environment
+ * @return the number of environments that are done
+ */
+uint32_t envStep(EnvSet *env, const uint8_t *actions, uint32_t frames);
+
+// downsample video RAM in `memory` into ENV_OBS_SIZE cells
+void envObserve(const uint8_t *memory, uint8_t *observation);
+
+// the 4-digit BCD score at `address`, as a number
+uint32_t envScore(const uint8_t *memory, uint16_t address);
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * Step a batch of Space Invaders environments with random actions and
+ * report environment frames per second, episodes and rewards.
+ *
+ * usage: envbench [-j threads] [-n envs] [-f frames] [-s steps] [-H] <rom>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emulator.h"
+#include "machine.h"
+#include "env.h"
+
+static void usage(const char *name){
+    printf("usage: %s [options] <rom>\n"
+           "  -j threads    worker threads (default: one per CPU)\n"
+           "  -n count      environments (default 256)\n"
+           "  -f frames     frames each action is held (default 4)\n"
+           "  -s steps      steps to run (default 1000)\n"
+           "  -H            put the environments on huge pages\n", name);
+    exit(EXIT_FAILURE);
+}
+
+static double nowSeconds(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    const char *rom = NULL;
+    int threads = 0;
+    uint32_t count = 256;
+    uint32_t frames = 4;
+    uint64_t steps = 1000;
+    int huge = 0;
+
+    for (int i = 1; i < argc; i++){
+        if (argv[i][0] != '-'){
+            if (rom)
+                usage(argv[0]);
+            rom = argv[i];
+        } else if (strcmp(argv[i], "-H") == 0){
+            huge = 1;
+        } else if (i + 1 < argc && strcmp(argv[i], "-j") == 0){
+            threads = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-n") == 0){
+            count = strtoul(argv[++i], NULL, 0);
+        } else if (i + 1 < argc && strcmp(argv[i], "-f") == 0){
+            frames = strtoul(argv[++i], NULL, 0);
+        } else if (i + 1 < argc && strcmp(argv[i], "-s") == 0){
+            steps = strtoull(argv[++i], NULL, 0);
+        } else{
+            usage(argv[0]);
+        }
+    }
+    if (!rom || count == 0 || frames == 0)
+        usage(argv[0]);
+
+    uint8_t *image = (uint8_t *)calloc(0x10000, 1);
+    if (machineLoadROM(image, rom, 0) < 0){
+        printf("Cannot read %s\n", rom);
+        exit(EXIT_FAILURE);
+    }
+
+    EnvSet *env = envCreate(count, image, threads, huge);
+    if (!env){
+        printf("Cannot map %u environments\n", count);
+        exit(EXIT_FAILURE);
+    }
+    State8080 *boot = arenaTemplate(env->pool->arena)->state;
+    printf("%u environments on %d threads; %s\n", count, env->pool->threads,
+           env->started ? "the game started" : "the game did not start, stepping from where the boot ended");
+    if (boot->stop && boot->stop != STOP_LIMIT)
+        printf("the boot stopped: %s at %04x\n", stopReasonName(boot->stop), boot->pc);
+
+    uint8_t *actions = (uint8_t *)malloc(count);
+    uint64_t episodes = 0, reward = 0, seed = 88172645463325252ULL;
+    double start = nowSeconds();
+
+    for (uint64_t s = 0; s < steps; s++){
+        for (uint32_t i = 0; i < count; i++){
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            actions[i] = seed % ENV_ACTIONS;
+        }
+        episodes += envStep(env, actions, frames);
+        for (uint32_t i = 0; i < count; i++)
+            reward += env->rewards[i];
+    }
+    double seconds = nowSeconds() - start;
+
+    printf("%llu steps, %llu environment frames in %.2f s: %.0f frames/s, %.0f steps/s\n",
+           (unsigned long long)env->steps, (unsigned long long)env->frames, seconds,
+           seconds > 0 ? env->frames / seconds : 0.0, seconds > 0 ? env->steps * count / seconds : 0.0);
+    printf("%llu episodes ended, %llu points scored\n", (unsigned long long)episodes, (unsigned long long)reward);
+
+    free(actions);
+    free(image);
+    envFree(env);
+    return 0;
+}
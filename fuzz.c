@@ -0,0 +1,135 @@
+#include "fuzz.h"
+#include <stdlib.h>
+#include <string.h>
+
+// jumps, calls, returns, RST and PCHL: where one basic block ends
+static const uint8_t is_branch[256] = {
+    [0xc3] = 1, [0xc2] = 1, [0xca] = 1, [0xd2] = 1, [0xda] = 1, [0xe2] = 1, [0xea] = 1, [0xf2] = 1, [0xfa] = 1,
+    [0xcd] = 1, [0xc4] = 1, [0xcc] = 1, [0xd4] = 1, [0xdc] = 1, [0xe4] = 1, [0xec] = 1, [0xf4] = 1, [0xfc] = 1,
+    [0xc9] = 1, [0xc0] = 1, [0xc8] = 1, [0xd0] = 1, [0xd8] = 1, [0xe0] = 1, [0xe8] = 1, [0xf0] = 1, [0xf8] = 1,
+    [0xc7] = 1, [0xcf] = 1, [0xd7] = 1, [0xdf] = 1, [0xe7] = 1, [0xef] = 1, [0xf7] = 1, [0xff] = 1,
+    [0xe9] = 1,
+};
+
+const char *fuzzResultName(FuzzResult result){
+    switch (result){
+        case FUZZ_OK:               return "ok";
+        case FUZZ_LIMIT:            return "limit";
+        case FUZZ_HALT:             return "halt";
+        case FUZZ_UNIMPLEMENTED:    return "unimplemented opcode";
+        case FUZZ_STACK:            return "stack in ROM";
+    }
+    return "?";
+}
+
+Fuzzer *fuzzCreate(const uint8_t *image, uint8_t *map){
+    Arena *arena = arenaCreate(1, 0);
+    if (!arena)
+        return NULL;
+
+    Fuzzer *fz = (Fuzzer *)calloc(1, sizeof(Fuzzer));
+    fz->arena = arena;
+    memcpy(arenaTemplate(arena)->state->memory, image, 0x10000);
+    fz->m = arenaMachine(arena, 0);
+    fz->state = arenaState(arena, 0);
+    fz->own_map = !map;
+    fz->map = map ? map : (uint8_t *)calloc(FUZZ_MAP_SIZE, 1);
+    fz->max_instructions = FUZZ_DEFAULT_LIMIT;
+    return fz;
+}
+
+void fuzzFree(Fuzzer *fz){
+    if (!fz)
+        return;
+    if (fz->own_map)
+        free(fz->map);
+    arenaFree(fz->arena);
+    free(fz);
+}
+
+// IN 0-2 read the input a byte at a time
+static uint8_t fuzzInput(void *ctx, uint8_t port, uint8_t value){
+    Fuzzer *fz = (Fuzzer *)ctx;
+    (void)port;
+
+    if (fz->pos >= fz->size){
+        fz->used_up = 1;
+        return value;
+    }
+    return fz->input[fz->pos++];
+}
+
+static inline void edge(Fuzzer *fz, uint16_t target){
+    // an odd multiplier spreads neighbouring addresses over the map
+    uint16_t location = target * 40503u;
+
+    fz->map[location ^ fz->prev]++;
+    fz->prev = location >> 1;
+}
+
+FuzzResult fuzzRun(Fuzzer *fz, const uint8_t *data, size_t size){
+    Machine *m = fz->m;
+    State8080 *state = fz->state;
+
+    // the first run takes the whole template, later ones only what they changed
+    if (fz->execs++ == 0)
+        arenaClone(fz->arena, 0);
+    else
+        arenaReset(fz->arena, 0);
+    m->input_hook = fuzzInput;
+    m->hook_ctx = fz;
+
+    size_t ram = size < fz->ram_length ? size : fz->ram_length;
+    for (size_t i = 0; i < ram; i++)
+        writeMemory(state, fz->ram_start + i, data[i]);
+    fz->input = data + ram;
+    fz->size = size - ram;
+    fz->pos = 0;
+    fz->used_up = 0;
+    fz->prev = 0;
+    uint64_t end = m->instructions + fz->max_instructions;
+
+    while (1){
+        uint16_t pc = state->pc;
+        uint8_t opcode = state->memory[pc];
+
+        Emulate8080Op(state);
+        if (state->stop){
+            if (state->stop != STOP_HALT){
+                fz->fault_pc = pc;
+                fz->fault_opcode = opcode;
+                return FUZZ_UNIMPLEMENTED;
+            }
+            if (!state->int_enable)
+                return FUZZ_HALT;
+            // sleep until the next interrupt
+            state->stop = STOP_NONE;
+            if (state->cycles < m->next_interrupt)
+                state->cycles = m->next_interrupt;
+        }
+        m->instructions++;
+
+        // taken or not, the next block is an edge
+        if (is_branch[opcode])
+            edge(fz, state->pc);
+        if (state->sp < m->rom_size){
+            fz->fault_pc = pc;
+            fz->fault_opcode = opcode;
+            return FUZZ_STACK;
+        }
+        if (fz->used_up)
+            return FUZZ_OK;
+        if (machineInterrupts(m))
+            edge(fz, state->pc);
+        if (m->instructions >= end)
+            return FUZZ_LIMIT;
+    }
+}
+
+uint32_t fuzzCountEdges(const uint8_t *map){
+    uint32_t edges = 0;
+
+    for (uint32_t i = 0; i < FUZZ_MAP_SIZE; i++)
+        edges += map[i] != 0;
+    return edges;
+}
@@ -0,0 +1,87 @@
+#ifndef FUZZ_H
+#define FUZZ_H
+#include <stdint.h>
+#include <stddef.h>
+#include "emulator.h"
+#include "machine.h"
+#include "arena.h"
+
+/*
+ * In-process fuzzing of guest firmware.
+ *
+ * One input is one execution: its first ram_length bytes are written to RAM
+ * at ram_start, and the rest are what IN 0-2 read, one byte per read. The
+ * execution ends when a read finds the input used up, after max_instructions,
+ * or on a fault. Every execution starts from the template (an arena slot:
+ * load the ROM, or restore a snapshot to start mid-game), and the reset
+ * copies back only the pages the last execution stored to.
+ *
+ * Coverage is AFL-style: every branch (JMP/Jcc, CALL/Ccc, RET/Rcc, RST,
+ * PCHL, interrupts) bumps an 8-bit counter for the edge from the previous
+ * block to the one it leads to, in a map of FUZZ_MAP_SIZE counters. A
+ * conditional branch that is not taken counts too: the fall-through is a
+ * block of its own.
+ */
+
+#define FUZZ_MAP_SIZE       0x10000
+#define FUZZ_DEFAULT_LIMIT  1000000     // instructions per execution
+
+typedef enum FuzzResult {
+    FUZZ_OK = 0,            // the input was used up
+    FUZZ_LIMIT,             // ran max_instructions without using it up
+    FUZZ_HALT,              // HLT with interrupts disabled, which never returns
+    FUZZ_UNIMPLEMENTED,     // crash: an opcode the core does not implement
+    FUZZ_STACK,             // crash: SP went below the end of ROM
+} FuzzResult;
+
+const char *fuzzResultName(FuzzResult result);
+
+static inline int fuzzCrashed(FuzzResult result){
+    return result >= FUZZ_UNIMPLEMENTED;
+}
+
+typedef struct Fuzzer {
+    Arena      *arena;          // the template and one instance
+    Machine    *m;
+    State8080  *state;
+    uint8_t    *map;            // FUZZ_MAP_SIZE edge counters
+    int        own_map;
+    uint16_t   prev;            // previous branch target, hashed and shifted
+    // the input being run
+    const uint8_t *input;
+    size_t     size;
+    size_t     pos;
+    int        used_up;
+    // settings
+    uint16_t   ram_start;
+    uint16_t   ram_length;
+    uint64_t   max_instructions;
+    // the last crash
+    uint16_t   fault_pc;
+    uint8_t    fault_opcode;
+    uint64_t   execs;
+} Fuzzer;
+
+/*
+ * @param image 64K memory image with the ROM loaded, copied into the template
+ * @param map Coverage counters to update, e.g. libFuzzer's extra counters;
+ * NULL to allocate them
+ */
+Fuzzer *fuzzCreate(const uint8_t *image, uint8_t *map);
+void fuzzFree(Fuzzer *fz);
+
+// the machine every execution starts from, to set up before the first fuzzRun
+static inline Machine *fuzzTemplate(Fuzzer *fz){
+    return arenaTemplate(fz->arena);
+}
+
+/*
+ * Run one input from the template. The coverage map is not cleared, so
+ * clear it between inputs if only the last one's edges are wanted.
+ */
+FuzzResult fuzzRun(Fuzzer *fz, const uint8_t *data, size_t size);
+
+// map entries that are not zero
+uint32_t fuzzCountEdges(const uint8_t *map);
+
+#endif
@@ -0,0 +1,261 @@
+/*
+ * A small coverage-guided fuzzer for guest firmware, for hosts without
+ * libFuzzer. Inputs that reach new edges join the corpus; crashing inputs
+ * are written to crash-<n> files, one per distinct fault.
+ *
+ * usage: fuzz8080 [-n execs] [-t seconds] [-s seed] [-r start:length] [-l instructions] [-o dir] <rom> [seed inputs...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emulator.h"
+#include "machine.h"
+#include "fuzz.h"
+
+#define MAX_INPUT   4096
+#define MAX_CORPUS  8192
+#define MAX_FAULTS  256
+
+typedef struct Input {
+    uint8_t    *data;
+    size_t     size;
+} Input;
+
+static void usage(const char *name){
+    printf("usage: %s [options] <rom> [seed inputs...]\n"
+           "  -n execs          stop after this many executions (default: no limit)\n"
+           "  -t seconds        stop after this long (default 10)\n"
+           "  -s seed           random seed\n"
+           "  -r start:length   the first `length` bytes of an input go to RAM at `start`\n"
+           "  -l instructions   per execution (default %d)\n"
+           "  -o dir            where crash files go (default .)\n", name, FUZZ_DEFAULT_LIMIT);
+    exit(EXIT_FAILURE);
+}
+
+static double nowSeconds(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint32_t rnd(uint32_t n){
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return n ? rng_state % n : 0;
+}
+
+// a few random edits of `in`, into out; @return the new size
+static size_t mutate(const Input *in, uint8_t *out){
+    size_t size = in->size;
+    memcpy(out, in->data, size);
+
+    for (int edits = 1 + rnd(4); edits; edits--){
+        switch (rnd(5)){
+            case 0: // flip a bit
+                if (size)
+                    out[rnd(size)] ^= 1 << rnd(8);
+                break;
+            case 1: // random byte
+                if (size)
+                    out[rnd(size)] = rnd(256);
+                break;
+            case 2: // insert bytes
+            {
+                size_t at = rnd(size + 1);
+                size_t n = 1 + rnd(8);
+                if (size + n > MAX_INPUT)
+                    break;
+                memmove(&out[at + n], &out[at], size - at);
+                for (size_t i = 0; i < n; i++)
+                    out[at + i] = rnd(256);
+                size += n;
+                break;
+            }
+            case 3: // delete bytes
+            {
+                if (!size)
+                    break;
+                size_t at = rnd(size);
+                size_t n = 1 + rnd(size - at < 8 ? size - at : 8);
+                memmove(&out[at], &out[at + n], size - at - n);
+                size -= n;
+                break;
+            }
+            default: // repeat a byte, like holding a button
+            {
+                if (!size)
+                    break;
+                size_t at = rnd(size);
+                size_t n = 1 + rnd(32);
+                if (size + n > MAX_INPUT)
+                    break;
+                memmove(&out[at + n], &out[at], size - at);
+                memset(&out[at], out[at + n], n);
+                size += n;
+                break;
+            }
+        }
+    }
+    return size;
+}
+
+static void addInput(Input *corpus, uint32_t *count, const uint8_t *data, size_t size){
+    if (*count >= MAX_CORPUS)
+        return;
+    corpus[*count].data = (uint8_t *)malloc(size ? size : 1);
+    memcpy(corpus[*count].data, data, size);
+    corpus[*count].size = size;
+    (*count)++;
+}
+
+// @return 1 if the last run's map has an edge `seen` does not, which it then gets
+static int newCoverage(const uint8_t *map, uint8_t *seen){
+    const uint64_t *words = (const uint64_t *)map;
+    int found = 0;
+
+    // most of the map is zero, so skip it eight counters at a time
+    for (uint32_t w = 0; w < FUZZ_MAP_SIZE / 8; w++){
+        if (!words[w])
+            continue;
+        for (uint32_t i = w * 8; i < w * 8 + 8; i++){
+            if (map[i] && !seen[i]){
+                seen[i] = 1;
+                found = 1;
+            }
+        }
+    }
+    return found;
+}
+
+int main(int argc, char *argv[]) {
+    const char *rom = NULL;
+    const char *dir = ".";
+    uint64_t max_execs = 0;
+    double max_seconds = 10;
+    uint64_t limit = FUZZ_DEFAULT_LIMIT;
+    uint16_t ram_start = 0, ram_length = 0;
+    static Input corpus[MAX_CORPUS];
+    uint32_t count = 0;
+    int first_seed = 0;
+
+    for (int i = 1; i < argc; i++){
+        if (argv[i][0] != '-'){
+            rom = argv[i];
+            first_seed = i + 1;
+            break;
+        } else if (i + 1 < argc && strcmp(argv[i], "-n") == 0){
+            max_execs = strtoull(argv[++i], NULL, 0);
+        } else if (i + 1 < argc && strcmp(argv[i], "-t") == 0){
+            max_seconds = atof(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-s") == 0){
+            rng_state = strtoull(argv[++i], NULL, 0) * 2654435761ULL + 1;
+        } else if (i + 1 < argc && strcmp(argv[i], "-l") == 0){
+            limit = strtoull(argv[++i], NULL, 0);
+        } else if (i + 1 < argc && strcmp(argv[i], "-o") == 0){
+            dir = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-r") == 0){
+            char *end;
+            ram_start = strtoul(argv[++i], &end, 0);
+            ram_length = *end == ':' ? strtoul(end + 1, NULL, 0) : 0;
+        } else{
+            usage(argv[0]);
+        }
+    }
+    if (!rom)
+        usage(argv[0]);
+
+    uint8_t *image = (uint8_t *)calloc(0x10000, 1);
+    if (machineLoadROM(image, rom, 0) < 0){
+        printf("Cannot read %s\n", rom);
+        exit(EXIT_FAILURE);
+    }
+    Fuzzer *fz = fuzzCreate(image, NULL);
+    if (!fz){
+        printf("Cannot map the fuzzer's memory\n");
+        exit(EXIT_FAILURE);
+    }
+    fz->ram_start = ram_start;
+    fz->ram_length = ram_length;
+    fz->max_instructions = limit;
+
+    uint8_t *seen = (uint8_t *)calloc(FUZZ_MAP_SIZE, 1);
+    uint8_t *buffer = (uint8_t *)malloc(MAX_INPUT);
+    for (int i = first_seed; i > 0 && i < argc; i++){
+        FILE *f = fopen(argv[i], "rb");
+        if (!f){
+            printf("Cannot read %s\n", argv[i]);
+            continue;
+        }
+        size_t size = fread(buffer, 1, MAX_INPUT, f);
+        fclose(f);
+        addInput(corpus, &count, buffer, size);
+    }
+    if (!count)
+        addInput(corpus, &count, buffer, 0);
+
+    struct { FuzzResult result; uint16_t pc; } faults[MAX_FAULTS];
+    int nfaults = 0;
+    uint64_t crashes = 0;
+    uint64_t results[FUZZ_STACK + 1] = {0};
+    double start = nowSeconds(), last = start, now = start;
+
+    while ((!max_execs || fz->execs < max_execs) && now - start < max_seconds){
+        size_t size = mutate(&corpus[rnd(count)], buffer);
+
+        memset(fz->map, 0, FUZZ_MAP_SIZE);
+        FuzzResult result = fuzzRun(fz, buffer, size);
+        results[result]++;
+
+        if (fuzzCrashed(result)){
+            int known = 0;
+            crashes++;
+            for (int i = 0; i < nfaults; i++)
+                known |= faults[i].result == result && faults[i].pc == fz->fault_pc;
+            if (!known && nfaults < MAX_FAULTS){
+                char path[4096];
+                faults[nfaults].result = result;
+                faults[nfaults].pc = fz->fault_pc;
+                snprintf(path, sizeof(path), "%s/crash-%d", dir, nfaults++);
+                FILE *f = fopen(path, "wb");
+                if (f){
+                    fwrite(buffer, 1, size, f);
+                    fclose(f);
+                }
+                printf("%s at %04x (opcode %02x): %s\n", fuzzResultName(result), fz->fault_pc,
+                       fz->fault_opcode, path);
+            }
+        }
+        if (newCoverage(fz->map, seen))
+            addInput(corpus, &count, buffer, size);
+
+        if ((fz->execs & 255) == 0){
+            now = nowSeconds();
+            if (now - last >= 1){
+                printf("%6.1f s  %llu execs  %.0f/s  %u edges  corpus %u  %llu crashes\n", now - start,
+                       (unsigned long long)fz->execs, fz->execs / (now - start), fuzzCountEdges(seen), count,
+                       (unsigned long long)crashes);
+                last = now;
+            }
+        }
+    }
+    now = nowSeconds();
+
+    printf("%llu execs in %.1f s: %.0f/s; %u edges, corpus %u, %d distinct crashes\n",
+           (unsigned long long)fz->execs, now - start, now > start ? fz->execs / (now - start) : 0.0,
+           fuzzCountEdges(seen), count, nfaults);
+    for (int r = 0; r <= FUZZ_STACK; r++)
+        if (results[r])
+            printf("  %-22s %llu\n", fuzzResultName((FuzzResult)r), (unsigned long long)results[r]);
+
+    for (uint32_t i = 0; i < count; i++)
+        free(corpus[i].data);
+    free(seen);
+    free(buffer);
+    free(image);
+    fuzzFree(fz);
+    return nfaults ? EXIT_FAILURE : 0;
+}
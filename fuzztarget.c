@@ -0,0 +1,54 @@
+/*
+ * libFuzzer entry point for guest firmware. The guest's edge counters are
+ * placed in libFuzzer's extra counters, so it keeps the inputs that reach
+ * new guest code. A crash (unimplemented opcode, stack in ROM) aborts, which
+ * libFuzzer reports and saves.
+ *
+ * build: clang -O2 -fsanitize=fuzzer -o fuzztarget fuzztarget.c fuzz.c arena.c machine.c emulator.c
+ * usage: FUZZ_ROM=<rom> [FUZZ_RAM=start:length] ./fuzztarget [libFuzzer options] [corpus]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "emulator.h"
+#include "machine.h"
+#include "fuzz.h"
+
+static uint8_t guest_edges[FUZZ_MAP_SIZE] __attribute__((section("__libfuzzer_extra_counters")));
+static Fuzzer *fuzzer;
+
+int LLVMFuzzerInitialize(int *argc, char ***argv){
+    const char *rom = getenv("FUZZ_ROM");
+    const char *ram = getenv("FUZZ_RAM");
+    (void)argc;
+    (void)argv;
+
+    uint8_t *image = (uint8_t *)calloc(0x10000, 1);
+    if (!rom || machineLoadROM(image, rom, 0) < 0){
+        fprintf(stderr, "Set FUZZ_ROM to a readable ROM image\n");
+        exit(EXIT_FAILURE);
+    }
+    fuzzer = fuzzCreate(image, guest_edges);
+    free(image);
+    if (!fuzzer){
+        fprintf(stderr, "Cannot map the fuzzer's memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (ram){
+        char *end;
+        fuzzer->ram_start = strtoul(ram, &end, 0);
+        fuzzer->ram_length = *end == ':' ? strtoul(end + 1, NULL, 0) : 0;
+    }
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+    FuzzResult result = fuzzRun(fuzzer, data, size);
+
+    if (fuzzCrashed(result)){
+        fprintf(stderr, "%s at %04x (opcode %02x)\n", fuzzResultName(result), fuzzer->fault_pc,
+                fuzzer->fault_opcode);
+        abort();
+    }
+    return 0;
+}
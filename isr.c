@@ -0,0 +1,107 @@
+#include "isr.h"
+#include <stdlib.h>
+#include <string.h>
+
+IsrStats *isrCreate(uint32_t budget, size_t log_limit){
+    IsrStats *stats = (IsrStats *)calloc(1, sizeof(IsrStats));
+
+    stats->budget = budget ? budget : ISR_DEFAULT_BUDGET;
+    stats->log_limit = log_limit;
+    for (int v = 0; v < ISR_VECTORS; v++)
+        stats->vectors[v].min = UINT64_MAX;
+
+    return stats;
+}
+
+void isrFree(IsrStats *stats){
+    if (!stats)
+        return;
+    free(stats->log);
+    free(stats);
+}
+
+void isrEnter(IsrStats *stats, const State8080 *state, int vector, uint64_t requested){
+    if (stats->depth == ISR_MAX_NESTING)
+        return;
+
+    IsrEvent *ev = &stats->open[stats->depth];
+    ev->vector = vector & (ISR_VECTORS - 1);
+    ev->depth = stats->depth;
+    ev->requested = requested;
+    ev->entry = state->cycles;
+    ev->exit = 0;
+    stats->slot[stats->depth] = state->sp;
+    stats->depth++;
+}
+
+void isrLeave(IsrStats *stats, const State8080 *state){
+    IsrEvent ev = stats->open[--stats->depth];
+    IsrVectorStats *vs = &stats->vectors[ev.vector];
+    uint64_t cycles, latency;
+
+    ev.exit = state->cycles;
+    cycles = ev.exit - ev.entry;
+    latency = ev.entry - ev.requested;
+
+    vs->count++;
+    vs->total += cycles;
+    if (cycles > vs->max)       vs->max = cycles;
+    if (cycles < vs->min)       vs->min = cycles;
+    if (cycles > stats->budget) vs->overruns++;
+    vs->latency_total += latency;
+    if (latency > vs->latency_max)  vs->latency_max = latency;
+    vs->histogram[cycles / ISR_BUCKET_CYCLES < ISR_BUCKETS ? cycles / ISR_BUCKET_CYCLES : ISR_BUCKETS - 1]++;
+
+    if (stats->nlog < stats->log_limit){
+        if (stats->nlog == stats->log_capacity){
+            stats->log_capacity = stats->log_capacity ? stats->log_capacity * 2 : 4096;
+            if (stats->log_capacity > stats->log_limit)
+                stats->log_capacity = stats->log_limit;
+            stats->log = (IsrEvent *)realloc(stats->log, stats->log_capacity * sizeof(IsrEvent));
+        }
+        stats->log[stats->nlog++] = ev;
+    }
+}
+
+void isrReport(IsrStats *stats, FILE *out){
+    fprintf(out, "# interrupt handlers, budget %u cycles\n", stats->budget);
+    fprintf(out, "# RST      count       mean        min        max  overruns  mean-latency  max-latency\n");
+
+    for (int v = 0; v < ISR_VECTORS; v++){
+        IsrVectorStats *vs = &stats->vectors[v];
+        if (!vs->count)
+            continue;
+        fprintf(out, "  %d  %10llu %10.1f %10llu %10llu %9llu %13.1f %12llu\n", v,
+                (unsigned long long)vs->count, (double)vs->total / vs->count,
+                (unsigned long long)vs->min, (unsigned long long)vs->max,
+                (unsigned long long)vs->overruns,
+                (double)vs->latency_total / vs->count, (unsigned long long)vs->latency_max);
+    }
+
+    for (int v = 0; v < ISR_VECTORS; v++){
+        IsrVectorStats *vs = &stats->vectors[v];
+        if (!vs->count)
+            continue;
+        fprintf(out, "\n# RST %d cycles histogram\n", v);
+        for (int b = 0; b < ISR_BUCKETS; b++){
+            if (!vs->histogram[b])
+                continue;
+            if (b == ISR_BUCKETS - 1)
+                fprintf(out, "  %6d+       %10llu\n", b * ISR_BUCKET_CYCLES, (unsigned long long)vs->histogram[b]);
+            else
+                fprintf(out, "  %6d-%-6d %10llu\n", b * ISR_BUCKET_CYCLES, (b + 1) * ISR_BUCKET_CYCLES - 1,
+                        (unsigned long long)vs->histogram[b]);
+        }
+    }
+}
+
+void isrWriteLog(IsrStats *stats, FILE *out){
+    fprintf(out, "vector,depth,requested,entry,exit,cycles,latency\n");
+    for (size_t i = 0; i < stats->nlog; i++){
+        IsrEvent *ev = &stats->log[i];
+        fprintf(out, "%u,%u,%llu,%llu,%llu,%llu,%llu\n", ev->vector, ev->depth,
+                (unsigned long long)ev->requested, (unsigned long long)ev->entry,
+                (unsigned long long)ev->exit, (unsigned long long)(ev->exit - ev->entry),
+                (unsigned long long)(ev->entry - ev->requested));
+    }
+}
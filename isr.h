@@ -0,0 +1,81 @@
+#ifndef ISR_H
+#define ISR_H
+#include <stdio.h>
+#include <stdint.h>
+#include "emulator.h"
+
+/*
+ * Interrupt service accounting.
+ *
+ * Every delivered interrupt is logged with the cycle it was requested, the cycle
+ * the handler was entered, the cycle its matching RET returned and how many
+ * handlers were already running. A handler is over once SP rises above the slot
+ * its return address was pushed to, the same rule the call-graph profiler uses.
+ *
+ * Build with -DISRSTATS to hook it into the run loop (see ISR_ENTER/ISR_STEP).
+ */
+
+#define ISR_VECTORS         8
+#define ISR_MAX_NESTING     8
+#define ISR_BUCKET_CYCLES   1024    // histogram bucket width
+#define ISR_BUCKETS         32      // the last bucket collects everything longer
+#define ISR_DEFAULT_BUDGET  16667   // half a Space Invaders frame: 2 MHz / 120 interrupts per second
+
+typedef struct IsrEvent {
+    uint64_t   requested;
+    uint64_t   entry;
+    uint64_t   exit;
+    uint8_t    vector;
+    uint8_t    depth;       // handlers already running when this one was entered
+} IsrEvent;
+
+typedef struct IsrVectorStats {
+    uint64_t   count;
+    uint64_t   total;       // handler cycles
+    uint64_t   max;
+    uint64_t   min;
+    uint64_t   overruns;    // handlers longer than the budget
+    uint64_t   latency_total;   // cycles from request to entry
+    uint64_t   latency_max;
+    uint64_t   histogram[ISR_BUCKETS];
+} IsrVectorStats;
+
+typedef struct IsrStats {
+    uint32_t   budget;
+    IsrVectorStats  vectors[ISR_VECTORS];
+    int        depth;
+    uint16_t   slot[ISR_MAX_NESTING];
+    IsrEvent   open[ISR_MAX_NESTING];
+    IsrEvent   *log;        // completed handlers, in completion order
+    size_t     nlog;
+    size_t     log_capacity;
+    size_t     log_limit;   // stop logging (but keep counting) past this many events
+} IsrStats;
+
+IsrStats *isrCreate(uint32_t budget, size_t log_limit);
+void isrFree(IsrStats *stats);
+
+// call right after GenerateInterrupt()
+void isrEnter(IsrStats *stats, const State8080 *state, int vector, uint64_t requested);
+void isrLeave(IsrStats *stats, const State8080 *state);
+
+// call after every instruction; closes the handlers the instruction returned from
+static inline void isrStep(IsrStats *stats, const State8080 *state){
+    while (stats->depth > 0 && stats->slot[stats->depth - 1] < state->sp)
+        isrLeave(stats, state);
+}
+
+void isrReport(IsrStats *stats, FILE *out);
+
+// CSV: vector,depth,requested,entry,exit,cycles,latency
+void isrWriteLog(IsrStats *stats, FILE *out);
+
+#ifdef ISRSTATS
+#define ISR_ENTER(stats, state, vector, requested)  isrEnter((stats), (state), (vector), (requested))
+#define ISR_STEP(stats, state)                      isrStep((stats), (state))
+#else
+#define ISR_ENTER(stats, state, vector, requested)  ((void)(requested))
+#define ISR_STEP(stats, state)                      ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * Run a ROM on every lane of the lockstep engine and then on the scalar
+ * core one lane at a time, check that both end in the same state and
+ * compare their speed per lane.
+ *
+ * usage: lockbench [-n steps] [-d] <rom>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emulator.h"
+#include "machine.h"
+#include "lockstep.h"
+
+static int lane_ids[LOCKSTEP_LANES];
+
+// with -d every lane reads its own input, so the lanes' paths can split
+static uint8_t laneInput(State8080 *state, uint8_t port){
+    return (uint8_t)(*(int *)state->io * 0x3b + port);
+}
+
+static uint8_t sameInput(State8080 *state, uint8_t port){
+    (void)state;
+    return port;
+}
+
+static double nowSeconds(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void setupLane(State8080 *state, int lane, int diverge){
+    lane_ids[lane] = lane;
+    state->io = &lane_ids[lane];
+    state->port_in = diverge ? laneInput : sameInput;
+}
+
+static int sameState(const State8080 *x, const State8080 *y){
+    return x->a == y->a && x->b == y->b && x->c == y->c && x->d == y->d && x->e == y->e &&
+           x->h == y->h && x->l == y->l && x->sp == y->sp && x->pc == y->pc &&
+           x->cc.z == y->cc.z && x->cc.s == y->cc.s && x->cc.p == y->cc.p &&
+           x->cc.cy == y->cc.cy && x->cc.ac == y->cc.ac && x->int_enable == y->int_enable &&
+           x->cycles == y->cycles && x->stop == y->stop && memcmp(x->memory, y->memory, 0x10000) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *rom = NULL;
+    uint64_t steps = 10000000;
+    int diverge = 0;
+
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "-d") == 0){
+            diverge = 1;
+        } else if (i + 1 < argc && strcmp(argv[i], "-n") == 0){
+            steps = strtoull(argv[++i], NULL, 0);
+        } else if (argv[i][0] != '-' && !rom){
+            rom = argv[i];
+        } else{
+            rom = NULL;
+            break;
+        }
+    }
+    if (!rom){
+        printf("usage: %s [-n steps] [-d] <rom>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t *image = (uint8_t *)calloc(0x10000, 1);
+    long rom_size = machineLoadROM(image, rom, 0);
+    if (rom_size < 0){
+        printf("Cannot read %s\n", rom);
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t *memories[LOCKSTEP_LANES];
+    for (int l = 0; l < LOCKSTEP_LANES; l++){
+        memories[l] = (uint8_t *)malloc(0x10000);
+        memcpy(memories[l], image, 0x10000);
+    }
+    Lockstep *ls = lockstepCreate(memories, rom_size);
+    for (int l = 0; l < LOCKSTEP_LANES; l++)
+        setupLane(&ls->lanes[l], l, diverge);
+
+    double start = nowSeconds();
+    uint64_t ran = lockstepRun(ls, steps);
+    double vector_seconds = nowSeconds() - start;
+    lockstepStore(ls);
+    uint64_t lane_instructions = ls->vector_instructions + ls->scalar_instructions;
+
+    // the same lanes on the scalar core, each for as many instructions
+    uint8_t *memory = (uint8_t *)malloc(0x10000);
+    State8080 state;
+    uint64_t scalar_instructions = 0;
+    double scalar_seconds = 0;
+    int mismatches = 0;
+
+    for (int l = 0; l < LOCKSTEP_LANES; l++){
+        memcpy(memory, image, 0x10000);
+        resetState(&state, memory);
+        setupLane(&state, l, diverge);
+
+        start = nowSeconds();
+        uint64_t n;
+        for (n = 0; n < ran && state.stop == STOP_NONE; n++)
+            Emulate8080Op(&state);
+        scalar_seconds += nowSeconds() - start;
+        scalar_instructions += n;
+
+        if (!sameState(&state, &ls->lanes[l])){
+            printf("lane %d differs: lockstep pc %04x cycles %llu, scalar pc %04x cycles %llu\n", l,
+                   ls->lanes[l].pc, (unsigned long long)ls->lanes[l].cycles, state.pc,
+                   (unsigned long long)state.cycles);
+            mismatches++;
+        }
+    }
+
+    printf("%d lanes, %llu steps, %s input\n", LOCKSTEP_LANES, (unsigned long long)ran,
+           diverge ? "per-lane" : "the same");
+    printf("vector steps  %.1f%%, %.1f lanes each; %.1f%% of lane instructions vectorized\n",
+           ran ? 100.0 * ls->vector_steps / ran : 0.0,
+           ls->vector_steps ? (double)ls->vector_instructions / ls->vector_steps : 0.0,
+           lane_instructions ? 100.0 * ls->vector_instructions / lane_instructions : 0.0);
+    printf("lockstep      %llu lane instructions in %.3f s: %.2f ns each, %.2f MIPS\n",
+           (unsigned long long)lane_instructions, vector_seconds,
+           lane_instructions ? vector_seconds * 1e9 / lane_instructions : 0.0,
+           vector_seconds > 0 ? lane_instructions / vector_seconds / 1e6 : 0.0);
+    printf("scalar        %llu instructions in %.3f s: %.2f ns each, %.2f MIPS\n",
+           (unsigned long long)scalar_instructions, scalar_seconds,
+           scalar_instructions ? scalar_seconds * 1e9 / scalar_instructions : 0.0,
+           scalar_seconds > 0 ? scalar_instructions / scalar_seconds / 1e6 : 0.0);
+    if (vector_seconds > 0 && scalar_instructions)
+        printf("speedup       %.2fx\n", (lane_instructions / vector_seconds) / (scalar_instructions / scalar_seconds));
+    printf("%s\n", mismatches ? "STATE MISMATCH" : "all lanes match the scalar core");
+
+    lockstepFree(ls);
+    for (int l = 0; l < LOCKSTEP_LANES; l++)
+        free(memories[l]);
+    free(memory);
+    free(image);
+    return mismatches ? EXIT_FAILURE : 0;
+}
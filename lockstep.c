@@ -0,0 +1,478 @@
+#include "lockstep.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+// vector steps between flushes of new_cycles, well short of overflowing it
+#define LOCKSTEP_FLUSH  (1 << 24)
+
+typedef int8_t  SLane8  __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef int16_t SLane16 __attribute__((vector_size(LOCKSTEP_LANES * 2)));
+typedef int32_t SLane32 __attribute__((vector_size(LOCKSTEP_LANES * 4)));
+
+/*
+ * The helpers are macros: with 32 lanes and no AVX a vector is wider than a
+ * register, and GCC notes an ABI change for every function that takes one.
+ */
+#define WIDEN(v)        __builtin_convertvector((v), LockLane16)
+#define NARROW(v)       __builtin_convertvector((v), LockLane8)
+// a comparison result (0 or all ones) as 0 or 1
+#define BIT(c)          ((LockLane8)(c) & 1)
+#define SPLAT8(x)       ((LockLane8){0} + (uint8_t)(x))
+#define SPLAT16(x)      ((LockLane16){0} + (uint16_t)(x))
+// a 0/0xff lane mask as 0/0xffff
+#define MASK16(m)       ((LockLane16)__builtin_convertvector((SLane8)(m), SLane16))
+#define BLEND(m, x, old) (((x) & (m)) | ((old) & ~(m)))
+// 1 where the byte has even parity, as parity() does
+#define PARITY(v)       ({ LockLane8 x_ = (v); x_ ^= x_ >> 4; x_ ^= x_ >> 2; x_ ^= x_ >> 1; ~x_ & 1; })
+// the lanes where condition 0-7 (NZ Z NC C PO PE P M) holds
+#define CONDITION(ls, cc) ((LockLane8)(((cc) < 2 ? (ls)->z : (cc) < 4 ? (ls)->cy : (cc) < 6 ? (ls)->p : (ls)->s) == ((cc) & 1)))
+// register pair 0-2 (BC, DE, HL) as in the opcodes; 3 is SP
+#define PAIR(ls, rp)    (WIDEN((ls)->r[(rp) * 2]) << 8 | WIDEN((ls)->r[(rp) * 2 + 1]))
+
+// set Z, S and P from `x` in the lanes of this step
+#define SET_ZSP(ls, x) do{ \
+        LockLane8 v_ = (x); \
+        (ls)->z = BLEND((ls)->mask, BIT(v_ == 0), (ls)->z); \
+        (ls)->s = BLEND((ls)->mask, v_ >> 7, (ls)->s); \
+        (ls)->p = BLEND((ls)->mask, PARITY(v_), (ls)->p); \
+    } while (0)
+
+static void setPair(Lockstep *ls, int rp, const LockLane16 *value){
+    if (rp == 3){
+        ls->sp = BLEND(MASK16(ls->mask), *value, ls->sp);
+        return;
+    }
+    ls->r[rp * 2] = BLEND(ls->mask, NARROW(*value >> 8), ls->r[rp * 2]);
+    ls->r[rp * 2 + 1] = BLEND(ls->mask, NARROW(*value), ls->r[rp * 2 + 1]);
+}
+
+/*
+ * The ALU group (ADD ADC SUB SBB ANA XRA ORA CMP) with operand x, flags
+ * as the scalar core sets them
+ */
+static void alu(Lockstep *ls, int kind, const LockLane8 *x){
+    LockLane8 a = ls->r[LOCK_A];
+    LockLane16 answer;
+
+    switch (kind){
+        case 0: answer = WIDEN(a) + WIDEN(*x); break;
+        case 1: answer = WIDEN(a) + WIDEN(*x) + WIDEN(ls->cy); break;
+        case 2: answer = WIDEN(a) - WIDEN(*x); break;
+        case 3: answer = WIDEN(a) - WIDEN(*x) - WIDEN(ls->cy); break;
+        case 4: answer = WIDEN(a & *x); break;
+        case 5: answer = WIDEN(a ^ *x); break;
+        case 6: answer = WIDEN(a | *x); break;
+        default:
+            // CMP: A is kept and CY is set when there is no borrow
+            answer = WIDEN(a) - WIDEN(*x);
+            SET_ZSP(ls, NARROW(answer));
+            ls->cy = BLEND(ls->mask, BIT(NARROW(answer >> 8) == 0), ls->cy);
+            return;
+    }
+    SET_ZSP(ls, NARROW(answer));
+    ls->cy = BLEND(ls->mask, BIT(NARROW(answer >> 8) != 0), ls->cy);
+    ls->r[LOCK_A] = BLEND(ls->mask, NARROW(answer), a);
+}
+
+// one bit per lane of a 0/0xff lane mask
+static inline uint32_t laneBits(const LockLane8 *m){
+#if defined(__AVX2__) && LOCKSTEP_LANES == 32
+    return _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)m));
+#elif defined(__SSE2__)
+    uint32_t bits = 0;
+    for (int i = 0; i < LOCKSTEP_LANES; i += 16){
+        const __m128i *p = (const __m128i *)((const uint8_t *)m + i);
+        bits |= (uint32_t)_mm_movemask_epi8(LOCKSTEP_LANES == 8 ? _mm_loadl_epi64(p) : _mm_loadu_si128(p)) << i;
+    }
+    return bits;
+#else
+    uint32_t bits = 0;
+    for (int l = 0; l < LOCKSTEP_LANES; l++)
+        bits |= (uint32_t)((*m)[l] & 1) << l;
+    return bits;
+#endif
+}
+
+// each lane in `lanes` reads its own memory at its own address
+static void gather(Lockstep *ls, uint32_t lanes, const LockLane16 *address, LockLane8 *value){
+    for (; lanes; lanes &= lanes - 1){
+        int l = __builtin_ctz(lanes);
+        (*value)[l] = ls->lanes[l].memory[(*address)[l]];
+    }
+}
+
+static void scatter(Lockstep *ls, uint32_t lanes, const LockLane16 *address, const LockLane8 *value){
+    for (; lanes; lanes &= lanes - 1){
+        int l = __builtin_ctz(lanes);
+        writeMemory(&ls->lanes[l], (*address)[l], (*value)[l]);
+    }
+}
+
+// a word from every lane's stack, read the way the core does; SP is moved by the caller
+static void popWord(Lockstep *ls, uint32_t lanes, LockLane16 *value){
+    for (; lanes; lanes &= lanes - 1){
+        int l = __builtin_ctz(lanes);
+        const uint8_t *memory = ls->lanes[l].memory;
+        uint16_t sp = ls->sp[l];
+        (*value)[l] = memory[sp] | (memory[sp + 1] << 8);
+    }
+}
+
+// push onto every lane's stack; SP is moved by the caller
+static void pushWord(Lockstep *ls, uint32_t lanes, const LockLane16 *value){
+    for (; lanes; lanes &= lanes - 1){
+        int l = __builtin_ctz(lanes);
+        writeMemory(&ls->lanes[l], ls->sp[l] - 1, (*value)[l] >> 8);
+        writeMemory(&ls->lanes[l], ls->sp[l] - 2, (*value)[l] & 0xff);
+    }
+}
+
+/*
+ * The core pushes the return address of a CALL before it reads the target,
+ * so a stack just above the instruction changes where it goes. Leave that
+ * to the core.
+ */
+static int pushesOverOperand(const Lockstep *ls, const LockLane8 *lanes){
+    LockLane8 overlap = NARROW((LockLane16)((LockLane16)(ls->sp - ls->pc - 2) <= 2)) & *lanes;
+    return laneBits(&overlap) != 0;
+}
+
+/*
+ * Run instruction `op` on the lanes in ls->mask (`lanes` as bits), if it
+ * only needs registers, flags and memory operands
+ * @return 0 if it has to go through the scalar core instead
+ */
+static int vectorOp(Lockstep *ls, uint32_t lanes, const uint8_t *op){
+    uint8_t code = op[0];
+    uint16_t length = 1;
+    uint16_t target = (op[2] << 8) | op[1];
+    int reg = (code >> 3) & 7;
+    int rp = code >> 4;
+    LockLane8 m = ls->mask;
+    LockLane16 m16 = MASK16(m);
+    LockLane8 a = ls->r[LOCK_A];
+    LockLane16 hl = PAIR(ls, 2);
+    LockLane8 x = {0};
+
+    if (code >= 0x80 && code < 0xc0){
+        if (code == 0xbf){
+            // CMP A
+            ls->z = BLEND(m, SPLAT8(1), ls->z);
+            ls->s = BLEND(m, SPLAT8(0), ls->s);
+            ls->p = BLEND(m, SPLAT8(1), ls->p);
+            ls->cy = BLEND(m, SPLAT8(0), ls->cy);
+        } else if ((code & 7) == LOCK_M){
+            gather(ls, lanes, &hl, &x);
+            // the core's XRA M is an AND
+            alu(ls, code == 0xae ? 4 : reg, &x);
+        } else{
+            alu(ls, reg, &ls->r[code & 7]);
+        }
+        // the core steps over a byte after CMP
+        if (reg == 7)
+            length = 2;
+    } else if (code < 0x40 && (code & 6) == 4){
+        // INR / DCR
+        if (reg == LOCK_M)
+            gather(ls, lanes, &hl, &x);
+        else
+            x = ls->r[reg];
+        LockLane8 answer = (code & 1) ? x - 1 : x + 1;
+        LockLane8 ac = (code & 1) ? BIT((answer & 0xf) > (x & 0xf)) : BIT((answer & 0xf) < (x & 0xf));
+        SET_ZSP(ls, answer);
+        ls->ac = BLEND(m, ac, ls->ac);
+        if (reg == LOCK_M)
+            scatter(ls, lanes, &hl, &answer);
+        else
+            ls->r[reg] = BLEND(m, answer, x);
+    } else{
+        LockLane16 value;
+        LockLane8 imm = SPLAT8(op[1]);
+
+        switch (code){
+            case 0x00: break;
+            case 0x06: case 0x0e: case 0x16: case 0x26: case 0x3e:  // MVI r (not E, L)
+                ls->r[reg] = BLEND(m, imm, ls->r[reg]);
+                length = 2;
+                break;
+            case 0x36:  // MVI M
+                scatter(ls, lanes, &hl, &imm);
+                length = 2;
+                break;
+            case 0x6f: case 0x7a: case 0x7b: case 0x7c:             // the MOVs the core has
+                ls->r[reg] = BLEND(m, ls->r[code & 7], ls->r[reg]);
+                break;
+            case 0x56: case 0x5e: case 0x66: case 0x7e:             // MOV r, M
+                gather(ls, lanes, &hl, &x);
+                ls->r[reg] = BLEND(m, x, ls->r[reg]);
+                break;
+            case 0x77:  // MOV M, A
+                scatter(ls, lanes, &hl, &a);
+                break;
+            case 0x1a:  // LDAX D
+                value = PAIR(ls, 1);
+                gather(ls, lanes, &value, &x);
+                ls->r[LOCK_A] = BLEND(m, x, a);
+                break;
+            case 0x3a:  // LDA
+                value = SPLAT16(target);
+                gather(ls, lanes, &value, &x);
+                ls->r[LOCK_A] = BLEND(m, x, a);
+                length = 3;
+                break;
+            case 0x32:  // STA
+                value = SPLAT16(target);
+                scatter(ls, lanes, &value, &a);
+                length = 3;
+                break;
+            case 0x01: case 0x11: case 0x21: case 0x31:             // LXI
+                value = SPLAT16(target);
+                setPair(ls, rp, &value);
+                length = 3;
+                break;
+            case 0x03: case 0x13: case 0x23: case 0x33:             // INX
+                value = (rp == 3 ? ls->sp : PAIR(ls, rp)) + 1;
+                setPair(ls, rp, &value);
+                break;
+            case 0x0b: case 0x1b: case 0x2b: case 0x3b:             // DCX
+                value = (rp == 3 ? ls->sp : PAIR(ls, rp)) - 1;
+                setPair(ls, rp, &value);
+                break;
+            case 0x09: case 0x19: case 0x29: case 0x39:             // DAD
+                value = hl + (rp == 3 ? ls->sp : PAIR(ls, rp));
+                ls->cy = BLEND(m, BIT(NARROW((LockLane16)(value < hl))), ls->cy);
+                setPair(ls, 2, &value);
+                break;
+            case 0x07:  // RLC
+                ls->r[LOCK_A] = BLEND(m, a << 1 | a >> 7, a);
+                ls->cy = BLEND(m, a >> 7, ls->cy);
+                break;
+            case 0x0f:  // RRC
+                ls->r[LOCK_A] = BLEND(m, a << 7 | a >> 1, a);
+                ls->cy = BLEND(m, a & 1, ls->cy);
+                break;
+            case 0x17:  // RAL
+                ls->r[LOCK_A] = BLEND(m, a << 1 | ls->cy, a);
+                ls->cy = BLEND(m, a >> 7, ls->cy);
+                break;
+            case 0x1f:  // RAR
+                ls->r[LOCK_A] = BLEND(m, ls->cy << 7 | a >> 1, a);
+                ls->cy = BLEND(m, a & 1, ls->cy);
+                break;
+            case 0x2f:  // CMA
+                ls->r[LOCK_A] = BLEND(m, ~a, a);
+                break;
+            case 0x37:  // STC
+                ls->cy = BLEND(m, SPLAT8(1), ls->cy);
+                break;
+            case 0x3f:  // CMC
+                ls->cy = BLEND(m, ls->cy ^ 1, ls->cy);
+                break;
+            case 0xc6: case 0xce: case 0xe6: case 0xfe:             // ADI ACI ANI CPI
+                alu(ls, reg, &imm);
+                length = 2;
+                break;
+            case 0xc3:  // JMP
+                ls->pc = BLEND(m16, SPLAT16(target), ls->pc);
+                length = 0;
+                break;
+            case 0xc2: case 0xca: case 0xd2: case 0xda:             // Jcc
+            case 0xe2: case 0xea: case 0xf2: case 0xfa:
+                ls->pc = BLEND(m16, BLEND(MASK16(CONDITION(ls, reg)), SPLAT16(target), ls->pc + 3), ls->pc);
+                length = 0;
+                break;
+            case 0xe9:  // PCHL
+                ls->pc = BLEND(m16, hl, ls->pc);
+                length = 0;
+                break;
+            case 0xf9:  // SPHL
+                ls->sp = BLEND(m16, hl, ls->sp);
+                break;
+            case 0xc1: case 0xd1: case 0xe1:                        // POP rp (not PSW)
+                popWord(ls, lanes, &value);
+                setPair(ls, (code >> 4) & 3, &value);
+                ls->sp = BLEND(m16, ls->sp + 2, ls->sp);
+                break;
+            case 0xc5: case 0xd5: case 0xe5:                        // PUSH rp
+                value = PAIR(ls, (code >> 4) & 3);
+                pushWord(ls, lanes, &value);
+                ls->sp = BLEND(m16, ls->sp - 2, ls->sp);
+                break;
+            case 0xcd:  // CALL
+                if (pushesOverOperand(ls, &m))
+                    return 0;
+                value = ls->pc + 3;
+                pushWord(ls, lanes, &value);
+                ls->sp = BLEND(m16, ls->sp - 2, ls->sp);
+                ls->pc = BLEND(m16, SPLAT16(target), ls->pc);
+                length = 0;
+                break;
+            case 0xc9:  // RET
+                popWord(ls, lanes, &value);
+                ls->sp = BLEND(m16, ls->sp + 2, ls->sp);
+                ls->pc = BLEND(m16, value, ls->pc);
+                length = 0;
+                break;
+            case 0xc4: case 0xcc: case 0xd4: case 0xdc:             // Ccc
+            case 0xe4: case 0xec: case 0xf4: case 0xfc:
+            {
+                LockLane8 taken = m & CONDITION(ls, reg);
+                LockLane16 t16 = MASK16(taken);
+                if (pushesOverOperand(ls, &taken))
+                    return 0;
+                value = ls->pc + 3;
+                pushWord(ls, laneBits(&taken), &value);
+                ls->sp = BLEND(t16, ls->sp - 2, ls->sp);
+                ls->pc = BLEND(m16, BLEND(t16, SPLAT16(target), value), ls->pc);
+                ls->new_cycles += (LockLane32)__builtin_convertvector((SLane8)taken, SLane32) & 6;
+                length = 0;
+                break;
+            }
+            case 0xc0: case 0xc8: case 0xd0: case 0xd8:             // Rcc
+            case 0xe0: case 0xe8: case 0xf0: case 0xf8:
+            {
+                LockLane8 taken = m & CONDITION(ls, reg);
+                LockLane16 t16 = MASK16(taken);
+                popWord(ls, laneBits(&taken), &value);
+                ls->sp = BLEND(t16, ls->sp + 2, ls->sp);
+                ls->pc = BLEND(m16, BLEND(t16, value, ls->pc + 1), ls->pc);
+                ls->new_cycles += (LockLane32)__builtin_convertvector((SLane8)taken, SLane32) & 6;
+                length = 0;
+                break;
+            }
+            default:
+                return 0;
+        }
+    }
+
+    if (length)
+        ls->pc = BLEND(m16, ls->pc + length, ls->pc);
+    ls->new_cycles += (LockLane32)__builtin_convertvector((SLane8)m, SLane32) & cycles8080[code];
+    return 1;
+}
+
+static void flushCycles(Lockstep *ls){
+    for (int l = 0; l < LOCKSTEP_LANES; l++)
+        ls->cycles[l] += ls->new_cycles[l];
+    ls->new_cycles = (LockLane32){0};
+}
+
+static void storeLane(Lockstep *ls, int l){
+    State8080 *s = &ls->lanes[l];
+
+    s->a = ls->r[LOCK_A][l];
+    s->b = ls->r[LOCK_B][l];
+    s->c = ls->r[LOCK_C][l];
+    s->d = ls->r[LOCK_D][l];
+    s->e = ls->r[LOCK_E][l];
+    s->h = ls->r[LOCK_H][l];
+    s->l = ls->r[LOCK_L][l];
+    s->sp = ls->sp[l];
+    s->pc = ls->pc[l];
+    s->cc.z = ls->z[l];
+    s->cc.s = ls->s[l];
+    s->cc.p = ls->p[l];
+    s->cc.cy = ls->cy[l];
+    s->cc.ac = ls->ac[l];
+    s->cycles = ls->cycles[l] + ls->new_cycles[l];
+}
+
+static void loadLane(Lockstep *ls, int l){
+    const State8080 *s = &ls->lanes[l];
+
+    ls->r[LOCK_A][l] = s->a;
+    ls->r[LOCK_B][l] = s->b;
+    ls->r[LOCK_C][l] = s->c;
+    ls->r[LOCK_D][l] = s->d;
+    ls->r[LOCK_E][l] = s->e;
+    ls->r[LOCK_H][l] = s->h;
+    ls->r[LOCK_L][l] = s->l;
+    ls->sp[l] = s->sp;
+    ls->pc[l] = s->pc;
+    ls->z[l] = s->cc.z;
+    ls->s[l] = s->cc.s;
+    ls->p[l] = s->cc.p;
+    ls->cy[l] = s->cc.cy;
+    ls->ac[l] = s->cc.ac;
+    ls->cycles[l] = s->cycles;
+    ls->new_cycles[l] = 0;
+    ls->active[l] = s->stop == STOP_NONE ? 0xff : 0;
+}
+
+Lockstep *lockstepCreate(uint8_t *memories[LOCKSTEP_LANES], uint16_t rom_size){
+    size_t size = (sizeof(Lockstep) + 63) & ~(size_t)63;
+    Lockstep *ls = (Lockstep *)aligned_alloc(64, size);
+
+    memset(ls, 0, sizeof(Lockstep));
+    for (int l = 0; l < LOCKSTEP_LANES; l++)
+        resetState(&ls->lanes[l], memories[l]);
+    ls->rom_size = rom_size;
+    lockstepLoad(ls);
+    return ls;
+}
+
+void lockstepFree(Lockstep *ls){
+    free(ls);
+}
+
+void lockstepLoad(Lockstep *ls){
+    for (int l = 0; l < LOCKSTEP_LANES; l++)
+        loadLane(ls, l);
+}
+
+void lockstepStore(Lockstep *ls){
+    for (int l = 0; l < LOCKSTEP_LANES; l++)
+        storeLane(ls, l);
+}
+
+static void scalarStep(Lockstep *ls, int l){
+    storeLane(ls, l);
+    Emulate8080Op(&ls->lanes[l]);
+    loadLane(ls, l);
+    ls->scalar_instructions++;
+}
+
+uint64_t lockstepRun(Lockstep *ls, uint64_t steps){
+    uint64_t step;
+
+    for (step = 0; step < steps; step++){
+        uint32_t active = laneBits(&ls->active);
+        if (!active)
+            break;
+
+        int leader = __builtin_ctz(active);
+        uint16_t pc = ls->pc[leader];
+        const uint8_t *memory = ls->lanes[leader].memory;
+        uint8_t op[3] = {memory[pc], memory[(uint16_t)(pc + 1)], memory[(uint16_t)(pc + 2)]};
+        ls->mask = NARROW((LockLane16)(ls->pc == pc)) & ls->active;
+
+        // code in RAM may differ between lanes
+        if (pc + 3 > ls->rom_size){
+            for (int l = leader + 1; l < LOCKSTEP_LANES; l++){
+                const uint8_t *other = ls->lanes[l].memory;
+                if (ls->mask[l] && (other[pc] != op[0] || other[(uint16_t)(pc + 1)] != op[1] ||
+                                    other[(uint16_t)(pc + 2)] != op[2]))
+                    ls->mask[l] = 0;
+            }
+        }
+
+        uint32_t scalar = active;
+        uint32_t vector = laneBits(&ls->mask);
+        // an instruction that wraps past 0xffff is left to the core, which reads on past the end
+        if (pc < 0xfffe && vectorOp(ls, vector, op)){
+            ls->vector_steps++;
+            ls->vector_instructions += __builtin_popcount(vector);
+            scalar &= ~vector;
+            if ((ls->vector_steps & (LOCKSTEP_FLUSH - 1)) == 0)
+                flushCycles(ls);
+        }
+        for (; scalar; scalar &= scalar - 1)
+            scalarStep(ls, __builtin_ctz(scalar));
+        ls->steps++;
+    }
+    flushCycles(ls);
+    return step;
+}
@@ -0,0 +1,78 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+#include <stdint.h>
+#include "emulator.h"
+
+/*
+ * Experimental lockstep engine: LOCKSTEP_LANES instances of the CPU with
+ * their registers in structure-of-arrays form, one vector per register.
+ *
+ * Every step runs one instruction on every lane. The lanes whose PC matches
+ * the first running lane's (and whose opcode bytes match, for code outside
+ * the ROM) form the mask. Register, ALU, rotate, jump, call/return and
+ * push/pop instructions run on all masked lanes at once, with the results
+ * blended in by the mask; their memory operands are read and written lane
+ * by lane. Lanes off the mask, and I/O, EI/DI, PSW and the instructions the
+ * core does not implement, go through Emulate8080Op one lane at a time,
+ * with the lane's registers copied into its State8080 and back.
+ *
+ * The vectors are GCC vector extensions, so -mavx2 gives 32-byte AVX2
+ * registers and the default x86-64 build uses SSE2. The results are exactly
+ * those of the scalar core, quirks included.
+ *
+ * Only the CPU runs in lockstep: there is no Machine, so no shift register
+ * and no interrupts. Give each lane's State8080 port handlers for I/O.
+ */
+
+#ifndef LOCKSTEP_LANES
+#define LOCKSTEP_LANES 16   // 8, 16 or 32
+#endif
+
+typedef uint8_t  LockLane8  __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef uint16_t LockLane16 __attribute__((vector_size(LOCKSTEP_LANES * 2)));
+typedef uint32_t LockLane32 __attribute__((vector_size(LOCKSTEP_LANES * 4)));
+
+// register numbers as in the opcodes; 6 (M) is memory and unused
+enum { LOCK_B, LOCK_C, LOCK_D, LOCK_E, LOCK_H, LOCK_L, LOCK_M, LOCK_A };
+
+typedef struct Lockstep {
+    LockLane8  r[8];
+    LockLane8  z, s, p, cy, ac;     // 0 or 1
+    LockLane8  active;              // 0xff while the lane runs
+    LockLane8  mask;                // the lanes running this step's instruction together
+    LockLane16 sp, pc;
+    uint64_t   cycles[LOCKSTEP_LANES];
+    LockLane32 new_cycles;          // added by vector steps, not yet in cycles
+    // memory, port handlers, int_enable, stop and dirty bits; the registers
+    // are only up to date after lockstepStore
+    State8080  lanes[LOCKSTEP_LANES];
+    uint16_t   rom_size;            // code below this is the same in every lane
+    // counters
+    uint64_t   steps;
+    uint64_t   vector_steps;        // steps that ran a vector instruction
+    uint64_t   vector_instructions; // lane instructions run by those
+    uint64_t   scalar_instructions;
+} Lockstep;
+
+/*
+ * Allocate an engine with every lane at resetState on the given memory.
+ * @param memories One 64K memory per lane; lanes must not share one
+ * @param rom_size Bytes at the start of memory that hold the same code in
+ * every lane and are never written, so their opcodes need no comparing
+ */
+Lockstep *lockstepCreate(uint8_t *memories[LOCKSTEP_LANES], uint16_t rom_size);
+void lockstepFree(Lockstep *ls);
+
+// copy registers from lanes[] into the vectors, e.g. after changing them or a snapshot restore
+void lockstepLoad(Lockstep *ls);
+// copy the vectors out to lanes[], to read them or run a lane elsewhere
+void lockstepStore(Lockstep *ls);
+
+/*
+ * Run `steps` steps, or until every lane has stopped. A lane stops when its
+ * State8080 does (HLT, an unimplemented opcode).
+ * @return the steps run
+ */
+uint64_t lockstepRun(Lockstep *ls, uint64_t steps);
+
+#endif
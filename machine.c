@@ -0,0 +1,97 @@
+#include "machine.h"
+#include <stdio.h>
+#include <string.h>
+
+static uint8_t machineIn(State8080 *state, uint8_t port){
+    Machine *m = (Machine *)state->io;
+
+    if (port < 3)
+        return m->input_hook ? m->input_hook(m->hook_ctx, port, m->inputs[port]) : m->inputs[port];
+    if (port == 3)
+        return (m->shift >> (8 - m->shift_offset)) & 0xff;
+    return 0;
+}
+
+static void machineOut(State8080 *state, uint8_t port, uint8_t value){
+    Machine *m = (Machine *)state->io;
+
+    if (port == 2)
+        m->shift_offset = value & 0x7;
+    else if (port == 4)
+        m->shift = (value << 8) | (m->shift >> 8);
+    m->outputs[port & 0x7] = value;
+}
+
+void machineInit(Machine *m, State8080 *state){
+    memset(m, 0, sizeof(Machine));
+    m->state = state;
+    m->next_interrupt = state->cycles + HALF_FRAME_CYCLES;
+    m->next_vector = 1;
+    m->rom_size = MACHINE_ROM_SIZE;
+    // these bits are tied high on the real board
+    m->inputs[0] = 0x0e;
+    m->inputs[1] = 0x08;
+
+    state->port_in = machineIn;
+    state->port_out = machineOut;
+    state->io = m;
+}
+
+long machineLoadROM(uint8_t *memory, const char *path, uint16_t offset){
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return -1;
+
+    long size = fread(&memory[offset], 1, 0x10000 - offset, f);
+    fclose(f);
+
+    return size;
+}
+
+StopReason machineRun(Machine *m, uint64_t max_instructions, uint64_t max_cycles, uint64_t max_frames){
+    State8080 *state = m->state;
+    uint64_t end_instructions = max_instructions ? m->instructions + max_instructions : UINT64_MAX;
+    uint64_t end_cycles = max_cycles ? state->cycles + max_cycles : UINT64_MAX;
+    uint64_t end_frames = max_frames ? m->frames + max_frames : UINT64_MAX;
+
+    // a previous run that stopped on a limit can simply be continued
+    if (state->stop == STOP_LIMIT)
+        state->stop = STOP_NONE;
+
+    while (!state->stop){
+        uint8_t opcode = state->memory[state->pc];
+        int ran = 0;
+
+        // a fused pair runs only if nothing is due between its two instructions,
+        // and it does not wrap past $ffff, where its operands would be read unwrapped
+        if (fusable8080[opcode] && state->pc <= 0xfffc){
+            uint64_t after = state->cycles + cycles8080[opcode];
+            if (after < m->next_interrupt && after < end_cycles && m->instructions + 1 < end_instructions &&
+                !(m->pending && state->int_enable))
+                ran = Emulate8080Pair(state);
+        }
+        if (!ran){
+            Emulate8080Op(state);
+            ran = 1;
+        }
+        if (state->stop){
+            // the first of a fused pair has run; HLT has run, an unimplemented opcode has not
+            m->instructions += ran - 1;
+            if (state->stop == STOP_HALT)
+                m->instructions++;
+            // a watchpoint stops after its instruction, which goes on as if nothing happened
+            if (state->stop == STOP_BREAK){
+                m->instructions++;
+                machineInterrupts(m);
+            }
+            break;
+        }
+        m->instructions += ran;
+        machineInterrupts(m);
+
+        if (m->instructions >= end_instructions || state->cycles >= end_cycles || m->frames >= end_frames)
+            state->stop = STOP_LIMIT;
+    }
+
+    return (StopReason)state->stop;
+}
@@ -0,0 +1,88 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+#include <stdint.h>
+#include "emulator.h"
+
+/*
+ * The board around the CPU: Space Invaders raises RST 1 at mid-screen and
+ * RST 2 at vblank, each 60 times a second on a 2 MHz 8080.
+ *
+ * Ports: IN 0-2 read the input latches (buttons, coin, DIP switches), IN 3
+ * reads the shift register; OUT 2 sets the shift amount, OUT 4 shifts a byte
+ * in, OUT 3 and 5 drive the sound latches, OUT 6 is the watchdog.
+ */
+
+#define HALF_FRAME_CYCLES   16667   // 2 MHz / 120
+#define MACHINE_ROM_SIZE    0x2000  // invaders.h-e; RAM starts above it
+
+typedef struct Machine {
+    State8080  *state;
+    uint64_t   next_interrupt;  // cycle count at which the next request is raised
+    uint64_t   requested;       // cycle count the pending request was raised at
+    uint8_t    next_vector;
+    uint8_t    pending;         // vector waiting for the guest to enable interrupts, 0 if none
+    uint64_t   instructions;
+    uint64_t   frames;
+    uint64_t   interrupts;
+    uint16_t   shift;           // the shift register's 16 bits
+    uint8_t    shift_offset;    // OUT 2: which 8 of them IN 3 reads
+    uint8_t    inputs[3];       // IN 0-2, set by whoever drives the controls
+    uint8_t    outputs[8];      // last value written to each OUT port
+    uint16_t   rom_size;        // memory below this is ROM
+    uint64_t   rom_hash;        // hash of the ROM, 0 until it is needed
+    // optional observers for recording a session (movie.h); NULL when unused
+    uint8_t    (*input_hook)(void *ctx, uint8_t port, uint8_t value);  // IN 0-2, may replace the value
+    void       (*interrupt_hook)(void *ctx, int vector);                // after an interrupt is taken
+    void       *hook_ctx;
+} Machine;
+
+// also connects the board's ports to the CPU
+void machineInit(Machine *m, State8080 *state);
+
+/*
+ * Read a ROM image into memory
+ * @param offset Where the image starts (0 for Space Invaders, 0x100 for CP/M programs)
+ * @return the number of bytes loaded, -1 if the file cannot be read
+ */
+long machineLoadROM(uint8_t *memory, const char *path, uint16_t offset);
+
+/*
+ * Raise and deliver the half-frame interrupts that are due. Call after every instruction.
+ * A request stays pending while the guest has interrupts disabled.
+ * @return the vector delivered, 0 if none
+ */
+static inline int machineInterrupts(Machine *m){
+    State8080 *state = m->state;
+
+    if (state->cycles >= m->next_interrupt){
+        m->pending = m->next_vector;
+        m->requested = m->next_interrupt;
+        m->next_vector = (m->next_vector == 1) ? 2 : 1;
+        m->next_interrupt += HALF_FRAME_CYCLES;
+
+        // vblank (RST 2) ends a frame
+        if (m->pending == 2)
+            m->frames++;
+    }
+
+    if (m->pending && state->int_enable){
+        int vector = m->pending;
+        GenerateInterrupt(state, vector);
+        m->interrupts++;
+        m->pending = 0;
+        if (m->interrupt_hook)
+            m->interrupt_hook(m->hook_ctx, vector);
+        return vector;
+    }
+
+    return 0;
+}
+
+/*
+ * Run without any instrumentation until a limit is reached or the core stops
+ * @param max_instructions, max_cycles, max_frames Totals to stop at, 0 for no limit
+ * @return why the run stopped; STOP_LIMIT is also stored in state->stop
+ */
+StopReason machineRun(Machine *m, uint64_t max_instructions, uint64_t max_cycles, uint64_t max_frames);
+
+#endif
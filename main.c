@@ -15,68 +15,508 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include "emulator.h"
 #include "disassembler.h"
+#include "trace.h"
+#include "profiler.h"
+#include "callgraph.h"
+#include "sampler.h"
+#include "isr.h"
+#include "stats.h"
+#include "machine.h"
+#include "snapshot.h"
+#include "rewind.h"
+#include "movie.h"
+#include "debug.h"
+#include "pagewatch.h"
+#include <time.h>
 
-void loadROM(uint8_t *memory, FILE* instructions){
-    long fsize;
+void printState(State8080 state){
+    printf("A $%02x B $%02x C $%02x D $%02x E $%02x H $%02x L $%02x SP %04x\n", state.a, state.b, state.c, state.d, state.e, state.h, state.l, state.sp); 
+    printf("Z%d S%d P%d CY%d AC%d\n\n", state.cc.z, state.cc.s, state.cc.p, state.cc.cy, state.cc.ac);
+}
 
-	// move the file position indicator to EOF to determine the size
-	fseek(instructions, 0, SEEK_END);
-	fsize = ftell(instructions);
-    
-    // bring the file position indicator to the beginning of the file again
-	fseek(instructions, 0, SEEK_SET); 
+#define REWIND_HISTORY  16  // instructions shown before a fault
+#define MAX_POINTS      64  // -B, -W and -M options
+#define PAGEWATCH_SHOWN 16  // -M hits listed at the end
 
-	// Read file into a buffer and add the null terminator
-	fread(memory, 1, fsize, instructions);
-	memory[fsize] = 0;
+static void usage(const char *name){
+    printf("usage: %s [options] <rom>\n"
+           "  -d         disassemble and print the state after every instruction\n"
+           "  -t file    write a binary trace for tracediff\n"
+           "  -n count   stop after this many instructions\n"
+           "  -c count   stop after this many cycles\n"
+           "  -f count   stop after this many frames\n"
+           "  -b         print a benchmark summary at the end\n"
+           "  -s         dump the final state\n"
+           "  -R file    start from a snapshot taken with -S\n"
+           "  -S file    save a snapshot at the end\n"
+           "  -m file    record the inputs and interrupts to a movie for replay\n"
+           "  -r frames  keep ten minutes of rewind points, one every this many frames;\n"
+           "             an unimplemented instruction then shows the instructions before it\n"
+           "  -B addr[:condition]\n"
+           "             stop before the instruction at addr, if the condition holds\n"
+           "  -W start[-end][:r|w|rw]\n"
+           "             stop after an instruction that accesses the range (build with -DWATCH)\n"
+           "  -M start[-end][:b]\n"
+           "             count writes to the range, trapped by the host MMU; :b also stops on them\n"
+           "Without a limit the ROM runs until HLT or an unimplemented instruction.\n", name);
+    exit(EXIT_FAILURE);
 }
 
-State8080* initState(uint8_t* memory){
-    State8080 *state = (State8080 *)calloc(1, sizeof(State8080)); // init to 0
-    state->sp = 0x2000;
-    state->memory = memory;
+static double elapsed(const struct timespec *start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-    return state;
+static bool limitReached(const Machine *m, uint64_t max_instructions, uint64_t max_cycles, uint64_t max_frames){
+    return (max_instructions && m->instructions >= max_instructions) ||
+           (max_cycles && m->state->cycles >= max_cycles) ||
+           (max_frames && m->frames >= max_frames);
 }
 
-void printState(State8080 state){
-    printf("A $%02x B $%02x C $%02x D $%02x E $%02x H $%02x L $%02x SP %04x\n", state.a, state.b, state.c, state.d, state.e, state.h, state.l, state.sp); 
-    printf("Z%d S%d P%d CY%d AC%d\n\n", state.cc.z, state.cc.s, state.cc.p, state.cc.cy, state.cc.ac);
+#ifdef STATSHM
+// publish the counters, with the host time since the previous frame
+static void publishFrame(StatsBlock *block, StatsSnapshot *stats, const Machine *m,
+                         const struct timespec *start, struct timespec *frame_start){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    stats->instructions = m->instructions;
+    stats->cycles = m->state->cycles;
+    stats->frames = m->frames;
+    stats->interrupts = m->interrupts;
+    stats->frame_ns = (now.tv_sec - frame_start->tv_sec) * 1000000000LL + (now.tv_nsec - frame_start->tv_nsec);
+    stats->total_ns = (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+    *frame_start = now;
+    if (block)
+        statsPublish(block, stats);
 }
+#define PUBLISH_FRAME(block, stats, m, start, frame_start)  publishFrame(block, stats, m, start, frame_start)
+#else
+#define PUBLISH_FRAME(block, stats, m, start, frame_start)  ((void)(frame_start))
+#endif
 
 int main(int argc, char *argv[]) {
-    bool debug = true;
-    uint8_t limit;  // = 50;
-    uint8_t ctr = 0;
-	FILE* f = fopen(argv[1], "rb");
+    bool debug = false;
+    bool bench = false;
+    bool dump = false;
+    const char *rom = NULL;
+    const char *trace_path = NULL;
+    const char *restore_path = NULL;
+    const char *save_path = NULL;
+    const char *movie_path = NULL;
+    uint32_t rewind_interval = 0;   // 0 = no rewind buffer
+    uint64_t max_instructions = 0;  // 0 = no limit
+    uint64_t max_cycles = 0;
+    uint64_t max_frames = 0;
+    const char *breakpoints[MAX_POINTS];
+    const char *watchpoints[MAX_POINTS];
+    const char *pagewatches[MAX_POINTS];
+    int breakpoint_count = 0, watchpoint_count = 0, pagewatch_count = 0;
 
-    if (argc != 3){
-        printf("incorrect number of arguments. Quit program");
-        exit(EXIT_FAILURE);
+    for (int i = 1; i < argc; i++){
+        if (argv[i][0] != '-'){
+            if (rom)
+                usage(argv[0]);
+            rom = argv[i];
+        } else if (strcmp(argv[i], "-d") == 0){
+            debug = true;
+        } else if (strcmp(argv[i], "-b") == 0){
+            bench = true;
+        } else if (strcmp(argv[i], "-s") == 0){
+            dump = true;
+        } else if (i + 1 < argc && strcmp(argv[i], "-t") == 0){
+            trace_path = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-R") == 0){
+            restore_path = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-r") == 0){
+            rewind_interval = strtoul(argv[++i], NULL, 0);
+        } else if (i + 1 < argc && strcmp(argv[i], "-m") == 0){
+            movie_path = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-B") == 0 && breakpoint_count < MAX_POINTS){
+            breakpoints[breakpoint_count++] = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-W") == 0 && watchpoint_count < MAX_POINTS){
+            watchpoints[watchpoint_count++] = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-M") == 0 && pagewatch_count < MAX_POINTS){
+            pagewatches[pagewatch_count++] = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-S") == 0){
+            save_path = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-n") == 0){
+            max_instructions = strtoull(argv[++i], NULL, 0);
+        } else if (i + 1 < argc && strcmp(argv[i], "-c") == 0){
+            max_cycles = strtoull(argv[++i], NULL, 0);
+        } else if (i + 1 < argc && strcmp(argv[i], "-f") == 0){
+            max_frames = strtoull(argv[++i], NULL, 0);
+        } else{
+            usage(argv[0]);
+        }
     }
-    else{
-        limit = atoi(argv[2]);
+    if (!rom)
+        usage(argv[0]);
+    if (movie_path && restore_path){
+        printf("A movie starts at power-on and cannot be recorded from a snapshot\n");
+        exit(EXIT_FAILURE);
     }
 
-	if (!f){
-		printf("File pointer is null");
+    // 64k in size, holds 8-bit data; -M needs it on host pages of its own
+    uint8_t *memory = pagewatch_count ? pageWatchAlloc() : (uint8_t *)calloc(0x10000, 1);
+    if (!memory){
+        printf("Cannot map memory for -M\n");
+        exit(EXIT_FAILURE);
     }
-
-    uint8_t *memory = (uint8_t *)malloc(0x10000);    // 64k in size, holds 8-bit data
     State8080 *state8080;
+    TraceWriter *trace = NULL;
+#ifdef PROFILE
+    Profile *profile = profileCreate();
+#endif
+#ifdef CALLGRAPH
+    CallGraph *callgraph = callgraphCreate();
+    char symbols[1024];
 
-    loadROM(memory, f);
-	fclose(f);
+    // optional symbol file next to the ROM: <rom>.sym
+    snprintf(symbols, sizeof(symbols), "%s.sym", rom);
+    callgraphLoadSymbols(callgraph, symbols);
+#endif
+
+    if (machineLoadROM(memory, rom, 0) < 0){
+        printf("Cannot read %s\n", rom);
+        exit(EXIT_FAILURE);
+    }
     state8080 = initState(memory);
 
-	while (true){
-		Disassemble8080Op(state8080->memory, state8080->pc);
+#ifdef ISRSTATS
+    IsrStats *isr = isrCreate(HALF_FRAME_CYCLES, 1 << 20);
+#endif
+    Machine machine;
+    machineInit(&machine, state8080);
+    if (restore_path){
+        Snapshot *snap = (Snapshot *)malloc(sizeof(Snapshot));
+        int err = snapshotLoad(snap, restore_path);
+        if (err)
+            printf("Cannot read snapshot %s\n", restore_path);
+        else if ((err = snapshotRestore(snap, &machine)) != 0)
+            printf("Snapshot %s was taken with a different ROM\n", restore_path);
+        free(snap);
+        if (err)
+            exit(EXIT_FAILURE);
+        // a run saved at its limit carries on from there
+        if (state8080->stop == STOP_LIMIT)
+            state8080->stop = STOP_NONE;
+    }
+#ifdef STATSHM
+    StatsSnapshot stats = {0};
+    StatsBlock *stats_block = statsCreate(NULL);
+    if (!stats_block)
+        printf("Cannot create the stats segment\n");
+#endif
+    struct timespec start, frame_start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    frame_start = start;
+
+    // limits and the benchmark count from here, which is not zero after -R
+    Machine base = machine;
+    uint64_t base_cycles = state8080->cycles;
+    if (max_instructions)
+        max_instructions += base.instructions;
+    if (max_cycles)
+        max_cycles += base_cycles;
+    if (max_frames)
+        max_frames += base.frames;
+
+    MovieWriter *movie = NULL;
+    if (movie_path){
+        movie = movieRecord(movie_path, &machine, MOVIE_DEFAULT_INTERVAL, MOVIE_DEFAULT_CHECKPOINT);
+        if (!movie)
+            printf("Cannot open movie file %s\n", movie_path);
+    }
+
+    Rewind *rewind = NULL;
+    if (rewind_interval){
+        rewind = rewindCreate(&machine, rewind_interval, REWIND_DEFAULT_WINDOW);
+        rewindCapture(rewind);
+    }
+
+    Debugger *debugger = NULL;
+    if (breakpoint_count || watchpoint_count)
+        debugger = debugCreate(&machine);
+    for (int i = 0; i < breakpoint_count; i++){
+        char *condition;
+        uint16_t address = strtoul(breakpoints[i], &condition, 0);
+
+        if (debugBreak(debugger, address, *condition == ':' ? condition + 1 : NULL) != 0){
+            printf("Cannot compile breakpoint %s: %s\n", breakpoints[i], debugger->error);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < watchpoint_count; i++){
+        char *end;
+        uint16_t first = strtoul(watchpoints[i], &end, 0);
+        uint16_t last = *end == '-' ? strtoul(end + 1, &end, 0) : first;
+        int kind = WATCH_WRITE;
+
+        if (*end == ':')
+            kind = (strchr(end, 'r') ? WATCH_READ : 0) | (strchr(end, 'w') ? WATCH_WRITE : 0);
+        if (debugWatch(debugger, first, last, kind) != 0){
+            printf("Cannot watch %s (watchpoints need a build with -DWATCH)\n", watchpoints[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (pagewatch_count){
+        // the watcher stops on every range or on none, so one :b is enough
+        int stop = 0;
+        for (int i = 0; i < pagewatch_count; i++)
+            if (strstr(pagewatches[i], ":b"))
+                stop = 1;
+        if (pageWatchStart(state8080, stop) != 0){
+            printf("Cannot install the page watch handlers\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < pagewatch_count; i++){
+        char *end;
+        uint16_t first = strtoul(pagewatches[i], &end, 0);
+        uint16_t last = *end == '-' ? strtoul(end + 1, NULL, 0) : first;
+
+        pageWatchAdd(first, last);
+    }
+
+#ifdef SAMPLE
+    SampleStats *samples = sampleStatsCreate();
+    if (samplerStart(state8080, 1000) != 0)
+        printf("Cannot start the sampling timer\n");
+#endif
+
+    if (trace_path){
+        trace = traceOpen(trace_path, TRACE_DEFAULT_INTERVAL, state8080);
+        if (!trace)
+            printf("Cannot open trace file %s\n", trace_path);
+    }
+
+    // per-instruction hooks need the stepping loop; otherwise run at full speed
+#if defined(PROFILE) || defined(CALLGRAPH) || defined(ISRSTATS)
+    bool step = true;
+#else
+    bool step = debug || trace;
+#endif
+
+    if (!step){
+        // one frame at a time, so the stats segment stays current
+        do{
+            uint64_t left_instructions = max_instructions ? max_instructions - machine.instructions : 0;
+            uint64_t left_cycles = max_cycles ? max_cycles - state8080->cycles : 0;
+
+            if (debugger)
+                debugRun(debugger, left_instructions, left_cycles, 1);
+            else
+                machineRun(&machine, left_instructions, left_cycles, 1);
+            if (pagewatch_count)
+                pageWatchRearm();
+            if (rewind)
+                rewindPoll(rewind);
+            PUBLISH_FRAME(stats_block, &stats, &machine, &start, &frame_start);
+            SAMPLER_DRAIN(samples);
+        } while (state8080->stop == STOP_LIMIT &&
+                 !limitReached(&machine, max_instructions, max_cycles, max_frames));
+    }
+
+	while (step){
+        uint16_t pc = state8080->pc;
+        uint8_t opcode = state8080->memory[pc];
+        uint64_t cycles = state8080->cycles;
+        uint16_t sp = state8080->sp;
+
+        if (debugger){
+            if (debugAtBreakpoint(debugger, state8080)){
+                debugger->hit = DEBUG_BREAKPOINT;
+                debugger->hit_pc = pc;
+                state8080->stop = STOP_BREAK;
+                break;
+            }
+            debugger->pc = pc;
+        }
+        if (debug)
+            Disassemble8080Op(state8080->memory, state8080->pc);
         Emulate8080Op(state8080);
+        // HLT has run; an instruction that hit a watchpoint has too, and is finished below like machineRun does
+        if (state8080->stop && state8080->stop != STOP_BREAK){
+            if (state8080->stop == STOP_HALT)
+                machine.instructions++;
+            break;
+        }
+        if (debug)
+            printState(*state8080);
+        machine.instructions++;
+
+        if (trace)  traceRecord(trace, state8080, pc, opcode);
+        PROFILE_STEP(profile, pc, opcode, state8080->cycles - cycles);
+        CALLGRAPH_STEP(callgraph, state8080, opcode, sp, state8080->cycles - cycles);
+        ISR_STEP(isr, state8080);
+
+        uint64_t frames = machine.frames;
+        int vector = machineInterrupts(&machine);
+        if (vector){
+            ISR_ENTER(isr, state8080, vector, machine.requested);
+#ifdef CALLGRAPH
+            callgraphCall(callgraph, state8080);
+#endif
+        }
+
+        if (pagewatch_count && machine.frames != frames)
+            pageWatchRearm();
+        if (rewind && machine.frames != frames)
+            rewindPoll(rewind);
+        if (machine.frames != frames){
+            PUBLISH_FRAME(stats_block, &stats, &machine, &start, &frame_start);
+            SAMPLER_DRAIN(samples);
+        }
+
+        if (state8080->stop == STOP_BREAK)
+            break;
+        if (limitReached(&machine, max_instructions, max_cycles, max_frames)){
+            state8080->stop = STOP_LIMIT;
+            break;
+        }
+    }
+    double seconds = elapsed(&start);
+
+    // before anything below writes guest memory from the host
+    if (pagewatch_count){
+        PageWatchHit hits[PAGEWATCH_SHOWN];
+        int shown = pageWatchRecent(hits, PAGEWATCH_SHOWN);
+
+        pageWatchStop();
+        printf("%llu watched writes", (unsigned long long)pageWatchHits());
+        printf(shown ? ", the last %d:\n" : "\n", shown);
+        for (int i = 0; i < shown; i++)
+            printf("  $%04x = $%02x, PC $%04x, cycle %llu\n", hits[i].address,
+                   hits[i].value, hits[i].pc, (unsigned long long)hits[i].cycles);
+    }
+
+    // before rewinding, which runs the machine again
+    if (movie && movieClose(movie) != 0)
+        printf("Cannot write movie file %s\n", movie_path);
+
+    if (rewind && state8080->stop == STOP_UNIMPLEMENTED){
+        uint64_t fault = machine.instructions;
+
+        if (rewindStepBack(rewind, REWIND_HISTORY) == 0){
+            printf("The last %d instructions:\n", REWIND_HISTORY);
+            while (machine.instructions < fault){
+                Disassemble8080Op(state8080->memory, state8080->pc);
+                machineRun(&machine, 1, 0, 0);
+                printState(*state8080);
+            }
+        }
+        state8080->stop = STOP_UNIMPLEMENTED;
+    }
+
+    if (debugger && state8080->stop == STOP_BREAK){
+        if (debugger->hit == DEBUG_BREAKPOINT)
+            printf("Breakpoint at $%04x\n", debugger->hit_pc);
+        else
+            printf("Watchpoint: $%04x %s $%02x by the instruction at $%04x\n", debugger->hit_address,
+                   debugger->hit_kind == WATCH_READ ? "read" : "written with", debugger->hit_value,
+                   debugger->hit_pc);
+        Disassemble8080Op(state8080->memory, state8080->pc);
         printState(*state8080);
+    }
+    debugFree(debugger);
+
+#ifdef STATSHM
+    stats.stop_reason = state8080->stop;
+    publishFrame(stats_block, &stats, &machine, &start, &frame_start);
+    statsDestroy(stats_block);
+#endif
+
+    if (save_path){
+        Snapshot *snap = (Snapshot *)malloc(sizeof(Snapshot));
+        snapshotTake(snap, &machine);
+        if (snapshotSave(snap, save_path) != 0)
+            printf("Cannot write snapshot %s\n", save_path);
+        free(snap);
+    }
+
+    if (bench){
+        uint64_t instructions = machine.instructions - base.instructions;
+        uint64_t cycles = state8080->cycles - base_cycles;
+        uint64_t frames = machine.frames - base.frames;
+
+        printf("stopped: %s\n", stopReasonName(state8080->stop));
+        printf("%llu instructions, %llu cycles, %llu frames, %llu interrupts in %.3f s\n",
+               (unsigned long long)instructions, (unsigned long long)cycles, (unsigned long long)frames,
+               (unsigned long long)(machine.interrupts - base.interrupts), seconds);
+        if (seconds > 0)
+            printf("%.2f MIPS, %.1f frames/s, %.2fx a 2 MHz 8080\n",
+                   instructions / seconds / 1e6, frames / seconds, cycles / seconds / 2e6);
+    }
+    if (rewind){
+        if (bench)
+            printf("rewind: %u points, %.1f KB\n", rewind->count, rewindBytes(rewind) / 1024.0);
+        rewindFree(rewind);
+    }
+
+    if (dump){
+        printf("PC %04x  cycles %llu  interrupts %s  stopped: %s\n", state8080->pc,
+               (unsigned long long)state8080->cycles, state8080->int_enable ? "enabled" : "disabled",
+               stopReasonName(state8080->stop));
+        printState(*state8080);
+    }
+
+    traceClose(trace);
+
+#ifdef ISRSTATS
+    FILE *isr_report = fopen("interrupts.txt", "w");
+    FILE *isr_log = fopen("interrupts.csv", "w");
+    if (isr_report){
+        isrReport(isr, isr_report);
+        fclose(isr_report);
+    }
+    if (isr_log){
+        isrWriteLog(isr, isr_log);
+        fclose(isr_log);
+    }
+    isrFree(isr);
+#endif
+
+#ifdef SAMPLE
+    samplerStop();
+    samplerDrain(samples);
+    FILE *sampled = fopen("samples.txt", "w");
+    if (sampled){
+        sampleStatsReport(samples, state8080->memory, sampled);
+        fclose(sampled);
+    }
+    sampleStatsFree(samples);
+#endif
+
+#ifdef PROFILE
+    FILE *report = fopen("profile.txt", "w");
+    if (report){
+        profileReport(profile, state8080->memory, report);
+        fclose(report);
+    }
+    profileFree(profile);
+#endif
+#ifdef CALLGRAPH
+    FILE *folded = fopen("callgraph.folded", "w");
+    FILE *routines = fopen("callgraph.txt", "w");
+    if (folded){
+        callgraphFolded(callgraph, folded);
+        fclose(folded);
+    }
+    if (routines){
+        callgraphReport(callgraph, routines);
+        fclose(routines);
+    }
+    callgraphFree(callgraph);
+#endif
 
-        if (debug && ctr > limit)   break;
-        ctr++;
+    if (state8080->stop == STOP_UNIMPLEMENTED){
+        printf("Error: Unimplemented instruction %02x at $%04x\n", state8080->memory[state8080->pc], state8080->pc);
+        exit(1);
     }
 }
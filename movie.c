@@ -0,0 +1,576 @@
+#include "movie.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+#define MOVIE_BUFFER    (1 << 16)
+// equal bytes that may sit inside one snapshot record before it is split in two
+#define MOVIE_GAP       4
+
+static void putVarint(FILE *f, uint64_t value){
+    while (value >= 0x80){
+        putc((value & 0x7f) | 0x80, f);
+        value >>= 7;
+    }
+    putc(value, f);
+}
+
+static void put64(FILE *f, uint64_t value){
+    for (int i = 0; i < 8; i++)
+        putc((value >> (8 * i)) & 0xff, f);
+}
+
+static void putEvent(MovieWriter *mw, uint8_t kind, uint8_t arg, uint64_t cycle){
+    putc(kind << 4 | arg, mw->f);
+    putVarint(mw->f, cycle - mw->last_cycle);
+    mw->last_cycle = cycle;
+    mw->events++;
+}
+
+static uint8_t recordInput(void *ctx, uint8_t port, uint8_t value){
+    MovieWriter *mw = (MovieWriter *)ctx;
+
+    if (!(mw->logged & (1 << port)) || mw->inputs[port] != value){
+        putEvent(mw, MOVIE_INPUT, port, mw->m->state->cycles);
+        putc(value, mw->f);
+        mw->inputs[port] = value;
+        mw->logged |= 1 << port;
+    }
+    return value;
+}
+
+// embed a snapshot, with RAM as the XOR against the previous one
+static void recordSnapshot(MovieWriter *mw){
+    Machine *m = mw->m;
+    State8080 *state = m->state;
+    const uint8_t *mem = state->memory;
+    uint8_t *prev = mw->ram;
+    SnapshotState s;
+    uint32_t pos = m->rom_size, addr = m->rom_size;
+
+    putEvent(mw, MOVIE_SNAPSHOT, 0, state->cycles);
+    put64(mw->f, hashState(state));
+    snapshotSaveRegisters(&s, m);
+    fwrite(&s, sizeof(s), 1, mw->f);
+    fwrite(mw->inputs, 1, sizeof(mw->inputs), mw->f);
+
+    while (addr < 0x10000){
+        if (mem[addr] == prev[addr]){
+            addr++;
+            continue;
+        }
+
+        uint32_t start = addr, last = addr;
+        while (addr < 0x10000 && addr - last <= MOVIE_GAP){
+            if (mem[addr] != prev[addr])
+                last = addr;
+            addr++;
+        }
+        addr = last + 1;
+
+        putVarint(mw->f, start - pos);
+        putVarint(mw->f, addr - start);
+        for (uint32_t i = start; i < addr; i++){
+            putc(mem[i] ^ prev[i], mw->f);
+            prev[i] = mem[i];
+        }
+        pos = addr;
+    }
+    putVarint(mw->f, 0x10000 - pos);
+}
+
+static void recordInterrupt(void *ctx, int vector){
+    MovieWriter *mw = (MovieWriter *)ctx;
+    State8080 *state = mw->m->state;
+    // the cycle count after the instruction it followed, before RST's own cycles
+    uint64_t cycle = state->cycles - cycles8080[0xc7];
+    int64_t drift = (int64_t)(cycle - mw->last_interrupt) - HALF_FRAME_CYCLES;
+
+    putc(MOVIE_INTERRUPT << 4 | vector, mw->f);
+    putVarint(mw->f, drift < 0 ? ((uint64_t)-drift << 1) - 1 : (uint64_t)drift << 1);
+    mw->last_cycle = cycle;
+    mw->last_interrupt = cycle;
+    mw->events++;
+
+    if (vector == 2 && ++mw->frames >= mw->interval){
+        putEvent(mw, MOVIE_HASH, 0, state->cycles);
+        put64(mw->f, hashState(state));
+        mw->frames = 0;
+    }
+    if (vector == 2 && mw->checkpoint && ++mw->since_checkpoint >= mw->checkpoint){
+        recordSnapshot(mw);
+        mw->since_checkpoint = 0;
+    }
+}
+
+MovieWriter *movieRecord(const char *path, Machine *m, uint32_t interval, uint32_t checkpoint){
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return NULL;
+
+    MovieWriter *mw = (MovieWriter *)calloc(1, sizeof(MovieWriter));
+    mw->f = f;
+    mw->m = m;
+    mw->interval = interval ? interval : MOVIE_DEFAULT_INTERVAL;
+    mw->checkpoint = checkpoint;
+    if (checkpoint)
+        mw->ram = (uint8_t *)calloc(0x10000, 1);
+    setvbuf(f, NULL, _IOFBF, MOVIE_BUFFER);
+
+    MovieHeader header = {0};
+    memcpy(header.magic, MOVIE_MAGIC, sizeof(MOVIE_MAGIC));
+    header.version = MOVIE_VERSION;
+    header.interval = mw->interval;
+    header.checkpoint = checkpoint;
+    header.rom_size = m->rom_size;
+    header.rom_hash = snapshotRomHash(m);
+    fwrite(&header, sizeof(header), 1, f);
+
+    m->input_hook = recordInput;
+    m->interrupt_hook = recordInterrupt;
+    m->hook_ctx = mw;
+    return mw;
+}
+
+int movieClose(MovieWriter *mw){
+    if (!mw)
+        return 0;
+
+    Machine *m = mw->m;
+    putEvent(mw, MOVIE_END, 0, m->state->cycles);
+    putVarint(mw->f, m->instructions);
+    put64(mw->f, hashState(m->state));
+
+    m->input_hook = NULL;
+    m->interrupt_hook = NULL;
+    m->hook_ctx = NULL;
+
+    int ok = !ferror(mw->f);
+    if (fclose(mw->f) != 0)
+        ok = 0;
+    free(mw->ram);
+    free(mw);
+    return ok ? 0 : -1;
+}
+
+static int getVarint(MovieReader *mr, uint64_t *value){
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7){
+        int c = getc(mr->f);
+        if (c == EOF)
+            return -1;
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+static int get64(MovieReader *mr, uint64_t *value){
+    *value = 0;
+    for (int i = 0; i < 8; i++){
+        int c = getc(mr->f);
+        if (c == EOF)
+            return -1;
+        *value |= (uint64_t)c << (8 * i);
+    }
+    return 0;
+}
+
+// the RAM records of a MOVIE_SNAPSHOT, XORed into mr->snapshot if there is one
+static int readSnapshotRAM(MovieReader *mr){
+    uint8_t *ram = mr->snapshot ? mr->snapshot->memory : NULL;
+    uint64_t pos = mr->header.rom_size;
+    uint64_t skip, len;
+
+    while (1){
+        if (getVarint(mr, &skip))
+            return -1;
+        pos += skip;
+        if (pos >= 0x10000)
+            return pos == 0x10000 ? 0 : -1;
+        if (getVarint(mr, &len) || pos + len > 0x10000)
+            return -1;
+        for (uint64_t end = pos + len; pos < end; pos++){
+            int c = getc(mr->f);
+            if (c == EOF)
+                return -1;
+            if (ram)
+                ram[pos] ^= c;
+        }
+    }
+}
+
+// decode the next event into mr->next; kind 0 at the end of the file
+static void readEvent(MovieReader *mr){
+    MovieEvent *e = &mr->next;
+    uint64_t delta;
+    int c = getc(mr->f);
+    int err = 0;
+
+    memset(e, 0, sizeof(*e));
+    if (c == EOF)
+        return;
+
+    e->kind = c >> 4;
+    e->arg = c & 0xf;
+    switch (e->kind){
+        case MOVIE_INPUT:
+            err = getVarint(mr, &delta) || (c = getc(mr->f)) == EOF || e->arg > 2;
+            e->value = c;
+            e->cycle = mr->last_cycle + delta;
+            break;
+        case MOVIE_INTERRUPT:
+            err = getVarint(mr, &delta);
+            // undo the zigzag
+            e->cycle = mr->last_interrupt + HALF_FRAME_CYCLES +
+                       ((delta & 1) ? -(int64_t)((delta + 1) >> 1) : (int64_t)(delta >> 1));
+            mr->last_interrupt = e->cycle;
+            break;
+        case MOVIE_HASH:
+            err = getVarint(mr, &delta) || get64(mr, &e->hash);
+            e->cycle = mr->last_cycle + delta;
+            break;
+        case MOVIE_END:
+            err = getVarint(mr, &delta) || getVarint(mr, &e->instructions) || get64(mr, &e->hash);
+            e->cycle = mr->last_cycle + delta;
+            break;
+        case MOVIE_SNAPSHOT: {
+            SnapshotState s;
+            err = getVarint(mr, &delta) || get64(mr, &e->hash) ||
+                  fread(&s, sizeof(s), 1, mr->f) != 1 ||
+                  fread(e->inputs, 1, sizeof(e->inputs), mr->f) != sizeof(e->inputs) ||
+                  readSnapshotRAM(mr);
+            e->cycle = mr->last_cycle + delta;
+            if (mr->snapshot)
+                mr->snapshot->state = s;
+            break;
+        }
+        default:
+            err = 1;
+    }
+
+    if (err){
+        memset(e, 0, sizeof(*e));
+        mr->truncated = 1;
+        return;
+    }
+    mr->last_cycle = e->cycle;
+}
+
+MovieReader *movieOpen(const char *path, int *err){
+    FILE *f = fopen(path, "rb");
+    if (!f){
+        *err = -1;
+        return NULL;
+    }
+
+    MovieReader *mr = (MovieReader *)calloc(1, sizeof(MovieReader));
+    mr->f = f;
+    setvbuf(f, NULL, _IOFBF, MOVIE_BUFFER);
+
+    *err = 0;
+    if (fread(&mr->header, sizeof(mr->header), 1, f) != 1)
+        *err = -1;
+    else if (memcmp(mr->header.magic, MOVIE_MAGIC, sizeof(MOVIE_MAGIC)) != 0 ||
+             mr->header.version < 1 || mr->header.version > MOVIE_VERSION)
+        *err = -2;
+    if (*err){
+        movieFree(mr);
+        return NULL;
+    }
+
+    readEvent(mr);
+    return mr;
+}
+
+void movieFree(MovieReader *mr){
+    if (!mr)
+        return;
+    fclose(mr->f);
+    free(mr);
+}
+
+// IN 0-2 during a replay: the latch as of the last recorded change up to now
+static uint8_t replayInput(void *ctx, uint8_t port, uint8_t value){
+    MovieReader *mr = (MovieReader *)ctx;
+    uint64_t cycles = mr->m->state->cycles;
+
+    (void)value;
+    while (mr->next.kind == MOVIE_INPUT && mr->next.cycle <= cycles){
+        mr->inputs[mr->next.arg] = mr->next.value;
+        mr->events++;
+        readEvent(mr);
+    }
+    return mr->inputs[port];
+}
+
+/*
+ * Act on the events that are due after an instruction
+ * @return 1 to keep going, 0 at a matching end, -1 on a mismatch or a bad file
+ */
+static int replayDue(MovieReader *mr, MovieReport *report){
+    Machine *m = mr->m;
+    State8080 *state = m->state;
+
+    while (mr->next.kind && mr->next.cycle <= state->cycles){
+        MovieEvent *e = &mr->next;
+        uint64_t hash;
+
+        mr->events++;
+        report->cycle = state->cycles;
+        switch (e->kind){
+            case MOVIE_INPUT:
+                // a read the replay did not make; the next hash will not match
+                mr->inputs[e->arg] = e->value;
+                break;
+            case MOVIE_INTERRUPT:
+                GenerateInterrupt(state, e->arg);
+                m->interrupts++;
+                if (e->arg == 2)
+                    m->frames++;
+                break;
+            case MOVIE_HASH:
+            case MOVIE_END:
+            case MOVIE_SNAPSHOT:
+                hash = hashState(state);
+                if (e->cycle != state->cycles){
+                    report->error = "out of step with the recording";
+                    return -1;
+                }
+                if (hash != e->hash){
+                    report->expected = e->hash;
+                    report->actual = hash;
+                    report->error = "state hash mismatch";
+                    return -1;
+                }
+                if (e->kind == MOVIE_HASH || (e->kind == MOVIE_SNAPSHOT && !mr->segment)){
+                    report->hashes++;
+                    break;
+                }
+                if (e->kind == MOVIE_SNAPSHOT){
+                    report->ok = 1;
+                    return 0;
+                }
+                if (e->instructions != m->instructions){
+                    report->error = "instruction count mismatch";
+                    return -1;
+                }
+                report->ok = 1;
+                return 0;
+        }
+        readEvent(mr);
+    }
+
+    if (!mr->next.kind){
+        report->error = mr->truncated ? "the movie is truncated or corrupt" : "the movie has no end marker";
+        return -1;
+    }
+    return 1;
+}
+
+// replay from wherever the machine and the reader are to the end (or the next snapshot)
+static int replayRun(MovieReader *mr, Machine *m, MovieReport *report){
+    State8080 *state = m->state;
+    int result = 1;
+
+    mr->m = m;
+    m->input_hook = replayInput;
+    m->interrupt_hook = NULL;
+    m->hook_ctx = mr;
+
+    // a segment can end where it starts, e.g. when the recording stopped at a snapshot
+    if (state->cycles >= mr->next.cycle)
+        result = replayDue(mr, report);
+
+    // no limits and no interrupt timer: the movie decides when to stop
+    while (result > 0 && !state->stop){
+        Emulate8080Op(state);
+        if (state->stop){
+            if (state->stop == STOP_HALT)
+                m->instructions++;
+            break;
+        }
+        m->instructions++;
+        if (state->cycles >= mr->next.cycle)
+            result = replayDue(mr, report);
+    }
+    if (result > 0)
+        result = replayDue(mr, report);
+    if (result > 0){
+        report->cycle = state->cycles;
+        report->error = "the program stopped before the end of the movie";
+        result = -1;
+    }
+
+    report->events = mr->events;
+    m->input_hook = NULL;
+    m->hook_ctx = NULL;
+    return result;
+}
+
+int movieReplay(MovieReader *mr, Machine *m, MovieReport *report){
+    memset(report, 0, sizeof(*report));
+    if (mr->header.rom_size != m->rom_size || mr->header.rom_hash != snapshotRomHash(m)){
+        report->error = "the movie was recorded with a different ROM";
+        return -1;
+    }
+    return replayRun(mr, m, report);
+}
+
+// where a segment starts: power-on, or just after a snapshot
+typedef struct MovieCheckpoint {
+    long       offset;          // of the first event after it
+    uint64_t   last_cycle;
+    uint64_t   last_interrupt;
+    uint8_t    inputs[3];
+    Snapshot   *snapshot;       // NULL for power-on
+} MovieCheckpoint;
+
+typedef struct MovieVerifier {
+    const char *path;
+    const uint8_t *rom;
+    MovieHeader header;
+    MovieCheckpoint *checkpoints;
+    MovieSegment *segments;
+    uint32_t   count;
+    uint32_t   next;            // next segment to hand out
+} MovieVerifier;
+
+static void verifySegment(MovieVerifier *v, uint32_t i){
+    MovieCheckpoint *ck = &v->checkpoints[i];
+    MovieSegment *seg = &v->segments[i];
+    uint8_t *memory = (uint8_t *)malloc(0x10000);
+    State8080 *state;
+    Machine m;
+    struct timespec start, end;
+
+    memcpy(memory, v->rom, 0x10000);
+    state = initState(memory);
+    machineInit(&m, state);
+    if (ck->snapshot)
+        snapshotRestore(ck->snapshot, &m);
+    seg->start_frame = m.frames;
+    seg->start_cycle = state->cycles;
+
+    MovieReader *mr = (MovieReader *)calloc(1, sizeof(MovieReader));
+    mr->f = fopen(v->path, "rb");
+    if (!mr->f || fseek(mr->f, ck->offset, SEEK_SET) != 0){
+        seg->report.error = "cannot reopen the movie";
+        if (mr->f)
+            fclose(mr->f);
+    } else{
+        setvbuf(mr->f, NULL, _IOFBF, MOVIE_BUFFER);
+        mr->header = v->header;
+        mr->last_cycle = ck->last_cycle;
+        mr->last_interrupt = ck->last_interrupt;
+        memcpy(mr->inputs, ck->inputs, sizeof(mr->inputs));
+        mr->segment = 1;
+        readEvent(mr);
+
+        uint64_t instructions = m.instructions;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        replayRun(mr, &m, &seg->report);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        seg->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        seg->instructions = m.instructions - instructions;
+        fclose(mr->f);
+    }
+    seg->end_cycle = state->cycles;
+
+    free(mr);
+    free(state);
+    free(memory);
+}
+
+static void *verifyWorker(void *arg){
+    MovieVerifier *v = (MovieVerifier *)arg;
+    uint32_t i;
+
+    // segments differ in length, so hand them out one at a time
+    while ((i = __atomic_fetch_add(&v->next, 1, __ATOMIC_RELAXED)) < v->count)
+        verifySegment(v, i);
+    return NULL;
+}
+
+// read the movie once, without running it, to find and decode its snapshots
+static int findCheckpoints(MovieVerifier *v){
+    int err;
+    MovieReader *mr = movieOpen(v->path, &err);
+    uint32_t capacity = 16;
+
+    if (!mr)
+        return err;
+    v->header = mr->header;
+    v->checkpoints = (MovieCheckpoint *)calloc(capacity, sizeof(MovieCheckpoint));
+    v->checkpoints[0].offset = sizeof(MovieHeader);
+    v->count = 1;
+
+    mr->snapshot = (Snapshot *)calloc(1, sizeof(Snapshot));
+    mr->snapshot->header.rom_size = mr->header.rom_size;
+    mr->snapshot->header.rom_hash = mr->header.rom_hash;
+
+    for (; mr->next.kind; readEvent(mr)){
+        if (mr->next.kind != MOVIE_SNAPSHOT)
+            continue;
+        if (v->count == capacity){
+            capacity *= 2;
+            v->checkpoints = (MovieCheckpoint *)realloc(v->checkpoints, capacity * sizeof(MovieCheckpoint));
+        }
+
+        MovieCheckpoint *ck = &v->checkpoints[v->count++];
+        ck->offset = ftell(mr->f);
+        ck->last_cycle = mr->last_cycle;
+        ck->last_interrupt = mr->last_interrupt;
+        memcpy(ck->inputs, mr->next.inputs, sizeof(ck->inputs));
+        ck->snapshot = (Snapshot *)malloc(sizeof(Snapshot));
+        memcpy(ck->snapshot, mr->snapshot, sizeof(Snapshot));
+    }
+
+    free(mr->snapshot);
+    movieFree(mr);
+    return 0;
+}
+
+int movieVerify(const char *path, const uint8_t *rom, int threads, MovieSegment **segments, uint32_t *count){
+    MovieVerifier v = {0};
+    int err;
+
+    *segments = NULL;
+    *count = 0;
+    v.path = path;
+    v.rom = rom;
+    if ((err = findCheckpoints(&v)) != 0)
+        return err;
+
+    if (v.header.rom_hash != fnv1a(FNV_OFFSET, rom, v.header.rom_size)){
+        err = -3;
+    } else{
+        v.segments = (MovieSegment *)calloc(v.count, sizeof(MovieSegment));
+        if (threads <= 0)
+            threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads > (int)v.count)
+            threads = v.count;
+
+        pthread_t *workers = (pthread_t *)malloc(threads * sizeof(pthread_t));
+        for (int t = 0; t < threads; t++)
+            pthread_create(&workers[t], NULL, verifyWorker, &v);
+        for (int t = 0; t < threads; t++)
+            pthread_join(workers[t], NULL);
+        free(workers);
+
+        for (uint32_t i = 0; i < v.count; i++)
+            if (!v.segments[i].report.ok)
+                err++;
+        *segments = v.segments;
+        *count = v.count;
+    }
+
+    for (uint32_t i = 0; i < v.count; i++)
+        free(v.checkpoints[i].snapshot);
+    free(v.checkpoints);
+    return err;
+}
@@ -0,0 +1,167 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+#include <stdio.h>
+#include <stdint.h>
+#include "emulator.h"
+#include "machine.h"
+#include "snapshot.h"
+
+/*
+ * Input movie: everything that reaches the machine from outside, with the
+ * cycle it happened at, so a session can be replayed exactly.
+ *
+ * The recorder sits on the Machine's hooks. It logs a read of an input latch
+ * (IN 0-2) only when the value differs from the previous read of that port,
+ * every interrupt the guest takes, and a hash of the machine every
+ * `interval` frames. IN 3 (the shift register) is not logged: it follows
+ * from the OUTs the guest made.
+ *
+ * The replayer runs its own loop. It answers IN 0-2 from the movie, delivers
+ * the interrupts at the recorded cycles instead of raising them itself and
+ * stops at the first hash that does not match.
+ *
+ * Every `checkpoint` frames the recorder also embeds a snapshot. The stretch
+ * between two of them is a segment that can be replayed on its own, starting
+ * from the first snapshot, so movieVerify checks a long movie on all cores.
+ *
+ * File layout:
+ *   MovieHeader (host endian)
+ *   events, each one byte of kind << 4 | port or vector, then
+ *     MOVIE_INPUT      varint cycle delta, value
+ *     MOVIE_INTERRUPT  varint zigzag(cycles since the previous interrupt - HALF_FRAME_CYCLES)
+ *     MOVIE_HASH       varint cycle delta, 8-byte hash
+ *     MOVIE_END        varint cycle delta, varint instructions, 8-byte hash
+ *     MOVIE_SNAPSHOT   varint cycle delta, 8-byte hash, SnapshotState (host
+ *                      endian), the 3 input latches as logged so far, then
+ *                      RAM XOR the previous snapshot's as records of
+ *                      (varint skip, varint length, bytes) ending with a skip
+ *                      that reaches 0x10000
+ * Cycle deltas count from the previous event. Hashes are little endian.
+ * An interrupt costs two bytes, so an hour of play is about a megabyte, plus a
+ * few KB per snapshot.
+ */
+
+#define MOVIE_MAGIC     "8080MOV"
+#define MOVIE_VERSION   2           // 1 had no snapshots and is still read
+#define MOVIE_DEFAULT_INTERVAL      60      // frames between hashes
+#define MOVIE_DEFAULT_CHECKPOINT    3600    // frames between snapshots, one a minute
+
+enum {
+    MOVIE_INPUT = 1,
+    MOVIE_INTERRUPT,
+    MOVIE_HASH,
+    MOVIE_END,
+    MOVIE_SNAPSHOT
+};
+
+typedef struct MovieHeader {
+    char       magic[8];
+    uint32_t   version;
+    uint32_t   interval;    // frames between hashes
+    uint16_t   rom_size;
+    uint16_t   pad;
+    uint32_t   checkpoint;  // frames between snapshots, 0 if there are none
+    uint64_t   rom_hash;    // fnv1a() of the ROM
+} MovieHeader;
+
+typedef struct MovieEvent {
+    uint8_t    kind;
+    uint8_t    arg;         // port or vector
+    uint8_t    value;       // MOVIE_INPUT
+    uint64_t   cycle;
+    uint64_t   hash;        // MOVIE_HASH, MOVIE_END, MOVIE_SNAPSHOT
+    uint64_t   instructions;    // MOVIE_END
+    uint8_t    inputs[3];   // MOVIE_SNAPSHOT
+} MovieEvent;
+
+typedef struct MovieWriter {
+    FILE       *f;
+    Machine    *m;
+    uint32_t   interval;
+    uint32_t   checkpoint;
+    uint32_t   frames;          // vblanks taken since the last hash
+    uint32_t   since_checkpoint;
+    uint64_t   last_cycle;
+    uint64_t   last_interrupt;
+    uint8_t    inputs[3];       // last value logged per port
+    uint8_t    logged;          // bit per port: logged at least once
+    uint64_t   events;
+    uint8_t    *ram;            // RAM at the last snapshot
+} MovieWriter;
+
+typedef struct MovieReader {
+    FILE       *f;
+    MovieHeader header;
+    Machine    *m;              // the machine being replayed
+    MovieEvent next;            // kind 0 once the file is exhausted
+    uint64_t   last_cycle;
+    uint64_t   last_interrupt;
+    uint8_t    inputs[3];       // latches as of the last MOVIE_INPUT
+    int        truncated;       // the file ended inside an event
+    uint64_t   events;          // events replayed so far
+    int        segment;         // stop at the first snapshot instead of checking and passing it
+    Snapshot   *snapshot;       // when set, MOVIE_SNAPSHOT events are decoded into it
+} MovieReader;
+
+typedef struct MovieReport {
+    int        ok;              // reached MOVIE_END with every hash matching
+    uint64_t   events;
+    uint64_t   hashes;          // hashes that matched
+    uint64_t   cycle;           // where the replay stopped
+    uint64_t   expected;        // on a mismatch, the recorded hash
+    uint64_t   actual;
+    const char *error;          // why it stopped early, NULL if ok
+} MovieReport;
+
+// a stretch between snapshots, as replayed by movieVerify
+typedef struct MovieSegment {
+    uint64_t   start_frame;
+    uint64_t   start_cycle;
+    uint64_t   end_cycle;       // where the replay stopped
+    uint64_t   instructions;    // replayed in this segment
+    double     seconds;
+    MovieReport report;
+} MovieSegment;
+
+/*
+ * Start recording. The machine must be at power-on (nothing executed yet),
+ * since that is where the replay starts.
+ * @param interval Frames between hashes, 0 for MOVIE_DEFAULT_INTERVAL
+ * @param checkpoint Frames between snapshots, 0 for none
+ * @return NULL if the file cannot be created
+ */
+MovieWriter *movieRecord(const char *path, Machine *m, uint32_t interval, uint32_t checkpoint);
+
+/*
+ * Write the final state, detach from the machine and close
+ * @return 0, or -1 if the file could not be written completely
+ */
+int movieClose(MovieWriter *mw);
+
+/*
+ * @param err Gets -1 if the file cannot be read, -2 if it is not a movie of this version
+ * @return NULL on error
+ */
+MovieReader *movieOpen(const char *path, int *err);
+void movieFree(MovieReader *mr);
+
+/*
+ * Run a freshly initialised machine with the movie's ROM loaded through the
+ * whole movie, as fast as the host allows
+ * @return 0 if it reached the end with every hash matching, -1 otherwise
+ */
+int movieReplay(MovieReader *mr, Machine *m, MovieReport *report);
+
+/*
+ * Split the movie at its snapshots and replay every segment from its starting
+ * snapshot on a pool of threads. Each segment must reach the next snapshot
+ * (or the end) with a matching hash.
+ * @param rom 64K memory image with the movie's ROM loaded
+ * @param threads Worker threads, 0 for one per online CPU
+ * @param segments Gets a malloc'd array of results, in movie order
+ * @return the number of segments that failed, -1 if the file cannot be read,
+ * -2 if it is not a movie of this version, -3 if it was recorded with a different ROM
+ */
+int movieVerify(const char *path, const uint8_t *rom, int threads, MovieSegment **segments, uint32_t *count);
+
+#endif
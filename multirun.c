@@ -0,0 +1,106 @@
+/*
+ * Run many independent copies of a ROM on a thread pool and report their
+ * combined speed.
+ *
+ * usage: multirun [-j threads] [-n instances] [-f frames] [-s slice] [-v] <rom>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emulator.h"
+#include "machine.h"
+#include "pool.h"
+
+static void usage(const char *name){
+    printf("usage: %s [options] <rom>\n"
+           "  -j threads    worker threads (default: one per CPU)\n"
+           "  -n count      instances (default 64)\n"
+           "  -f frames     frames each instance runs (default 600; 0 runs until every program stops)\n"
+           "  -s frames     frames an instance runs before another gets the thread (default %d)\n"
+           "  -H            put the instances on huge pages\n"
+           "  -v            list every instance at the end\n", name, POOL_DEFAULT_SLICE);
+    exit(EXIT_FAILURE);
+}
+
+static void printProgress(const PoolProgress *p){
+    printf("%6.1f s  %u/%u done  frames %llu-%llu  %.2f MIPS  %llu steals\n", p->seconds, p->done, p->count,
+           (unsigned long long)p->min_frames, (unsigned long long)p->max_frames,
+           p->seconds > 0 ? p->instructions / p->seconds / 1e6 : 0.0, (unsigned long long)p->steals);
+}
+
+int main(int argc, char *argv[]) {
+    const char *rom = NULL;
+    int threads = 0;
+    uint32_t count = 64;
+    uint64_t frames = 600;
+    uint32_t slice = 0;
+    int verbose = 0;
+    int huge = 0;
+
+    for (int i = 1; i < argc; i++){
+        if (argv[i][0] != '-'){
+            if (rom)
+                usage(argv[0]);
+            rom = argv[i];
+        } else if (strcmp(argv[i], "-v") == 0){
+            verbose = 1;
+        } else if (strcmp(argv[i], "-H") == 0){
+            huge = 1;
+        } else if (i + 1 < argc && strcmp(argv[i], "-j") == 0){
+            threads = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-n") == 0){
+            count = strtoul(argv[++i], NULL, 0);
+        } else if (i + 1 < argc && strcmp(argv[i], "-f") == 0){
+            frames = strtoull(argv[++i], NULL, 0);
+        } else if (i + 1 < argc && strcmp(argv[i], "-s") == 0){
+            slice = strtoul(argv[++i], NULL, 0);
+        } else{
+            usage(argv[0]);
+        }
+    }
+    if (!rom || count == 0)
+        usage(argv[0]);
+
+    uint8_t *image = (uint8_t *)calloc(0x10000, 1);
+    if (machineLoadROM(image, rom, 0) < 0){
+        printf("Cannot read %s\n", rom);
+        exit(EXIT_FAILURE);
+    }
+
+    Pool *pool = poolCreate(count, image, threads, huge);
+    PoolProgress progress;
+    static const char *pages[] = {"4 KB pages", "transparent huge pages", "2 MB pages"};
+
+    if (!pool){
+        printf("Cannot map %u instances\n", count);
+        exit(EXIT_FAILURE);
+    }
+    printf("%u instances on %d threads, %.1f MB on %s\n", pool->count, pool->threads,
+           pool->arena->size / 1048576.0, pages[pool->arena->pages]);
+    poolStart(pool, frames, slice);
+    while (!poolWait(pool, 1000)){
+        poolProgress(pool, &progress);
+        printProgress(&progress);
+    }
+    poolProgress(pool, &progress);
+    printProgress(&progress);
+
+    if (verbose){
+        printf("instance        frames  instructions    slices   host ms  stopped\n");
+        for (uint32_t i = 0; i < pool->count; i++){
+            PoolInstance *inst = &pool->instances[i];
+            printf("%8u  %12llu  %12llu  %8llu  %8.1f  %s\n", i, (unsigned long long)inst->machine->frames,
+                   (unsigned long long)inst->machine->instructions, (unsigned long long)inst->slices,
+                   inst->ns / 1e6, stopReasonName(inst->state->stop));
+        }
+    }
+
+    printf("%llu instructions, %llu frames in %.3f s: %.2f MIPS, %.1fx a 2 MHz 8080 per thread\n",
+           (unsigned long long)progress.instructions, (unsigned long long)progress.frames, progress.seconds,
+           progress.seconds > 0 ? progress.instructions / progress.seconds / 1e6 : 0.0,
+           progress.seconds > 0 ? progress.cycles / progress.seconds / 2e6 / pool->threads : 0.0);
+
+    poolFree(pool);
+    free(image);
+    return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * Count the opcode sequences in a binary trace (written by main.c) to choose
+ * the pairs worth fusing in Emulate8080Pair. Only straight-line sequences
+ * are counted, where each instruction follows the previous one in memory,
+ * since those are the only ones a dispatch can fuse.
+ *
+ * usage: ngrams [-n length] [-k count] <trace>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emulator.h"
+#include "trace.h"
+#include "disassembler.h"
+
+#define MAX_LENGTH  4       // opcodes per sequence, packed into a 32-bit key
+
+typedef struct Gram {
+    uint32_t   key;         // the opcodes, first in the top byte used
+    uint64_t   count;
+} Gram;
+
+typedef struct Counter {
+    int        length;
+    Gram       *table;      // open addressing, count 0 for a free slot
+    uint32_t   capacity;
+    uint32_t   used;
+    TraceRecord window[MAX_LENGTH];         // the last `length` records
+    int        held;        // records in the window, up to `length`
+    uint64_t   instructions;
+    uint64_t   grams;
+} Counter;
+
+static void usage(const char *name){
+    printf("usage: %s [options] <trace>\n"
+           "  -n length  opcodes per sequence, 2 to %d (default 2)\n"
+           "  -k count   sequences to list (default 20)\n", name, MAX_LENGTH);
+    exit(EXIT_FAILURE);
+}
+
+static inline uint32_t slotOf(uint32_t key, uint32_t capacity){
+    return (key * 0x9e3779b1u) >> 7 & (capacity - 1);
+}
+
+static void grow(Counter *c){
+    Gram *old = c->table;
+    uint32_t old_capacity = c->capacity;
+
+    c->capacity = old ? old_capacity * 2 : 1 << 12;
+    c->table = (Gram *)calloc(c->capacity, sizeof(Gram));
+    for (uint32_t i = 0; i < old_capacity; i++){
+        if (!old[i].count)
+            continue;
+        uint32_t slot = slotOf(old[i].key, c->capacity);
+        while (c->table[slot].count)
+            slot = (slot + 1) & (c->capacity - 1);
+        c->table[slot] = old[i];
+    }
+    free(old);
+}
+
+static void add(Counter *c, uint32_t key){
+    uint32_t slot = slotOf(key, c->capacity);
+
+    while (c->table[slot].count && c->table[slot].key != key)
+        slot = (slot + 1) & (c->capacity - 1);
+    if (!c->table[slot].count){
+        c->table[slot].key = key;
+        if (++c->used * 2 > c->capacity){
+            c->table[slot].count = 1;
+            grow(c);
+            return;
+        }
+    }
+    c->table[slot].count++;
+}
+
+// the last `length` records, if they are straight-line code as the core steps PC
+static void countWindow(Counter *c){
+    const TraceRecord *w = c->window;
+    uint32_t key = w[0].opcode;
+
+    for (int i = 1; i < c->length; i++){
+        if (w[i].pc != (uint16_t)(w[i - 1].pc + length8080[w[i - 1].opcode]))
+            return;
+        key = key << 8 | w[i].opcode;
+    }
+    add(c, key);
+    c->grams++;
+}
+
+static void visit(void *ctx, const TraceRecord *records, uint32_t count){
+    Counter *c = (Counter *)ctx;
+
+    // the window carries over from block to block, so sequences can span them
+    for (uint32_t i = 0; i < count; i++){
+        memmove(c->window, c->window + 1, (c->length - 1) * sizeof(TraceRecord));
+        c->window[c->length - 1] = records[i];
+        if (c->held < c->length)
+            c->held++;
+        if (c->held == c->length)
+            countWindow(c);
+    }
+    c->instructions += count;
+}
+
+static int byCount(const void *x, const void *y){
+    const Gram *a = (const Gram *)x, *b = (const Gram *)y;
+    return a->count < b->count ? 1 : a->count > b->count ? -1 : (a->key > b->key) - (a->key < b->key);
+}
+
+// the mnemonic without its operand values, e.g. "JNZ" or "MOV A,M"
+static void mnemonic(uint8_t opcode, char *name, size_t size){
+    unsigned char code[3] = {opcode, 0, 0};
+    char text[64] = {0};
+    FILE *out = fmemopen(text, sizeof(text) - 1, "w");
+    Disassemble8080Mnemonic(out, code);
+    fclose(out);
+
+    size_t n = strcspn(text, "#$");
+    while (n && (text[n - 1] == ' ' || text[n - 1] == ','))
+        n--;
+    text[n] = 0;
+
+    // squeeze the column padding
+    size_t j = 0;
+    for (size_t i = 0; text[i] && j + 1 < size; i++)
+        if (text[i] != ' ' || (j && name[j - 1] != ' '))
+            name[j++] = text[i];
+    name[j] = 0;
+}
+
+int main(int argc, char *argv[]) {
+    Counter c;
+    char names[256][24];
+    const char *path = NULL;
+    int top = 20;
+
+    memset(&c, 0, sizeof(c));
+    c.length = 2;
+    for (int i = 1; i < argc; i++){
+        if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+            c.length = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-k") == 0)
+            top = atoi(argv[++i]);
+        else if (argv[i][0] != '-' && !path)
+            path = argv[i];
+        else
+            usage(argv[0]);
+    }
+    if (!path || c.length < 2 || c.length > MAX_LENGTH)
+        usage(argv[0]);
+
+    for (int op = 0; op < 256; op++)
+        mnemonic(op, names[op], sizeof(names[op]));
+    grow(&c);
+
+    FILE *f = fopen(path, "rb");
+    if (!f){
+        printf("cannot open trace file %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (traceScan(f, visit, &c) < 0){
+        printf("%s is not a trace\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+
+    // compact the table and sort it, most frequent first
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < c.capacity; i++)
+        if (c.table[i].count)
+            c.table[n++] = c.table[i];
+    qsort(c.table, n, sizeof(Gram), byCount);
+
+    printf("# %llu instructions, %llu straight-line sequences of %d, %u different\n",
+           (unsigned long long)c.instructions, (unsigned long long)c.grams, c.length, n);
+    for (uint32_t i = 0; i < n && i < (uint32_t)top; i++){
+        printf("%12llu %6.2f%%  ", (unsigned long long)c.table[i].count,
+               c.instructions ? 100.0 * c.table[i].count / c.instructions : 0.0);
+        for (int j = c.length - 1; j >= 0; j--)
+            printf("%02x ", (c.table[i].key >> (8 * j)) & 0xff);
+        for (int j = c.length - 1; j >= 0; j--)
+            printf("%s%s", names[(c.table[i].key >> (8 * j)) & 0xff], j ? "; " : "\n");
+    }
+
+    free(c.table);
+    return 0;
+}
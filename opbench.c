@@ -0,0 +1,283 @@
+/*
+ * Per-opcode microbenchmark.
+ *
+ * For every opcode a small ROM is generated: a prologue that points SP, HL, DE
+ * and BC at RAM, then 64 copies of the instruction followed by a JMP back, so the
+ * loop runs the opcode millions of times. Instructions that move SP or PC are
+ * paired with one that undoes them (PUSH B/POP B, CALL/POP, LXI H/PCHL, ...) and
+ * reported per instruction of the pair. Branch targets are the next instruction,
+ * so taken and not-taken branches fall through the same way; with the flags all
+ * clear JNZ/JNC/JPO/JP are taken and JZ/JC/JPE/JM are not.
+ *
+ * usage: opbench [-n instructions] [-o results.csv] [-l label]
+ *   -n  instructions to execute per opcode (default 10000000)
+ *   -o  write one CSV row per opcode and per family, for tracking regressions
+ *   -l  label for the CSV rows, e.g. the commit id
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emulator.h"
+#include "disassembler.h"
+
+#define PROLOGUE    0x0040
+#define BODY        0x0100
+#define UNROLL      64
+#define RAM_OPERAND 0x2080  // address operand for LDA/STA/LHLD/SHLD
+
+typedef struct OpResult {
+    int        measured;
+    const char *status;     // "ok", or why the opcode stopped the core (unimplemented, halt)
+    int        unit;        // instructions per repeated unit
+    char       mnemonic[32];
+    char       mix[48];     // what was repeated, when it is more than the opcode
+    double     ns;          // host ns per executed instruction
+} OpResult;
+
+// condition of Jcc/Ccc/Rcc holds with all flags clear
+static int conditionHolds(uint8_t op){
+    return ((op >> 3) & 1) == 0;    // NZ, NC, PO, P
+}
+
+// lengths as the core steps PC, so CMP r/M gets the byte it skips
+static uint16_t emit(uint8_t *memory, uint16_t at, uint8_t op, uint16_t operand){
+    memory[at] = op;
+    if (length8080[op] >= 2)
+        memory[at + 1] = operand & 0xff;
+    if (length8080[op] == 3)
+        memory[at + 2] = operand >> 8;
+    return at + length8080[op];
+}
+
+/*
+ * Write one repeated unit for `op` at `at`
+ * @return the address after the unit; *unit gets the number of instructions in it
+ */
+static uint16_t emitUnit(uint8_t *memory, uint16_t at, uint8_t op, int *unit, char *mix){
+    uint8_t kind = op & 0xc7;
+    uint16_t next = at + length8080[op];
+
+    *unit = 1;
+    mix[0] = '\0';
+
+    if (op == 0xe9){                                    // PCHL
+        uint16_t target = at + 4;
+        at = emit(memory, at, 0x21, target);
+        *unit = 2;
+        strcpy(mix, "LXI H,next; PCHL");
+        return emit(memory, at, op, 0);
+    }
+    if ((op & 0xcf) == 0xc5 || (op & 0xcf) == 0xc1){    // PUSH/POP rp
+        uint8_t push = op | 0x04, pop = op & ~0x04;
+        at = emit(memory, at, push, 0);
+        *unit = 2;
+        sprintf(mix, "PUSH/POP pair %02x %02x", push, pop);
+        return emit(memory, at, pop, 0);
+    }
+    if (op == 0xcd || (kind == 0xc4 && conditionHolds(op))){    // CALL taken
+        at = emit(memory, at, op, next);
+        *unit = 2;
+        strcpy(mix, "CALL next; POP B");
+        return emit(memory, at, 0xc1, 0);
+    }
+    if (op == 0xc9 || op == 0xd9 || (kind == 0xc0 && conditionHolds(op))){  // RET taken
+        uint16_t target = at + 5;
+        at = emit(memory, at, 0x01, target);
+        at = emit(memory, at, 0xc5, 0);
+        *unit = 3;
+        strcpy(mix, "LXI B,next; PUSH B; RET");
+        return emit(memory, at, op, 0);
+    }
+    if (kind == 0xc7){                                  // RST n, vectors hold RET
+        // the core's RST pushes PC+2 with PC already past the opcode, so the
+        // RET lands on RST+3 and the two padding bytes are stepped over
+        at = emit(memory, at, op, 0);
+        at = emit(memory, at, 0x00, 0);
+        *unit = 2;
+        strcpy(mix, "RST n; RET (2 pad bytes skipped)");
+        return emit(memory, at, 0x00, 0);
+    }
+    if (kind == 0xc2 || kind == 0xc4 || op == 0xc3 || op == 0xcb)   // jumps, calls not taken
+        return emit(memory, at, op, next);
+    if (op == 0x22 || op == 0x2a || op == 0x32 || op == 0x3a)
+        return emit(memory, at, op, RAM_OPERAND);
+    if (op == 0x21)                                     // LXI H keeps HL on RAM
+        return emit(memory, at, op, 0x2100);
+    if (op == 0x26)                                     // MVI H likewise
+        return emit(memory, at, op, 0x21);
+
+    return emit(memory, at, op, 0x01);
+}
+
+static void buildROM(uint8_t *memory, uint8_t op, OpResult *res){
+    uint16_t at;
+
+    memset(memory, 0, 0x10000);
+    // every RST vector (and whatever the core jumps to for them) returns at once
+    memset(memory, 0xc9, PROLOGUE);
+
+    at = PROLOGUE;
+    at = emit(memory, at, 0x31, 0x2400);    // LXI SP
+    at = emit(memory, at, 0x21, 0x2100);    // LXI H
+    at = emit(memory, at, 0x11, 0x2200);    // LXI D
+    at = emit(memory, at, 0x01, 0x2300);    // LXI B
+    emit(memory, at, 0xc3, BODY);
+
+    at = BODY;
+    for (int i = 0; i < UNROLL; i++)
+        at = emitUnit(memory, at, op, &res->unit, res->mix);
+    emit(memory, at, 0xc3, BODY);
+}
+
+static uint64_t nowNs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void measure(uint8_t *memory, uint8_t op, uint64_t count, OpResult *res){
+    State8080 state;
+
+    memset(res, 0, sizeof(*res));
+    buildROM(memory, op, res);
+    {
+        // single instructions show the operands they ran with
+        uint8_t code[3] = {op, 0, 0};
+        if (res->unit == 1)
+            memcpy(code, &memory[BODY], length8080[op]);
+        FILE *f = fmemopen(res->mnemonic, sizeof(res->mnemonic), "w");
+        Disassemble8080Mnemonic(f, code);
+        fclose(f);
+    }
+
+    memset(&state, 0, sizeof(state));
+    state.memory = memory;
+    state.pc = PROLOGUE;
+
+    uint64_t start = nowNs();
+    uint64_t n;
+    for (n = 0; n < count; n++){
+        Emulate8080Op(&state);
+        if (state.stop)
+            break;
+    }
+    uint64_t elapsed = nowNs() - start;
+
+    if (state.stop){
+        res->status = stopReasonName(state.stop);
+        return;
+    }
+    res->status = "ok";
+    res->measured = 1;
+    res->ns = (double)elapsed / n;
+}
+
+typedef struct Family {
+    const char *name;
+    int        (*member)(uint8_t op);
+} Family;
+
+static int isMovRR(uint8_t op)      { return op >= 0x40 && op < 0x80 && op != 0x76 && (op & 7) != 6 && ((op >> 3) & 7) != 6; }
+static int isMovM(uint8_t op)       { return op >= 0x40 && op < 0x80 && op != 0x76 && ((op & 7) == 6 || ((op >> 3) & 7) == 6); }
+static int isAluR(uint8_t op)       { return op >= 0x80 && op < 0xc0 && (op & 7) != 6; }
+static int isAluM(uint8_t op)       { return op >= 0x80 && op < 0xc0 && (op & 7) == 6; }
+static int isAluI(uint8_t op)       { return (op & 0xc7) == 0xc6; }
+static int isJccTaken(uint8_t op)   { return (op & 0xc7) == 0xc2 && conditionHolds(op); }
+static int isJccNotTaken(uint8_t op){ return (op & 0xc7) == 0xc2 && !conditionHolds(op); }
+static int isCallTaken(uint8_t op)  { return op == 0xcd || ((op & 0xc7) == 0xc4 && conditionHolds(op)); }
+static int isCccNotTaken(uint8_t op){ return (op & 0xc7) == 0xc4 && !conditionHolds(op); }
+static int isRetTaken(uint8_t op)   { return op == 0xc9 || ((op & 0xc7) == 0xc0 && conditionHolds(op)); }
+static int isRccNotTaken(uint8_t op){ return (op & 0xc7) == 0xc0 && !conditionHolds(op); }
+static int isPushPop(uint8_t op)    { return op >= 0xc0 && ((op & 0xcf) == 0xc5 || (op & 0xcf) == 0xc1); }
+static int isIncDec(uint8_t op)     { return op < 0x40 && ((op & 7) == 4 || (op & 7) == 5 || (op & 7) == 3); }
+
+static const Family families[] = {
+    {"MOV r,r",             isMovRR},
+    {"MOV r,M / MOV M,r",   isMovM},
+    {"ALU r",               isAluR},
+    {"ALU M",               isAluM},
+    {"ALU immediate",       isAluI},
+    {"INR/DCR/INX/DCX",     isIncDec},
+    {"Jcc taken",           isJccTaken},
+    {"Jcc not taken",       isJccNotTaken},
+    {"CALL/Ccc taken",      isCallTaken},
+    {"Ccc not taken",       isCccNotTaken},
+    {"RET/Rcc taken",       isRetTaken},
+    {"Rcc not taken",       isRccNotTaken},
+    {"PUSH/POP",            isPushPop},
+};
+
+int main(int argc, char *argv[]) {
+    uint64_t count = 10000000;
+    const char *csv_path = NULL;
+    const char *label = "";
+    OpResult *results = (OpResult *)calloc(256, sizeof(OpResult));
+    uint8_t *memory = (uint8_t *)malloc(0x10000);
+
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            count = strtoull(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            csv_path = argv[++i];
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            label = argv[++i];
+        else{
+            printf("usage: %s [-n instructions] [-o results.csv] [-l label]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("op  mnemonic           ns/ins  repeated\n");
+    for (int op = 0; op < 256; op++){
+        OpResult *res = &results[op];
+        measure(memory, op, count, res);
+
+        if (!res->measured)
+            printf("%02x  %-16s %8s\n", op, res->mnemonic, res->status);
+        else
+            printf("%02x  %-16s %8.2f  %s\n", op, res->mnemonic, res->ns, res->mix);
+    }
+
+    printf("\nfamily                  ns/ins  opcodes\n");
+    double family_ns[sizeof(families) / sizeof(families[0])];
+    int family_n[sizeof(families) / sizeof(families[0])];
+    for (size_t f = 0; f < sizeof(families) / sizeof(families[0]); f++){
+        double sum = 0;
+        int n = 0;
+        for (int op = 0; op < 256; op++){
+            if (families[f].member(op) && results[op].measured){
+                sum += results[op].ns;
+                n++;
+            }
+        }
+        family_ns[f] = n ? sum / n : 0;
+        family_n[f] = n;
+        if (n)
+            printf("%-22s %7.2f  %d\n", families[f].name, family_ns[f], n);
+        else
+            printf("%-22s %7s  0\n", families[f].name, "-");
+    }
+
+    if (csv_path){
+        FILE *csv = fopen(csv_path, "w");
+        if (!csv){
+            printf("Cannot write %s\n", csv_path);
+            exit(EXIT_FAILURE);
+        }
+        fprintf(csv, "label,kind,name,opcode,status,ns_per_instruction,unit\n");
+        for (int op = 0; op < 256; op++){
+            OpResult *res = &results[op];
+            fprintf(csv, "%s,opcode,\"%s\",%02x,%s,%.3f,%d\n", label, res->mnemonic, op,
+                    res->status, res->ns, res->unit);
+        }
+        for (size_t f = 0; f < sizeof(families) / sizeof(families[0]); f++)
+            fprintf(csv, "%s,family,\"%s\",,%s,%.3f,%d\n", label, families[f].name,
+                    family_n[f] ? "ok" : "unmeasured", family_ns[f], family_n[f]);
+        fclose(csv);
+    }
+
+    free(results);
+    free(memory);
+    return 0;
+}
@@ -0,0 +1,242 @@
+#define _GNU_SOURCE     // REG_EFL in ucontext.h
+#include "pagewatch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+#define TRAP_FLAG   0x100       // EFLAGS.TF: trap after the next instruction
+#define HAVE_SINGLE_STEP
+#endif
+
+#define MAX_HOST_PAGES  (0x10000 / 4096)
+#ifdef HAVE_SINGLE_STEP
+#define MAX_PENDING     4       // stores that faulted and have not trapped yet
+#else
+// a page stays writable until pageWatchRearm, so each can fault once a frame
+#define MAX_PENDING     MAX_HOST_PAGES
+#endif
+
+/*
+ * Everything the signal handlers touch lives here: a handler has no way to be
+ * passed a context, so there is one watcher per process.
+ */
+static State8080 *volatile target;
+static uint8_t *memory;
+static long page_size;
+static int page_shift;
+static int stop_on_hit;
+static int running;
+static uint64_t watched[0x10000 / 64];      // the watched bytes
+static uint32_t page_watches[MAX_HOST_PAGES]; // watched bytes per host page
+static uint8_t armed[MAX_HOST_PAGES];       // the host page is read-only now
+static PageWatchHit history[PAGEWATCH_HISTORY];
+static volatile uint64_t hits;
+// stores that faulted on a watched page; the value is read once they are done
+static struct {
+    uint64_t   hit;         // its entry in the history
+    uint16_t   address;
+    uint8_t    watched;
+    uint8_t    page;
+} pending[MAX_PENDING];
+static volatile int pending_count;
+static struct sigaction previous_segv;
+static struct sigaction previous_trap;
+
+static inline int isWatched(uint16_t address){
+    return (watched[address >> 6] >> (address & 63)) & 1;
+}
+
+static void protectPage(int page, int read_only){
+    mprotect(memory + ((size_t)page << page_shift), page_size, read_only ? PROT_READ : PROT_READ | PROT_WRITE);
+    armed[page] = read_only;
+}
+
+// the stores that faulted have completed: record their values and protect the pages again
+static void finishPending(void){
+    State8080 *state = target;
+
+    for (int i = 0; i < pending_count; i++){
+        if (pending[i].watched){
+            PageWatchHit *hit = &history[pending[i].hit & (PAGEWATCH_HISTORY - 1)];
+            hit->value = memory[pending[i].address];
+            if (stop_on_hit && state && !state->stop)
+                state->stop = STOP_BREAK;
+        }
+        if (page_watches[pending[i].page])
+            protectPage(pending[i].page, 1);
+    }
+    pending_count = 0;
+}
+
+// let the previous handler have a signal that is not ours: the access faults again and goes to it
+static void passOn(int sig, struct sigaction *previous){
+    sigaction(sig, previous, NULL);
+}
+
+static void onFault(int sig, siginfo_t *info, void *context){
+    (void)context;
+    State8080 *state = target;
+    uint8_t *address = (uint8_t *)info->si_addr;
+
+    if (!state || address < memory || address >= memory + 0x10000 || pending_count == MAX_PENDING){
+        passOn(sig, &previous_segv);
+        return;
+    }
+    uint16_t offset = address - memory;
+    int page = offset >> page_shift;
+    if (!armed[page]){
+        passOn(sig, &previous_segv);
+        return;
+    }
+
+    // a store next to a watched range on the same host page is let through without a hit
+    pending[pending_count].address = offset;
+    pending[pending_count].page = page;
+    pending[pending_count].watched = isWatched(offset);
+    if (pending[pending_count].watched){
+        PageWatchHit *hit = &history[hits & (PAGEWATCH_HISTORY - 1)];
+        hit->address = offset;
+        hit->value = 0;
+        hit->pc = state->pc;
+        hit->cycles = state->cycles;
+        pending[pending_count].hit = hits++;
+    }
+    pending_count++;
+    protectPage(page, 0);
+
+#ifdef HAVE_SINGLE_STEP
+    // return into the store, then trap right after it
+    ucontext_t *uc = (ucontext_t *)context;
+    uc->uc_mcontext.gregs[REG_EFL] |= TRAP_FLAG;
+#endif
+}
+
+#ifdef HAVE_SINGLE_STEP
+static void onTrap(int sig, siginfo_t *info, void *context){
+    (void)info;
+    ucontext_t *uc = (ucontext_t *)context;
+
+    if (!pending_count){
+        passOn(sig, &previous_trap);
+        raise(sig);
+        return;
+    }
+    uc->uc_mcontext.gregs[REG_EFL] &= ~TRAP_FLAG;
+    finishPending();
+}
+#endif
+
+uint8_t *pageWatchAlloc(void){
+    long size = sysconf(_SC_PAGESIZE);
+    // the core reads memory[sp + 1] without wrapping, so map a page past the end
+    void *p = mmap(NULL, 0x10000 + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return p == MAP_FAILED ? NULL : (uint8_t *)p;
+}
+
+void pageWatchRelease(uint8_t *memory){
+    if (memory)
+        munmap(memory, 0x10000 + sysconf(_SC_PAGESIZE));
+}
+
+int pageWatchStart(State8080 *state, int stop){
+    struct sigaction sa;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    if (running || page_size <= 0 || (page_size & (page_size - 1)) || 0x10000 / page_size > MAX_HOST_PAGES ||
+        ((uintptr_t)state->memory & (page_size - 1)))
+        return -1;
+    for (page_shift = 0; (1L << page_shift) < page_size; page_shift++)
+        ;
+
+    target = state;
+    memory = state->memory;
+    stop_on_hit = stop;
+    hits = 0;
+    pending_count = 0;
+    memset(watched, 0, sizeof(watched));
+    memset(page_watches, 0, sizeof(page_watches));
+    memset(armed, 0, sizeof(armed));
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = onFault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGSEGV, &sa, &previous_segv) != 0)
+        return -1;
+#ifdef HAVE_SINGLE_STEP
+    sa.sa_sigaction = onTrap;
+    if (sigaction(SIGTRAP, &sa, &previous_trap) != 0){
+        sigaction(SIGSEGV, &previous_segv, NULL);
+        return -1;
+    }
+#endif
+
+    running = 1;
+    return 0;
+}
+
+void pageWatchStop(void){
+    if (!running)
+        return;
+
+    pageWatchRemove(0, 0xffff);
+    finishPending();
+    sigaction(SIGSEGV, &previous_segv, NULL);
+#ifdef HAVE_SINGLE_STEP
+    sigaction(SIGTRAP, &previous_trap, NULL);
+#endif
+    target = NULL;
+    running = 0;
+}
+
+int pageWatchAdd(uint16_t start, uint16_t end){
+    if (!running)
+        return -1;
+
+    for (uint32_t address = start; address <= end; address++){
+        if (isWatched(address))
+            continue;
+        watched[address >> 6] |= 1ull << (address & 63);
+        if (page_watches[address >> page_shift]++ == 0)
+            protectPage(address >> page_shift, 1);
+    }
+    return 0;
+}
+
+void pageWatchRemove(uint16_t start, uint16_t end){
+    if (!running)
+        return;
+
+    for (uint32_t address = start; address <= end; address++){
+        if (!isWatched(address))
+            continue;
+        watched[address >> 6] &= ~(1ull << (address & 63));
+        if (--page_watches[address >> page_shift] == 0 && armed[address >> page_shift])
+            protectPage(address >> page_shift, 0);
+    }
+}
+
+void pageWatchRearm(void){
+    if (running && pending_count)
+        finishPending();
+}
+
+uint64_t pageWatchHits(void){
+    return hits;
+}
+
+int pageWatchRecent(PageWatchHit *out, int max){
+    uint64_t count = hits;
+    int n = count < (uint64_t)max ? (int)count : max;
+
+    if (n > PAGEWATCH_HISTORY)
+        n = PAGEWATCH_HISTORY;
+    for (int i = 0; i < n; i++)
+        out[i] = history[(count - n + i) & (PAGEWATCH_HISTORY - 1)];
+    return n;
+}
@@ -0,0 +1,67 @@
+#ifndef PAGEWATCH_H
+#define PAGEWATCH_H
+#include <stdint.h>
+#include "emulator.h"
+
+/*
+ * Write watchpoints on big regions (video RAM, the stack...) using the host
+ * MMU, for a long-running instance where a check on every store would cost
+ * too much.
+ *
+ * Guest memory has to come from pageWatchAlloc, so it starts on a host page.
+ * Watched host pages are made read-only. The first store to one raises
+ * SIGSEGV. The handler records the address and guest PC, makes the page
+ * writable, and sets the trap flag so the store completes. The SIGTRAP that
+ * follows records the value written and makes the page read-only again.
+ * Stores to other pages run at full speed, and so do loads from every page.
+ * On hosts without a trap flag (anything but x86), the page stays writable
+ * until pageWatchRearm; call it between frames.
+ *
+ * The granularity is the host page (4 KB on x86): a store next to a watched
+ * range on the same page traps too, and is left out of the count. Host code
+ * writing guest memory (a snapshot restore) traps like the guest, with the
+ * guest PC of wherever the guest was. Only one state per process can be
+ * watched, like the sampler.
+ */
+
+#define PAGEWATCH_HISTORY   1024    // hits kept for pageWatchRecent, a power of two
+
+typedef struct PageWatchHit {
+    uint16_t   address;
+    uint8_t    value;       // as written; not known until the store completes
+    uint16_t   pc;          // the guest PC mid-instruction: past the opcode, maybe past the operands
+    uint64_t   cycles;
+} PageWatchHit;
+
+/*
+ * 64K of guest memory on its own host pages, plus a tail for the core's
+ * reads past 0xffff
+ * @return NULL if it cannot be mapped
+ */
+uint8_t *pageWatchAlloc(void);
+void pageWatchRelease(uint8_t *memory);
+
+/*
+ * Install the handlers for `state`, whose memory came from pageWatchAlloc
+ * @param stop Also stop the run (STOP_BREAK) after a watched store
+ * @return 0, or -1 if the handlers cannot be installed or the memory is not page aligned
+ */
+int pageWatchStart(State8080 *state, int stop);
+
+// remove every watch and the handlers
+void pageWatchStop(void);
+
+// watch stores to start..end (inclusive); @return -1 if not started
+int pageWatchAdd(uint16_t start, uint16_t end);
+void pageWatchRemove(uint16_t start, uint16_t end);
+
+// protect every watched page again; only needed without a trap flag
+void pageWatchRearm(void);
+
+// stores to watched ranges since pageWatchStart
+uint64_t pageWatchHits(void);
+
+// copy up to `max` of the latest hits, oldest first; @return how many
+int pageWatchRecent(PageWatchHit *hits, int max);
+
+#endif
@@ -0,0 +1,111 @@
+#include "perf.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static const char *counter_names[PERF_COUNTERS] = {
+    "cycles", "instructions", "branch-misses", "L1d-misses"
+};
+
+static int openCounter(uint32_t type, uint64_t config){
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int perfOpen(PerfCounters *pc){
+    int opened = 0;
+
+    memset(pc, 0, sizeof(PerfCounters));
+    pc->fd[PERF_CYCLES] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    pc->fd[PERF_INSTRUCTIONS] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    pc->fd[PERF_BRANCH_MISSES] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    pc->fd[PERF_L1D_MISSES] = openCounter(PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_L1D |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+    for (int i = 0; i < PERF_COUNTERS; i++)
+        if (pc->fd[i] >= 0)
+            opened++;
+
+    return opened;
+}
+
+void perfStart(PerfCounters *pc){
+    for (int i = 0; i < PERF_COUNTERS; i++){
+        if (pc->fd[i] < 0)
+            continue;
+        ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &pc->start);
+}
+
+void perfStop(PerfCounters *pc){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pc->ns = (now.tv_sec - pc->start.tv_sec) * 1000000000ULL + (now.tv_nsec - pc->start.tv_nsec);
+
+    for (int i = 0; i < PERF_COUNTERS; i++){
+        uint64_t buf[3];    // value, time enabled, time running
+
+        pc->value[i] = 0;
+        if (pc->fd[i] < 0)
+            continue;
+        ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(pc->fd[i], buf, sizeof(buf)) != sizeof(buf))
+            continue;
+
+        // the kernel time-shares counters when there are more than the PMU has
+        if (buf[2] && buf[2] < buf[1])
+            pc->value[i] = (uint64_t)((double)buf[0] * buf[1] / buf[2]);
+        else
+            pc->value[i] = buf[0];
+    }
+}
+
+void perfClose(PerfCounters *pc){
+    for (int i = 0; i < PERF_COUNTERS; i++){
+        if (pc->fd[i] >= 0)
+            close(pc->fd[i]);
+        pc->fd[i] = -1;
+    }
+}
+
+void perfReport(const PerfCounters *pc, uint64_t guest_instructions, uint64_t guest_cycles, FILE *out){
+    double gi = guest_instructions ? (double)guest_instructions : 1.0;
+    double gc = guest_cycles ? (double)guest_cycles : 1.0;
+
+    fprintf(out, "guest instructions %llu, guest cycles %llu, host time %.3f s\n",
+            (unsigned long long)guest_instructions, (unsigned long long)guest_cycles, pc->ns / 1e9);
+    fprintf(out, "  %-14s %14s %14s %14s\n", "", "total", "per guest ins", "per guest cyc");
+    fprintf(out, "  %-14s %14llu %14.3f %14.3f\n", "host ns",
+            (unsigned long long)pc->ns, pc->ns / gi, pc->ns / gc);
+
+    for (int i = 0; i < PERF_COUNTERS; i++){
+        if (pc->fd[i] < 0){
+            fprintf(out, "  %-14s %14s\n", counter_names[i], "n/a");
+            continue;
+        }
+        fprintf(out, "  %-14s %14llu %14.3f %14.3f\n", counter_names[i],
+                (unsigned long long)pc->value[i], pc->value[i] / gi, pc->value[i] / gc);
+    }
+
+    if (pc->fd[PERF_CYCLES] >= 0 && pc->fd[PERF_INSTRUCTIONS] >= 0 && pc->value[PERF_CYCLES])
+        fprintf(out, "  host IPC %.3f\n", (double)pc->value[PERF_INSTRUCTIONS] / pc->value[PERF_CYCLES]);
+    fprintf(out, "  %.2f guest MIPS, %.2fx a 2 MHz 8080\n",
+            guest_instructions * 1000.0 / (pc->ns ? pc->ns : 1),
+            guest_cycles / ((pc->ns ? pc->ns : 1) / 1e9) / 2e6);
+}
@@ -0,0 +1,37 @@
+#ifndef PERF_H
+#define PERF_H
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Host hardware counters around a stretch of emulation, via Linux perf_event_open.
+ * Each counter is opened on its own, so a host that lacks one (or a container
+ * that allows none) still gets the others, or at least the wall-clock time.
+ */
+
+enum {
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,
+    PERF_COUNTERS
+};
+
+typedef struct PerfCounters {
+    int        fd[PERF_COUNTERS];       // -1 if the counter is unavailable
+    uint64_t   value[PERF_COUNTERS];    // scaled for multiplexing
+    uint64_t   ns;                      // wall-clock time between start and stop
+    struct timespec  start;
+} PerfCounters;
+
+// @return the number of hardware counters that could be opened (0 = wall clock only)
+int perfOpen(PerfCounters *pc);
+void perfStart(PerfCounters *pc);
+void perfStop(PerfCounters *pc);
+void perfClose(PerfCounters *pc);
+
+// counters per guest instruction and per guest cycle; unavailable counters are reported as such
+void perfReport(const PerfCounters *pc, uint64_t guest_instructions, uint64_t guest_cycles, FILE *out);
+
+#endif
@@ -0,0 +1,51 @@
+/*
+ * Run a ROM at full speed and report host hardware counters per guest
+ * instruction and per guest cycle. Falls back to wall-clock time when
+ * perf_event_open is not permitted (e.g. in a container).
+ *
+ * usage: perfbench <rom> [instructions]   (default 100000000)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "emulator.h"
+#include "machine.h"
+#include "perf.h"
+
+int main(int argc, char *argv[]) {
+    uint64_t limit = 100000000;
+    PerfCounters counters;
+    Machine machine;
+
+    if (argc != 2 && argc != 3){
+        printf("usage: %s <rom> [instructions]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (argc == 3)
+        limit = strtoull(argv[2], NULL, 0);
+
+    uint8_t *memory = (uint8_t *)calloc(0x10000, 1);
+    if (machineLoadROM(memory, argv[1], 0) < 0){
+        printf("Cannot read %s\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    State8080 *state = initState(memory);
+    machineInit(&machine, state);
+
+    if (perfOpen(&counters) == 0)
+        printf("hardware counters unavailable, reporting wall-clock time only\n");
+
+    perfStart(&counters);
+    StopReason reason = machineRun(&machine, limit, 0, 0);
+    perfStop(&counters);
+
+    printf("stopped: %s", stopReasonName(reason));
+    if (reason == STOP_UNIMPLEMENTED)
+        printf(" (opcode %02x at $%04x)", memory[state->pc], state->pc);
+    printf(", %llu frames\n", (unsigned long long)machine.frames);
+    perfReport(&counters, machine.instructions, state->cycles, stdout);
+
+    perfClose(&counters);
+    free(state);
+    free(memory);
+    return 0;
+}
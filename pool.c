@@ -0,0 +1,325 @@
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t nowNs(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// a deadline for pthread_cond_timedwait on a CLOCK_MONOTONIC condition variable
+static struct timespec atNs(uint64_t ns){
+    struct timespec t = {ns / 1000000000ULL, ns % 1000000000ULL};
+    return t;
+}
+
+typedef struct PoolWorker {
+    Pool       *pool;
+    int        id;
+} PoolWorker;
+
+static void *worker(void *arg);
+
+Pool *poolCreate(uint32_t count, const uint8_t *image, int threads, int huge){
+    Arena *arena = arenaCreate(count, huge);
+    if (!arena)
+        return NULL;
+
+    Pool *pool = (Pool *)calloc(1, sizeof(Pool));
+    pool->arena = arena;
+    memcpy(arenaTemplate(arena)->state->memory, image, 0x10000);
+
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > (int)count)
+        threads = count ? count : 1;
+    pool->count = count;
+    pool->threads = threads;
+
+    pool->instances = (PoolInstance *)aligned_alloc(64, (count ? count : 1) * sizeof(PoolInstance));
+    for (uint32_t i = 0; i < count; i++){
+        PoolInstance *inst = &pool->instances[i];
+        memset(inst, 0, sizeof(*inst));
+        arenaClone(arena, i);
+        inst->machine = arenaMachine(arena, i);
+        inst->state = arenaState(arena, i);
+    }
+
+    pool->queues = (PoolQueue *)aligned_alloc(64, threads * sizeof(PoolQueue));
+    for (int t = 0; t < threads; t++){
+        PoolQueue *q = &pool->queues[t];
+        memset(q, 0, sizeof(*q));
+        pthread_mutex_init(&q->lock, NULL);
+        // an instance is in at most one queue, so any queue can hold them all
+        q->items = (uint32_t *)malloc((count ? count : 1) * sizeof(uint32_t));
+    }
+    pool->workers = (pthread_t *)malloc(threads * sizeof(pthread_t));
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, &attr);
+    pthread_cond_init(&pool->idle, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // the workers park until poolStart
+    for (int t = 0; t < threads; t++){
+        PoolWorker *w = (PoolWorker *)malloc(sizeof(PoolWorker));
+        w->pool = pool;
+        w->id = t;
+        pthread_create(&pool->workers[t], NULL, worker, w);
+    }
+    return pool;
+}
+
+void poolFree(Pool *pool){
+    if (!pool)
+        return;
+    if (pool->running)
+        poolWait(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int t = 0; t < pool->threads; t++)
+        pthread_join(pool->workers[t], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+
+    for (int t = 0; t < pool->threads; t++){
+        pthread_mutex_destroy(&pool->queues[t].lock);
+        free(pool->queues[t].items);
+    }
+    free(pool->instances);
+    free(pool->queues);
+    free(pool->workers);
+    arenaFree(pool->arena);
+    free(pool);
+}
+
+void poolReset(Pool *pool){
+    for (uint32_t i = 0; i < pool->count; i++)
+        arenaReset(pool->arena, i);
+}
+
+static void push(Pool *pool, PoolQueue *q, uint32_t i){
+    pthread_mutex_lock(&q->lock);
+    q->items[(q->head + q->size++) % pool->count] = i;
+    pthread_mutex_unlock(&q->lock);
+}
+
+// the owner takes from the head, so its instances take turns
+static int takeHead(Pool *pool, PoolQueue *q){
+    int i = -1;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->size){
+        i = q->items[q->head];
+        q->head = (q->head + 1) % pool->count;
+        q->size--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return i;
+}
+
+// a thief takes from the tail, away from the owner
+static int takeTail(Pool *pool, PoolQueue *q){
+    int i = -1;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->size){
+        q->size--;
+        i = q->items[(q->head + q->size) % pool->count];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return i;
+}
+
+// run one slice of instance i; @return 1 once the instance is done
+static int runSlice(Pool *pool, PoolInstance *inst){
+    Machine *m = inst->machine;
+    uint64_t start = nowNs();
+    uint64_t frames = m->frames + pool->slice < inst->end_frame ? pool->slice : inst->end_frame - m->frames;
+
+    StopReason reason = machineRun(m, 0, 0, frames);
+    inst->ns += nowNs() - start;
+    inst->slices++;
+
+    __atomic_store_n(&inst->frames, m->frames, __ATOMIC_RELAXED);
+    __atomic_store_n(&inst->instructions, m->instructions, __ATOMIC_RELAXED);
+    __atomic_store_n(&inst->cycles, m->state->cycles, __ATOMIC_RELAXED);
+    return reason != STOP_LIMIT || m->frames >= inst->end_frame;
+}
+
+// one run: slices until every instance is done
+static void runQueues(Pool *pool, int id){
+    PoolQueue *own = &pool->queues[id];
+    int victim = id;
+
+    while (1){
+        int i = takeHead(pool, own);
+
+        for (int tries = 1; i < 0 && tries < pool->threads; tries++){
+            victim = (victim + 1) % pool->threads;
+            if (victim == id)
+                victim = (victim + 1) % pool->threads;
+            if ((i = takeTail(pool, &pool->queues[victim])) >= 0)
+                __atomic_fetch_add(&own->steals, 1, __ATOMIC_RELAXED);
+        }
+
+        if (i < 0){
+            if (__atomic_load_n(&pool->live, __ATOMIC_ACQUIRE) == 0)
+                return;
+            // the rest are being run by other workers: look again for one to steal
+            // shortly, or as soon as the last one finishes
+            struct timespec deadline = atNs(nowNs() + 50000);
+            pthread_mutex_lock(&pool->lock);
+            if (__atomic_load_n(&pool->live, __ATOMIC_ACQUIRE) != 0)
+                pthread_cond_timedwait(&pool->wake, &pool->lock, &deadline);
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        PoolInstance *inst = &pool->instances[i];
+        if (runSlice(pool, inst)){
+            if (pool->done_hook)
+                pool->done_hook(pool->hook_ctx, i);
+            __atomic_store_n(&inst->done, 1, __ATOMIC_RELAXED);
+            if (__atomic_sub_fetch(&pool->live, 1, __ATOMIC_ACQ_REL) == 0){
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_broadcast(&pool->wake);
+                pthread_mutex_unlock(&pool->lock);
+            }
+        } else{
+            push(pool, own, i);
+        }
+    }
+}
+
+static void *worker(void *arg){
+    PoolWorker *w = (PoolWorker *)arg;
+    Pool *pool = w->pool;
+    uint64_t run = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1){
+        while (!pool->quit && pool->run == run)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->quit)
+            break;
+        run = pool->run;
+        pthread_mutex_unlock(&pool->lock);
+
+        runQueues(pool, w->id);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(w);
+    return NULL;
+}
+
+int poolStart(Pool *pool, uint64_t frames, uint32_t slice){
+    if (pool->running)
+        return -1;
+
+    pool->slice = slice ? slice : POOL_DEFAULT_SLICE;
+    pool->live = 0;
+    for (int t = 0; t < pool->threads; t++){
+        pool->queues[t].head = 0;
+        pool->queues[t].size = 0;
+    }
+
+    for (uint32_t i = 0; i < pool->count; i++){
+        PoolInstance *inst = &pool->instances[i];
+        Machine *m = inst->machine;
+
+        inst->end_frame = frames ? m->frames + frames : UINT64_MAX;
+        inst->frames = m->frames;
+        inst->instructions = m->instructions;
+        inst->cycles = inst->state->cycles;
+        // a program that has already stopped for good stays done
+        inst->done = inst->state->stop && inst->state->stop != STOP_LIMIT;
+        if (!inst->done){
+            PoolQueue *q = &pool->queues[i % pool->threads];
+            q->items[q->size++] = i;
+            pool->live++;
+        }
+    }
+
+    pool->start_ns = 0;
+    poolProgress(pool, &pool->base);
+    pool->start_ns = nowNs();
+    pool->running = 1;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->busy = pool->threads;
+    pool->run++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+int poolWait(Pool *pool, uint32_t ms){
+    struct timespec deadline = atNs(nowNs() + ms * 1000000ULL);
+
+    if (!pool->running)
+        return 1;
+    // the last worker to park signals; once all have, none touches the queues
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy){
+        if (!ms)
+            pthread_cond_wait(&pool->idle, &pool->lock);
+        else if (pthread_cond_timedwait(&pool->idle, &pool->lock, &deadline) != 0 && pool->busy){
+            pthread_mutex_unlock(&pool->lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pool->end_ns = nowNs();
+    pool->running = 0;
+    return 1;
+}
+
+void poolProgress(const Pool *pool, PoolProgress *progress){
+    memset(progress, 0, sizeof(*progress));
+    progress->count = pool->count;
+    progress->min_frames = UINT64_MAX;
+
+    for (uint32_t i = 0; i < pool->count; i++){
+        const PoolInstance *inst = &pool->instances[i];
+        uint64_t frames = __atomic_load_n(&inst->frames, __ATOMIC_RELAXED);
+
+        progress->done += __atomic_load_n(&inst->done, __ATOMIC_RELAXED);
+        progress->instructions += __atomic_load_n(&inst->instructions, __ATOMIC_RELAXED);
+        progress->cycles += __atomic_load_n(&inst->cycles, __ATOMIC_RELAXED);
+        progress->frames += frames;
+        if (frames < progress->min_frames)
+            progress->min_frames = frames;
+        if (frames > progress->max_frames)
+            progress->max_frames = frames;
+    }
+    if (!pool->count)
+        progress->min_frames = 0;
+
+    for (int t = 0; t < pool->threads; t++)
+        progress->steals += __atomic_load_n(&pool->queues[t].steals, __ATOMIC_RELAXED);
+
+    if (pool->start_ns){
+        progress->instructions -= pool->base.instructions;
+        progress->cycles -= pool->base.cycles;
+        progress->frames -= pool->base.frames;
+        progress->steals -= pool->base.steals;
+        progress->seconds = ((pool->running ? nowNs() : pool->end_ns) - pool->start_ns) / 1e9;
+    }
+}
@@ -0,0 +1,124 @@
+#ifndef POOL_H
+#define POOL_H
+#include <stdint.h>
+#include <pthread.h>
+#include "emulator.h"
+#include "machine.h"
+#include "arena.h"
+
+/*
+ * Many independent machines on a pool of threads.
+ *
+ * Every instance has its own memory, State8080 and Machine, in one
+ * contiguous arena slot (arena.h); nothing is shared between them, so any
+ * number can run at once. Work is handed out
+ * in slices (a few frames of one instance). Each worker keeps a queue of
+ * instances: it runs the one at the head for a slice and puts it back at
+ * the tail, so its instances take turns. A worker whose queue is empty
+ * steals from the tail of another's, so instances that stop early or run
+ * slower do not leave threads idle.
+ *
+ * The workers are created once, with the pool, and park on a condition
+ * variable between runs, so poolStart and poolWait cost a wakeup each and a
+ * pool can be stepped many times a second.
+ *
+ * Progress counters are published after every slice and can be read while
+ * the pool runs.
+ */
+
+#define POOL_DEFAULT_SLICE  1   // frames
+
+// an instance's scheduling and progress; its machine lives in the arena
+typedef struct PoolInstance {
+    Machine    *machine;
+    State8080  *state;
+    uint64_t   end_frame;       // run until m->frames reaches this, or the program stops
+    int        done;
+    uint64_t   slices;
+    uint64_t   ns;              // host time spent in slices
+    // published after each slice for poolProgress
+    uint64_t   frames;
+    uint64_t   instructions;
+    uint64_t   cycles;
+} __attribute__((aligned(64))) PoolInstance;
+
+typedef struct PoolQueue {
+    pthread_mutex_t lock;
+    uint32_t   *items;          // ring of instance numbers
+    uint32_t   head;
+    uint32_t   size;
+    uint64_t   steals;          // instances this worker took from others
+} __attribute__((aligned(64))) PoolQueue;
+
+typedef struct PoolProgress {
+    uint32_t   count;
+    uint32_t   done;
+    // all instances together, since poolStart
+    uint64_t   instructions;
+    uint64_t   cycles;
+    uint64_t   frames;
+    uint64_t   min_frames;      // the instance furthest behind
+    uint64_t   max_frames;
+    uint64_t   steals;
+    double     seconds;
+} PoolProgress;
+
+typedef struct Pool {
+    Arena      *arena;
+    PoolInstance *instances;
+    uint32_t   count;
+    int        threads;
+    uint32_t   slice;
+    PoolQueue  *queues;         // one per worker
+    pthread_t  *workers;
+    uint32_t   live;            // instances not done yet
+    int        running;         // started and not waited for
+    pthread_mutex_t lock;       // guards the fields down to `quit`
+    pthread_cond_t wake;        // to workers: a run started, or its last instance finished
+    pthread_cond_t idle;        // to poolWait: every worker has parked
+    uint64_t   run;             // runs started; a parked worker wakes when it changes
+    int        busy;            // workers not parked yet since the run started
+    int        quit;            // poolFree: workers exit
+    uint64_t   start_ns;
+    uint64_t   end_ns;
+    PoolProgress base;          // totals at poolStart
+    // optional: called on the worker thread when instance i has run its frames or stopped
+    void       (*done_hook)(void *ctx, uint32_t i);
+    void       *hook_ctx;
+} Pool;
+
+/*
+ * @param image 64K memory image with the ROM loaded; it becomes the arena's
+ * template and every instance starts as a clone of it
+ * @param threads Worker threads, 0 for one per online CPU
+ * @param huge Put the arena on huge pages
+ * @return NULL if the arena cannot be mapped
+ */
+Pool *poolCreate(uint32_t count, const uint8_t *image, int threads, int huge);
+void poolFree(Pool *pool);
+
+// instance i's machine, to set up (inputs, a snapshot) before poolStart or read after poolWait
+static inline Machine *poolMachine(Pool *pool, uint32_t i){
+    return pool->instances[i].machine;
+}
+
+// every instance back to the template, e.g. between search iterations; not while running
+void poolReset(Pool *pool);
+
+/*
+ * Start the workers. Every instance runs `frames` more frames (0: no limit), or until it stops.
+ * @param slice Frames an instance runs before it goes back in the queue, 0 for POOL_DEFAULT_SLICE
+ * @return 0, or -1 if the pool is already running
+ */
+int poolStart(Pool *pool, uint64_t frames, uint32_t slice);
+
+/*
+ * Wait up to `ms` milliseconds (0: until done) for every instance to finish
+ * @return 1 when all are done and the workers have parked, 0 otherwise
+ */
+int poolWait(Pool *pool, uint32_t ms);
+
+// totals as of the last slice each instance finished; safe while running
+void poolProgress(const Pool *pool, PoolProgress *progress);
+
+#endif
@@ -0,0 +1,86 @@
+#include "profiler.h"
+#include <stdlib.h>
+#include "disassembler.h"
+
+Profile *profileCreate(void){
+    return (Profile *)calloc(1, sizeof(Profile));
+}
+
+void profileFree(Profile *prof){
+    free(prof);
+}
+
+typedef struct HotEntry {
+    uint32_t   index;
+    uint64_t   count;
+    uint64_t   cycles;
+} HotEntry;
+
+static int hotterFirst(const void *x, const void *y){
+    const HotEntry *i = (const HotEntry *)x, *j = (const HotEntry *)y;
+
+    if (i->cycles != j->cycles)
+        return i->cycles < j->cycles ? 1 : -1;
+    if (i->count != j->count)
+        return i->count < j->count ? 1 : -1;
+    return (i->index > j->index) - (i->index < j->index);
+}
+
+static uint32_t hotList(const uint64_t *count, const uint64_t *cycles, uint32_t n, HotEntry *out){
+    uint32_t used = 0;
+
+    for (uint32_t i = 0; i < n; i++){
+        if (count[i]){
+            out[used].index = i;
+            out[used].count = count[i];
+            out[used].cycles = cycles[i];
+            used++;
+        }
+    }
+    qsort(out, used, sizeof(HotEntry), hotterFirst);
+
+    return used;
+}
+
+void profileReport(const Profile *prof, uint8_t *memory, FILE *out){
+    profileReportAs(prof, memory, out, "instructions", "cycles");
+}
+
+void profileReportAs(const Profile *prof, uint8_t *memory, FILE *out, const char *count_name, const char *weight_name){
+    uint64_t total_count = 0, total_cycles = 0;
+    HotEntry *order = (HotEntry *)malloc(0x10000 * sizeof(HotEntry));
+    uint32_t n;
+
+    for (int op = 0; op < 256; op++){
+        total_count += prof->op_count[op];
+        total_cycles += prof->op_cycles[op];
+    }
+    fprintf(out, "# %llu %s, %llu %s\n\n",
+            (unsigned long long)total_count, count_name, (unsigned long long)total_cycles, weight_name);
+    if (total_cycles == 0)
+        total_cycles = 1;
+
+    fprintf(out, "# opcodes by %s\n", weight_name);
+    fprintf(out, "#    count %12s    share  op  mnemonic\n", weight_name);
+    n = hotList(prof->op_count, prof->op_cycles, 256, order);
+    for (uint32_t i = 0; i < n; i++){
+        uint8_t code[3] = {(uint8_t)order[i].index, 0, 0};
+        fprintf(out, "%10llu %12llu  %6.2f%%  %02x  ",
+                (unsigned long long)order[i].count, (unsigned long long)order[i].cycles,
+                100.0 * order[i].cycles / total_cycles, order[i].index);
+        Disassemble8080Mnemonic(out, code);
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "\n# addresses by %s\n", weight_name);
+    fprintf(out, "#    count %12s    share  addr mnemonic\n", weight_name);
+    n = hotList(prof->pc_count, prof->pc_cycles, 0x10000, order);
+    for (uint32_t i = 0; i < n; i++){
+        fprintf(out, "%10llu %12llu  %6.2f%%  ",
+                (unsigned long long)order[i].count, (unsigned long long)order[i].cycles,
+                100.0 * order[i].cycles / total_cycles);
+        Disassemble8080OpTo(out, memory, order[i].index);
+    }
+
+    free(order);
+}
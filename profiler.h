@@ -0,0 +1,46 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Flat execution profile of the Emulate8080Op loop: how often each address
+ * and each opcode ran, and how many clock states they took.
+ *
+ * Build with -DPROFILE to enable it. Without it, PROFILE_STEP expands to nothing
+ * and the run loop carries no profiling code at all.
+ */
+typedef struct Profile {
+    uint64_t   pc_count[0x10000];
+    uint64_t   pc_cycles[0x10000];
+    uint64_t   op_count[256];
+    uint64_t   op_cycles[256];
+} Profile;
+
+Profile *profileCreate(void);
+void profileFree(Profile *prof);
+
+/*
+ * Write the opcode histogram and the executed addresses as annotated disassembly,
+ * both sorted by clock states spent, hottest first
+ * @param *memory The memory image the profile was taken on (used for disassembly)
+ */
+void profileReport(const Profile *prof, uint8_t *memory, FILE *out);
+
+// same report for counters that are not instructions/cycles, e.g. samples from sampler.c
+void profileReportAs(const Profile *prof, uint8_t *memory, FILE *out, const char *count_name, const char *weight_name);
+
+static inline void profileStep(Profile *prof, uint16_t pc, uint8_t opcode, uint32_t cycles){
+    prof->pc_count[pc]++;
+    prof->pc_cycles[pc] += cycles;
+    prof->op_count[opcode]++;
+    prof->op_cycles[opcode] += cycles;
+}
+
+#ifdef PROFILE
+#define PROFILE_STEP(prof, pc, opcode, cycles)  profileStep((prof), (pc), (opcode), (cycles))
+#else
+#define PROFILE_STEP(prof, pc, opcode, cycles)  ((void)(cycles))
+#endif
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * Replay a movie recorded with `emulator -m` as fast as the host allows,
+ * checking every state hash in it. With -j the movie is split at its embedded
+ * snapshots and the segments are replayed in parallel.
+ *
+ * usage: replay [-j threads] <rom> <movie>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emulator.h"
+#include "machine.h"
+#include "movie.h"
+
+static double since(const struct timespec *start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int replayAll(const char *path, uint8_t *memory){
+    int err;
+    MovieReader *mr = movieOpen(path, &err);
+    if (!mr){
+        printf(err == -2 ? "%s is not a movie of this version\n" : "Cannot read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    State8080 *state = initState(memory);
+    Machine machine;
+    MovieReport report;
+    struct timespec start;
+
+    machineInit(&machine, state);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int result = movieReplay(mr, &machine, &report);
+    double seconds = since(&start);
+
+    printf("%s: %llu frames, %llu instructions, %llu events, %llu hashes matched in %.3f s",
+           result == 0 ? "ok" : "FAILED", (unsigned long long)machine.frames,
+           (unsigned long long)machine.instructions, (unsigned long long)report.events,
+           (unsigned long long)report.hashes, seconds);
+    if (seconds > 0)
+        printf(" (%.0fx real time)", state->cycles / seconds / 2e6);
+    printf("\n");
+
+    if (result != 0){
+        printf("stopped at cycle %llu, frame %llu, PC $%04x: %s\n", (unsigned long long)report.cycle,
+               (unsigned long long)machine.frames, state->pc, report.error);
+        if (report.expected != report.actual)
+            printf("expected hash %016llx, got %016llx\n",
+                   (unsigned long long)report.expected, (unsigned long long)report.actual);
+    }
+
+    movieFree(mr);
+    free(state);
+    return result == 0 ? 0 : 1;
+}
+
+static int verifyAll(const char *path, const uint8_t *memory, int threads){
+    MovieSegment *segments;
+    uint32_t count;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int failed = movieVerify(path, memory, threads, &segments, &count);
+    double seconds = since(&start);
+
+    if (failed == -1 || failed == -2){
+        printf(failed == -2 ? "%s is not a movie of this version\n" : "Cannot read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (failed == -3){
+        printf("%s was recorded with a different ROM\n", path);
+        return 1;
+    }
+
+    uint64_t instructions = 0, cycles = 0;
+    double busy = 0;
+    printf("segment  start frame      cycles  instructions    hashes    time  result\n");
+    for (uint32_t i = 0; i < count; i++){
+        MovieSegment *seg = &segments[i];
+        instructions += seg->instructions;
+        cycles += seg->end_cycle - seg->start_cycle;
+        busy += seg->seconds;
+        printf("%7u  %11llu  %10llu  %12llu  %8llu  %6.3f  %s\n", i, (unsigned long long)seg->start_frame,
+               (unsigned long long)(seg->end_cycle - seg->start_cycle), (unsigned long long)seg->instructions,
+               (unsigned long long)seg->report.hashes, seg->seconds,
+               seg->report.ok ? "ok" : seg->report.error);
+    }
+
+    printf("%s: %u segments, %d failed, %llu instructions in %.3f s",
+           failed ? "FAILED" : "ok", count, failed, (unsigned long long)instructions, seconds);
+    if (seconds > 0)
+        printf(" (%.0fx real time, %.1f threads busy)", cycles / seconds / 2e6, busy / seconds);
+    printf("\n");
+
+    free(segments);
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    int threads = -1;   // -1 = replay in one pass
+    int first = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-j") == 0){
+        threads = atoi(argv[2]);
+        first = 3;
+    }
+    if (argc - first != 2){
+        printf("usage: %s [-j threads] <rom> <movie>\n"
+               "  -j threads  replay the segments between snapshots in parallel (0: one per CPU)\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t *memory = (uint8_t *)calloc(0x10000, 1);
+    if (machineLoadROM(memory, argv[first], 0) < 0){
+        printf("Cannot read %s\n", argv[first]);
+        exit(EXIT_FAILURE);
+    }
+
+    int status = threads < 0 ? replayAll(argv[first + 1], memory) : verifyAll(argv[first + 1], memory, threads);
+    free(memory);
+    return status;
+}
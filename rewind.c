@@ -0,0 +1,236 @@
+#include "rewind.h"
+#include <stdlib.h>
+#include <string.h>
+
+// equal bytes that may sit inside one run before it is split in two
+#define REWIND_GAP  4
+
+static RewindPoint *point(Rewind *rw, uint32_t i){
+    return &rw->points[(rw->first + i) % rw->capacity];
+}
+
+Rewind *rewindCreate(Machine *m, uint32_t interval, uint32_t window){
+    Rewind *rw = (Rewind *)calloc(1, sizeof(Rewind));
+
+    rw->m = m;
+    rw->interval = interval ? interval : REWIND_DEFAULT_INTERVAL;
+    rw->capacity = (window ? window : REWIND_DEFAULT_WINDOW) / rw->interval + 1;
+    rw->points = (RewindPoint *)calloc(rw->capacity, sizeof(RewindPoint));
+    // worst case is a 1-byte run every REWIND_GAP + 1 bytes, each with a 4-byte header
+    rw->scratch = (uint8_t *)malloc(0x20000);
+    rw->next_frame = m->frames;
+    return rw;
+}
+
+void rewindFree(Rewind *rw){
+    if (!rw)
+        return;
+    for (uint32_t i = 0; i < rw->count; i++)
+        free(point(rw, i)->delta);
+    free(rw->points);
+    free(rw->scratch);
+    free(rw);
+}
+
+static void put16(uint8_t *out, uint32_t *size, uint16_t value){
+    out[(*size)++] = value & 0xff;
+    out[(*size)++] = value >> 8;
+}
+
+/*
+ * Encode RAM XOR latest as records of (skip, length, XOR bytes), looking only
+ * at dirty pages, and bring latest up to date as it goes
+ * @return the encoded size in rw->scratch
+ */
+static uint32_t encodeDelta(Rewind *rw){
+    State8080 *state = rw->m->state;
+    const uint8_t *mem = state->memory;
+    uint8_t *prev = rw->latest;
+    uint8_t *out = rw->scratch;
+    uint16_t rom_size = rw->m->rom_size;
+    uint32_t size = 0;
+    uint32_t pos = rom_size;    // where the last record ended
+
+    for (int page = rom_size >> MEMORY_PAGE_SHIFT; page < MEMORY_PAGES; page++){
+        if (!pageDirty(state, page))
+            continue;
+
+        uint32_t addr = page << MEMORY_PAGE_SHIFT;
+        uint32_t end = addr + MEMORY_PAGE_SIZE;
+        if (addr < rom_size)
+            addr = rom_size;
+
+        while (addr < end){
+            if (mem[addr] == prev[addr]){
+                addr++;
+                continue;
+            }
+
+            uint32_t start = addr, last = addr;
+            while (addr < end && addr - last <= REWIND_GAP){
+                if (mem[addr] != prev[addr])
+                    last = addr;
+                addr++;
+            }
+            addr = last + 1;
+
+            uint32_t skip = start - pos;
+            while (skip > 0xffff){
+                put16(out, &size, 0xffff);
+                put16(out, &size, 0);
+                skip -= 0xffff;
+            }
+            put16(out, &size, skip);
+            put16(out, &size, addr - start);
+            for (uint32_t i = start; i < addr; i++){
+                out[size++] = mem[i] ^ prev[i];
+                prev[i] = mem[i];
+            }
+            pos = addr;
+        }
+    }
+    return size;
+}
+
+static void applyDelta(uint8_t *ram, const uint8_t *delta, uint32_t size, uint16_t rom_size){
+    uint32_t pos = rom_size;
+
+    for (uint32_t i = 0; i < size; ){
+        uint16_t skip = delta[i] | (delta[i + 1] << 8);
+        uint16_t len = delta[i + 2] | (delta[i + 3] << 8);
+        i += 4;
+        pos += skip;
+        for (uint16_t j = 0; j < len; j++)
+            ram[pos++] ^= delta[i++];
+    }
+}
+
+void rewindCapture(Rewind *rw){
+    Machine *m = rw->m;
+    State8080 *state = m->state;
+
+    if (rw->count == rw->capacity){
+        RewindPoint *oldest = point(rw, 0);
+        rw->delta_bytes -= oldest->delta_size;
+        free(oldest->delta);
+        oldest->delta = NULL;
+        rw->first = (rw->first + 1) % rw->capacity;
+        rw->count--;
+
+        // the oldest point is never rebuilt from an older one, so its delta can go too
+        oldest = point(rw, 0);
+        rw->delta_bytes -= oldest->delta_size;
+        free(oldest->delta);
+        oldest->delta = NULL;
+        oldest->delta_size = 0;
+    }
+
+    RewindPoint *p = point(rw, rw->count);
+    snapshotSaveRegisters(&p->state, m);
+    p->delta = NULL;
+    p->delta_size = 0;
+
+    if (rw->count == 0){
+        memcpy(&rw->latest[m->rom_size], &state->memory[m->rom_size], 0x10000 - m->rom_size);
+    } else{
+        uint32_t size = encodeDelta(rw);
+        if (size){
+            p->delta = (uint8_t *)malloc(size);
+            memcpy(p->delta, rw->scratch, size);
+            p->delta_size = size;
+            rw->delta_bytes += size;
+        }
+    }
+
+    rw->count++;
+    snapshotCheckROM(m);
+    memset(state->dirty, 0, sizeof(state->dirty));
+    rw->next_frame = m->frames + rw->interval;
+}
+
+// go back to point i, dropping every point after it
+static void restorePoint(Rewind *rw, uint32_t i){
+    Machine *m = rw->m;
+    State8080 *state = m->state;
+
+    for (uint32_t j = rw->count - 1; j > i; j--){
+        RewindPoint *p = point(rw, j);
+        applyDelta(rw->latest, p->delta, p->delta_size, m->rom_size);
+        rw->delta_bytes -= p->delta_size;
+        free(p->delta);
+        p->delta = NULL;
+        p->delta_size = 0;
+    }
+    rw->count = i + 1;
+
+    snapshotCheckROM(m);
+    memcpy(&state->memory[m->rom_size], &rw->latest[m->rom_size], 0x10000 - m->rom_size);
+    snapshotLoadRegisters(&point(rw, i)->state, m);
+    memset(state->dirty, 0, sizeof(state->dirty));
+    invalidateMemoryHash(state);
+    rw->next_frame = m->frames + rw->interval;
+}
+
+// run forward to instruction `target`
+static int runTo(Rewind *rw, uint64_t target){
+    Machine *m = rw->m;
+
+    if (m->instructions < target)
+        machineRun(m, target - m->instructions, 0, 0);
+    if (m->state->stop == STOP_LIMIT)
+        m->state->stop = STOP_NONE;
+    return m->instructions == target ? 0 : -1;
+}
+
+int rewindStepBack(Rewind *rw, uint64_t count){
+    Machine *m = rw->m;
+    uint64_t target = count > m->instructions ? 0 : m->instructions - count;
+
+    if (rw->count == 0)
+        return -1;
+
+    for (uint32_t i = rw->count; i-- > 0; ){
+        if (point(rw, i)->state.instructions <= target){
+            restorePoint(rw, i);
+            return runTo(rw, target);
+        }
+    }
+
+    restorePoint(rw, 0);
+    return -1;
+}
+
+int rewindToPC(Rewind *rw, uint16_t address){
+    Machine *m = rw->m;
+    State8080 *state = m->state;
+    uint64_t end = m->instructions;
+
+    if (rw->count == 0)
+        return -1;
+
+    // search the stretch after each point, newest first
+    for (uint32_t i = rw->count; i-- > 0; ){
+        uint64_t found = UINT64_MAX;
+
+        restorePoint(rw, i);
+        while (m->instructions < end){
+            if (state->pc == address)
+                found = m->instructions;
+            if (machineRun(m, 1, 0, 0) != STOP_LIMIT)
+                break;
+        }
+
+        if (found != UINT64_MAX){
+            restorePoint(rw, i);
+            return runTo(rw, found);
+        }
+        end = point(rw, i)->state.instructions;
+    }
+
+    restorePoint(rw, 0);
+    return -1;
+}
+
+uint64_t rewindBytes(const Rewind *rw){
+    return sizeof(Rewind) + 0x20000 + rw->capacity * sizeof(RewindPoint) + rw->delta_bytes;
+}
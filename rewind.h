@@ -0,0 +1,79 @@
+#ifndef REWIND_H
+#define REWIND_H
+#include <stdint.h>
+#include "emulator.h"
+#include "machine.h"
+#include "snapshot.h"
+
+/*
+ * Rewind buffer: a ring of points taken every `interval` frames. Each point
+ * keeps its registers and its RAM as the XOR against the previous point,
+ * run-length encoded, so a frame that touches a few hundred bytes costs a few
+ * hundred bytes. Only the newest point's RAM is kept in full; an older one is
+ * rebuilt by XORing the deltas back in, newest first.
+ *
+ * Going back restores the nearest point at or before the target and runs
+ * forward with machineRun, which replays exactly as long as nothing outside
+ * the machine (e.g. the input latches) changed in between.
+ *
+ * The buffer owns the CPU's dirty page bits: each point is encoded from the
+ * pages stored to since the previous one, so do not mix it with snapshotReset.
+ */
+
+#define REWIND_DEFAULT_INTERVAL 60      // frames, one point a second
+#define REWIND_DEFAULT_WINDOW   36000   // frames, ten minutes
+
+typedef struct RewindPoint {
+    SnapshotState  state;
+    uint8_t        *delta;      // RAM XOR the previous point's, run-length encoded
+    uint32_t       delta_size;
+} RewindPoint;
+
+typedef struct Rewind {
+    Machine        *m;
+    uint32_t       interval;
+    uint32_t       capacity;
+    uint32_t       first;       // oldest point in the ring
+    uint32_t       count;
+    uint64_t       next_frame;  // take a point once m->frames reaches this
+    uint64_t       delta_bytes; // encoded bytes held by all points
+    RewindPoint    *points;
+    uint8_t        latest[0x10000];     // RAM at the newest point
+    uint8_t        *scratch;            // encoding buffer
+} Rewind;
+
+/*
+ * @param interval Frames between points
+ * @param window Frames to keep; older points are dropped
+ */
+Rewind *rewindCreate(Machine *m, uint32_t interval, uint32_t window);
+void rewindFree(Rewind *rw);
+
+// take a point now
+void rewindCapture(Rewind *rw);
+
+// call once per frame (or more often); takes a point when one is due
+static inline void rewindPoll(Rewind *rw){
+    if (rw->m->frames >= rw->next_frame)
+        rewindCapture(rw);
+}
+
+/*
+ * Go back `count` instructions. Points after the new position are dropped.
+ * @return 0, or -1 if that is further back than the oldest point (the machine
+ * is then left at the oldest point)
+ */
+int rewindStepBack(Rewind *rw, uint64_t count);
+
+/*
+ * Reverse continue: go back to the last time PC was `address`, before the
+ * current instruction
+ * @return 0, or -1 if PC was never there within the window (the machine is
+ * then left at the oldest point)
+ */
+int rewindToPC(Rewind *rw, uint16_t address);
+
+// memory held by the points, including the full copy of the newest RAM
+uint64_t rewindBytes(const Rewind *rw);
+
+#endif
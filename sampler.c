@@ -0,0 +1,144 @@
+#include "sampler.h"
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/*
+ * Everything the signal handler touches lives here: a handler has no way to be
+ * passed a context, and a ring per process matches one timer per process.
+ */
+static State8080 *volatile target;
+static uint8_t *memory;            // kept after samplerStop so the ring can still be drained
+static long period;
+static Sample ring[SAMPLER_RING_SIZE];
+static atomic_uint ring_head;      // written by the handler only
+static atomic_uint ring_tail;      // written by samplerDrain only
+static atomic_uint ring_dropped;
+static timer_t timer;
+static int running;
+static struct sigaction previous;
+
+static void onSample(int sig, siginfo_t *info, void *context){
+    (void)sig; (void)info; (void)context;
+    State8080 *state = target;
+    if (!state)
+        return;
+
+    unsigned head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+    if (head - tail == SAMPLER_RING_SIZE){
+        atomic_fetch_add_explicit(&ring_dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    // pc and sp may be mid-update by the interrupted instruction; that is fine for a sample
+    ring[head & (SAMPLER_RING_SIZE - 1)].pc = state->pc;
+    ring[head & (SAMPLER_RING_SIZE - 1)].sp = state->sp;
+    atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+}
+
+int samplerStart(State8080 *state, long period_us){
+    struct sigaction sa;
+    struct sigevent sev;
+    struct itimerspec its;
+
+    if (running || period_us <= 0)
+        return -1;
+
+    target = state;
+    memory = state->memory;
+    period = period_us;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = onSample;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, &previous) != 0)
+        return -1;
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIGPROF;
+    if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &sev, &timer) != 0){
+        sigaction(SIGPROF, &previous, NULL);
+        return -1;
+    }
+
+    its.it_value.tv_sec = period_us / 1000000;
+    its.it_value.tv_nsec = (period_us % 1000000) * 1000;
+    its.it_interval = its.it_value;
+    if (timer_settime(timer, 0, &its, NULL) != 0){
+        timer_delete(timer);
+        sigaction(SIGPROF, &previous, NULL);
+        return -1;
+    }
+
+    running = 1;
+    return 0;
+}
+
+void samplerStop(void){
+    if (!running)
+        return;
+
+    timer_delete(timer);
+    sigaction(SIGPROF, &previous, NULL);
+    target = NULL;
+    running = 0;
+}
+
+void samplerDrain(SampleStats *stats){
+    unsigned tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring_head, memory_order_acquire);
+    for (; tail != head; tail++){
+        Sample s = ring[tail & (SAMPLER_RING_SIZE - 1)];
+        uint8_t opcode = memory[s.pc];
+
+        stats->profile->pc_count[s.pc]++;
+        stats->profile->pc_cycles[s.pc] += period;
+        stats->profile->op_count[opcode]++;
+        stats->profile->op_cycles[opcode] += period;
+        stats->sp_count[s.sp]++;
+        stats->samples++;
+    }
+
+    atomic_store_explicit(&ring_tail, tail, memory_order_release);
+    stats->dropped += atomic_exchange_explicit(&ring_dropped, 0, memory_order_relaxed);
+}
+
+SampleStats *sampleStatsCreate(void){
+    SampleStats *stats = (SampleStats *)calloc(1, sizeof(SampleStats));
+    stats->profile = profileCreate();
+
+    return stats;
+}
+
+void sampleStatsFree(SampleStats *stats){
+    if (!stats)
+        return;
+    profileFree(stats->profile);
+    free(stats);
+}
+
+void sampleStatsReport(SampleStats *stats, uint8_t *image, FILE *out){
+    fprintf(out, "# %llu samples every %ld us, %llu dropped\n",
+            (unsigned long long)stats->samples, period, (unsigned long long)stats->dropped);
+    profileReportAs(stats->profile, image, out, "samples", "host_us");
+
+    uint64_t depth[SAMPLER_MAX_DEPTH + 1] = {0};   // last bucket collects everything deeper
+    int top = 0xffff;
+    while (top > 0 && !stats->sp_count[top])
+        top--;
+    for (int sp = 0; sp <= top; sp++){
+        int words = (top - sp) / 2;
+        depth[words < SAMPLER_MAX_DEPTH ? words : SAMPLER_MAX_DEPTH] += stats->sp_count[sp];
+    }
+
+    fprintf(out, "\n# stack depth (words below the highest SP sampled, $%04x)\n", top);
+    for (int d = 0; d <= SAMPLER_MAX_DEPTH; d++)
+        if (depth[d])
+            fprintf(out, "%s%3d %10llu\n", d == SAMPLER_MAX_DEPTH ? ">=" : "  ", d,
+                    (unsigned long long)depth[d]);
+}
@@ -0,0 +1,57 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+#include <stdio.h>
+#include <stdint.h>
+#include "emulator.h"
+#include "profiler.h"
+
+/*
+ * Statistical sampling profiler.
+ *
+ * A POSIX interval timer raises SIGPROF every `period_us` of process CPU time;
+ * the handler copies the guest PC and SP of the watched state into a lock-free
+ * single-producer/single-consumer ring. Nothing runs per instruction, so it can
+ * stay on in production. Only one state per process can be sampled at a time.
+ *
+ * Like any sampling profiler the PC has skid: the handler may catch Emulate8080Op
+ * after it advanced PC past the opcode, so samples can land on operand bytes.
+ */
+
+#define SAMPLER_RING_SIZE   65536   // must be a power of two
+#define SAMPLER_MAX_DEPTH   64      // depth histogram buckets (stack words)
+
+typedef struct Sample {
+    uint16_t   pc;
+    uint16_t   sp;
+} Sample;
+
+typedef struct SampleStats {
+    Profile    *profile;    // count = samples, weight = estimated host microseconds
+    uint64_t   sp_count[0x10000];  // depth is measured from the highest SP sampled
+    uint64_t   samples;
+    uint64_t   dropped;     // ring was full when the timer fired
+} SampleStats;
+
+/*
+ * Start sampling `state`
+ * @param period_us Sampling period in microseconds of CPU time
+ * @return 0 on success, -1 if the timer or the signal handler cannot be installed
+ */
+int samplerStart(State8080 *state, long period_us);
+void samplerStop(void);
+
+// move the samples collected so far out of the ring; safe to call while the timer runs
+void samplerDrain(SampleStats *stats);
+
+SampleStats *sampleStatsCreate(void);
+void sampleStatsFree(SampleStats *stats);
+void sampleStatsReport(SampleStats *stats, uint8_t *memory, FILE *out);
+
+// for the run loop: drain every frame, so a long run never fills the ring
+#ifdef SAMPLE
+#define SAMPLER_DRAIN(stats)    samplerDrain(stats)
+#else
+#define SAMPLER_DRAIN(stats)    ((void)0)
+#endif
+
+#endif
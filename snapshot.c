@@ -0,0 +1,237 @@
+#include "snapshot.h"
+#include <stdio.h>
+#include <string.h>
+#include "trace.h"
+
+uint64_t snapshotRomHash(Machine *m){
+    if (!m->rom_hash)
+        m->rom_hash = fnv1a(FNV_OFFSET, m->state->memory, m->rom_size);
+    return m->rom_hash;
+}
+
+void snapshotCheckROM(Machine *m){
+    for (int page = 0; page << MEMORY_PAGE_SHIFT < m->rom_size; page++){
+        if (pageDirty(m->state, page)){
+            m->rom_hash = 0;
+            return;
+        }
+    }
+}
+
+void snapshotSaveRegisters(SnapshotState *s, const Machine *m){
+    const State8080 *state = m->state;
+
+    memset(s, 0, sizeof(*s));
+    s->a = state->a;
+    s->b = state->b;
+    s->c = state->c;
+    s->d = state->d;
+    s->e = state->e;
+    s->h = state->h;
+    s->l = state->l;
+    s->flags = packFlags(state);
+    s->sp = state->sp;
+    s->pc = state->pc;
+    s->int_enable = state->int_enable;
+    s->stop = state->stop;
+    s->cycles = state->cycles;
+
+    s->next_vector = m->next_vector;
+    s->pending = m->pending;
+    s->next_interrupt = m->next_interrupt;
+    s->requested = m->requested;
+    s->instructions = m->instructions;
+    s->frames = m->frames;
+    s->interrupts = m->interrupts;
+    s->shift = m->shift;
+    s->shift_offset = m->shift_offset;
+    memcpy(s->inputs, m->inputs, sizeof(s->inputs));
+    memcpy(s->outputs, m->outputs, sizeof(s->outputs));
+}
+
+void snapshotLoadRegisters(const SnapshotState *s, Machine *m){
+    State8080 *state = m->state;
+
+    state->a = s->a;
+    state->b = s->b;
+    state->c = s->c;
+    state->d = s->d;
+    state->e = s->e;
+    state->h = s->h;
+    state->l = s->l;
+    unpackFlags(state, s->flags);
+    state->sp = s->sp;
+    state->pc = s->pc;
+    state->int_enable = s->int_enable;
+    state->stop = s->stop;
+    state->cycles = s->cycles;
+
+    m->next_vector = s->next_vector;
+    m->pending = s->pending;
+    m->next_interrupt = s->next_interrupt;
+    m->requested = s->requested;
+    m->instructions = s->instructions;
+    m->frames = s->frames;
+    m->interrupts = s->interrupts;
+    m->shift = s->shift;
+    m->shift_offset = s->shift_offset;
+    memcpy(m->inputs, s->inputs, sizeof(m->inputs));
+    memcpy(m->outputs, s->outputs, sizeof(m->outputs));
+}
+
+// copy the RAM pages whose dirty bit is set
+static void copyDirtyPages(uint8_t *dst, const uint8_t *src, const uint64_t *dirty, uint16_t rom_size){
+    for (int word = 0; word < MEMORY_PAGES / 64; word++){
+        uint64_t bits = dirty[word];
+        while (bits){
+            int page = word * 64 + __builtin_ctzll(bits);
+            int start = page << MEMORY_PAGE_SHIFT;
+            int end = start + MEMORY_PAGE_SIZE;
+            bits &= bits - 1;
+
+            if (start < rom_size)
+                start = rom_size;
+            if (start < end)
+                memcpy(&dst[start], &src[start], end - start);
+        }
+    }
+}
+
+#ifdef STATEHASH
+// update the memory hash for copying the dirty pages back from `src`
+static void hashDirtyPages(State8080 *state, const uint8_t *src, uint16_t rom_size){
+    for (int word = 0; word < MEMORY_PAGES / 64; word++){
+        uint64_t bits = state->dirty[word];
+        while (bits){
+            uint32_t address = (word * 64 + __builtin_ctzll(bits)) << MEMORY_PAGE_SHIFT;
+            uint32_t end = address + MEMORY_PAGE_SIZE;
+            bits &= bits - 1;
+
+            for (address = address < rom_size ? rom_size : address; address < end; address++)
+                if (state->memory[address] != src[address])
+                    state->memory_hash ^= memoryHashKey(address, state->memory[address]) ^
+                                          memoryHashKey(address, src[address]);
+        }
+    }
+}
+#endif
+
+static int sameROM(const Snapshot *snap, Machine *m){
+    return snap->header.rom_size == m->rom_size && snap->header.rom_hash == snapshotRomHash(m);
+}
+
+void snapshotTake(Snapshot *snap, Machine *m){
+    State8080 *state = m->state;
+
+    snapshotCheckROM(m);
+    memset(&snap->header, 0, sizeof(snap->header));
+    memcpy(snap->header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    snap->header.version = SNAPSHOT_VERSION;
+    snap->header.rom_size = m->rom_size;
+    snap->header.rom_hash = snapshotRomHash(m);
+
+    snapshotSaveRegisters(&snap->state, m);
+    memcpy(&snap->memory[m->rom_size], &state->memory[m->rom_size], 0x10000 - m->rom_size);
+    memset(state->dirty, 0, sizeof(state->dirty));
+}
+
+int snapshotRestore(const Snapshot *snap, Machine *m){
+    State8080 *state = m->state;
+
+    snapshotCheckROM(m);
+    if (!sameROM(snap, m))
+        return -1;
+
+    snapshotLoadRegisters(&snap->state, m);
+    memcpy(&state->memory[m->rom_size], &snap->memory[m->rom_size], 0x10000 - m->rom_size);
+    memset(state->dirty, 0, sizeof(state->dirty));
+    invalidateMemoryHash(state);
+    return 0;
+}
+
+void snapshotUpdate(Snapshot *snap, Machine *m){
+    State8080 *state = m->state;
+
+    // the checkpoint moves to a guest that stored into ROM along with the rest
+    snapshotCheckROM(m);
+    snap->header.rom_hash = snapshotRomHash(m);
+    snapshotSaveRegisters(&snap->state, m);
+    copyDirtyPages(snap->memory, state->memory, state->dirty, m->rom_size);
+    memset(state->dirty, 0, sizeof(state->dirty));
+}
+
+int snapshotReset(const Snapshot *snap, Machine *m){
+    State8080 *state = m->state;
+
+    snapshotCheckROM(m);
+    if (!sameROM(snap, m))
+        return -1;
+
+    snapshotLoadRegisters(&snap->state, m);
+#ifdef STATEHASH
+    // only the pages being copied back can change the memory hash
+    if (state->memory_hash_valid)
+        hashDirtyPages(state, snap->memory, m->rom_size);
+#endif
+    copyDirtyPages(state->memory, snap->memory, state->dirty, m->rom_size);
+    memset(state->dirty, 0, sizeof(state->dirty));
+    return 0;
+}
+
+uint32_t snapshotDiff(const Snapshot *snap, const Machine *m, int *first){
+    const State8080 *state = m->state;
+    uint32_t count = 0;
+
+    *first = -1;
+    for (int page = m->rom_size >> MEMORY_PAGE_SHIFT; page < MEMORY_PAGES; page++){
+        if (!pageDirty(state, page))
+            continue;
+        for (int addr = page << MEMORY_PAGE_SHIFT; addr < (page + 1) << MEMORY_PAGE_SHIFT; addr++){
+            if (addr < m->rom_size)
+                continue;
+            if (state->memory[addr] != snap->memory[addr]){
+                if (*first < 0)
+                    *first = addr;
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+int snapshotSave(const Snapshot *snap, const char *path){
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return -1;
+
+    size_t ram = 0x10000 - snap->header.rom_size;
+    int ok = fwrite(&snap->header, sizeof(snap->header), 1, f) == 1 &&
+             fwrite(&snap->state, sizeof(snap->state), 1, f) == 1 &&
+             fwrite(&snap->memory[snap->header.rom_size], 1, ram, f) == ram;
+
+    if (fclose(f) != 0)
+        ok = 0;
+    return ok ? 0 : -1;
+}
+
+int snapshotLoad(Snapshot *snap, const char *path){
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return -1;
+
+    int result = 0;
+    if (fread(&snap->header, sizeof(snap->header), 1, f) != 1)
+        result = -1;
+    else if (memcmp(snap->header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+             snap->header.version != SNAPSHOT_VERSION)
+        result = -2;
+    else{
+        size_t ram = 0x10000 - snap->header.rom_size;
+        if (fread(&snap->state, sizeof(snap->state), 1, f) != 1 ||
+            fread(&snap->memory[snap->header.rom_size], 1, ram, f) != ram)
+            result = -1;
+    }
+
+    fclose(f);
+    return result;
+}
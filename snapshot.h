@@ -0,0 +1,119 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <stdint.h>
+#include "emulator.h"
+#include "machine.h"
+
+/*
+ * Save state: CPU registers, flags, interrupt and cycle state, the board's
+ * devices and RAM. The ROM is not stored, only its hash, so a snapshot can only
+ * be restored on top of the same ROM.
+ *
+ * File layout (host endian):
+ *   SnapshotHeader
+ *   SnapshotState
+ *   RAM, from header.rom_size to 0xffff
+ *
+ * Taking and restoring a snapshot in memory is a copy of the RAM plus a few
+ * dozen bytes of registers. Both clear the CPU's dirty page bits, which makes
+ * the snapshot the machine's checkpoint: until another snapshot is taken or
+ * restored, snapshotUpdate, snapshotReset and snapshotDiff only need to look at
+ * the pages stored to since.
+ */
+
+#define SNAPSHOT_MAGIC      "8080SNP"
+#define SNAPSHOT_VERSION    1
+
+typedef struct SnapshotHeader {
+    char       magic[8];
+    uint32_t   version;
+    uint16_t   rom_size;    // memory below this is ROM and not stored
+    uint16_t   pad;
+    uint64_t   rom_hash;    // fnv1a() of the ROM
+} SnapshotHeader;
+
+// everything except memory, in a fixed layout
+typedef struct SnapshotState {
+    uint8_t    a;
+    uint8_t    b;
+    uint8_t    c;
+    uint8_t    d;
+    uint8_t    e;
+    uint8_t    h;
+    uint8_t    l;
+    uint8_t    flags;       // same layout as the PSW byte pushed by PUSH PSW
+    uint16_t   sp;
+    uint16_t   pc;
+    uint8_t    int_enable;
+    uint8_t    stop;
+    uint8_t    next_vector;
+    uint8_t    pending;
+    uint64_t   cycles;
+    uint64_t   next_interrupt;
+    uint64_t   requested;
+    uint64_t   instructions;
+    uint64_t   frames;
+    uint64_t   interrupts;
+    uint16_t   shift;
+    uint8_t    shift_offset;
+    uint8_t    inputs[3];
+    uint8_t    outputs[8];
+    uint8_t    pad[2];
+} SnapshotState;
+
+typedef struct Snapshot {
+    SnapshotHeader  header;
+    SnapshotState   state;
+    uint8_t         memory[0x10000];    // only header.rom_size and up is used
+} Snapshot;
+
+// hash of the machine's ROM, computed once and kept in m->rom_hash
+uint64_t snapshotRomHash(Machine *m);
+
+/*
+ * The board does not stop the guest storing into ROM, and snapshots leave
+ * ROM out. Call before clearing the dirty bits: if a page below rom_size is
+ * dirty, the cached ROM hash is dropped, so it is computed again and a
+ * snapshot of the old ROM is refused.
+ */
+void snapshotCheckROM(Machine *m);
+
+// registers, counters and devices only, for callers that keep memory their own way
+void snapshotSaveRegisters(SnapshotState *s, const Machine *m);
+void snapshotLoadRegisters(const SnapshotState *s, Machine *m);
+
+void snapshotTake(Snapshot *snap, Machine *m);
+
+/*
+ * Put the machine back into the state the snapshot was taken in
+ * @return 0, or -1 if the machine is running a different ROM
+ */
+int snapshotRestore(const Snapshot *snap, Machine *m);
+
+/*
+ * Incremental snapshotTake: copy only the pages stored to since the checkpoint
+ * @param snap The machine's checkpoint, which then moves to the current state
+ */
+void snapshotUpdate(Snapshot *snap, Machine *m);
+
+/*
+ * Incremental snapshotRestore: go back to the checkpoint, copying only the pages stored to since
+ * @param snap The machine's checkpoint
+ * @return 0, or -1 if the machine is running a different ROM
+ */
+int snapshotReset(const Snapshot *snap, Machine *m);
+
+/*
+ * Compare RAM with the checkpoint, looking only at the pages stored to since
+ * @param first Gets the lowest differing address, -1 if none
+ * @return the number of bytes that differ
+ */
+uint32_t snapshotDiff(const Snapshot *snap, const Machine *m, int *first);
+
+// @return 0, or -1 if the file cannot be written
+int snapshotSave(const Snapshot *snap, const char *path);
+
+// @return 0, -1 if the file cannot be read, -2 if it is not a snapshot of this version
+int snapshotLoad(Snapshot *snap, const char *path);
+
+#endif
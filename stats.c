@@ -0,0 +1,93 @@
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "emulator.h"
+
+StatsBlock *statsCreate(const char *name){
+    char created_name[sizeof(((StatsBlock *)0)->name)];
+
+    if (!name){
+        snprintf(created_name, sizeof(created_name), STATS_SHM_PREFIX "%d", (int)getpid());
+    }
+    else{
+        snprintf(created_name, sizeof(created_name), "%s", name);
+    }
+
+    int fd = shm_open(created_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, sizeof(StatsBlock)) != 0){
+        close(fd);
+        shm_unlink(created_name);
+        return NULL;
+    }
+
+    StatsBlock *block = (StatsBlock *)mmap(NULL, sizeof(StatsBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (block == MAP_FAILED){
+        shm_unlink(created_name);
+        return NULL;
+    }
+
+    memset(block, 0, sizeof(StatsBlock));
+    memcpy(block->name, created_name, sizeof(created_name));
+    block->pid = getpid();
+    block->version = STATS_VERSION;
+    atomic_thread_fence(memory_order_release);
+    block->magic = STATS_MAGIC;
+
+    return block;
+}
+
+void statsDestroy(StatsBlock *block){
+    if (!block)
+        return;
+    shm_unlink(block->name);
+    munmap(block, sizeof(StatsBlock));
+}
+
+const StatsBlock *statsAttach(const char *name){
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+
+    void *p = mmap(NULL, sizeof(StatsBlock), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return p == MAP_FAILED ? NULL : (const StatsBlock *)p;
+}
+
+void statsDetach(const StatsBlock *block){
+    if (block)
+        munmap((void *)block, sizeof(StatsBlock));
+}
+
+void statsPublish(StatsBlock *block, const StatsSnapshot *snap){
+    unsigned seq = atomic_load_explicit(&block->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&block->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&block->data, snap, sizeof(StatsSnapshot));
+    atomic_store_explicit(&block->seq, seq + 2, memory_order_release);
+}
+
+int statsRead(const StatsBlock *block, StatsSnapshot *snap){
+    unsigned before, after;
+
+    if (block->magic != STATS_MAGIC || block->version != STATS_VERSION)
+        return -1;
+
+    do {
+        before = atomic_load_explicit((atomic_uint *)&block->seq, memory_order_acquire);
+        if (before & 1)
+            continue;
+        memcpy(snap, (const void *)&block->data, sizeof(StatsSnapshot));
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit((atomic_uint *)&block->seq, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+
+    return 0;
+}
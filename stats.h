@@ -0,0 +1,56 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Live statistics published through a POSIX shared-memory segment.
+ *
+ * The run loop is the only writer and updates the block once per frame using a
+ * sequence lock: `seq` is odd while an update is in progress, so readers retry
+ * instead of the emulation thread ever taking a lock. The segment is named
+ * STATS_SHM_PREFIX<pid> unless the caller picks a name.
+ */
+
+#define STATS_SHM_PREFIX    "/emu8080."
+#define STATS_MAGIC         0x38303830  // "8080"
+#define STATS_VERSION       1
+
+typedef struct StatsSnapshot {
+    uint64_t   instructions;
+    uint64_t   cycles;
+    uint64_t   frames;
+    uint64_t   interrupts;
+    uint64_t   frame_ns;        // host time of the last frame
+    uint64_t   total_ns;        // host time since the run started
+    uint32_t   stop_reason;     // StopReason, STOP_NONE while running
+    uint32_t   pad;
+} StatsSnapshot;
+
+typedef struct StatsBlock {
+    uint32_t   magic;
+    uint32_t   version;
+    atomic_uint  seq;
+    uint32_t   pid;         // of the emulator process
+    char       name[64];    // segment name, so the creator can unlink it
+    StatsSnapshot  data;
+} StatsBlock;
+
+/*
+ * Create (or replace) the segment and map it
+ * @param name Segment name starting with '/', or NULL for STATS_SHM_PREFIX<pid>
+ * @return the mapped block, NULL on failure
+ */
+StatsBlock *statsCreate(const char *name);
+void statsDestroy(StatsBlock *block);
+
+// map an existing segment read-only
+const StatsBlock *statsAttach(const char *name);
+void statsDetach(const StatsBlock *block);
+
+void statsPublish(StatsBlock *block, const StatsSnapshot *snap);
+
+// @return 0 on success, -1 if the segment is not a stats block
+int statsRead(const StatsBlock *block, StatsSnapshot *snap);
+
+#endif
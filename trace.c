@@ -0,0 +1,448 @@
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define FNV_PRIME   0x100000001b3ULL
+
+uint64_t fnv1a(uint64_t hash, const uint8_t *data, size_t len){
+    for (size_t i = 0; i < len; i++){
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+uint8_t packFlags(const State8080 *state){
+    // same bit positions as PUSH PSW
+    return 0x02 |
+        state->cc.cy |
+        state->cc.p << 2 |
+        state->cc.ac << 4 |
+        state->cc.z << 6 |
+        state->cc.s << 7;
+}
+
+void unpackFlags(State8080 *state, uint8_t psw){
+    state->cc.cy = psw & 0x01;
+    state->cc.p = (psw >> 2) & 1;
+    state->cc.ac = (psw >> 4) & 1;
+    state->cc.z = (psw >> 6) & 1;
+    state->cc.s = (psw >> 7) & 1;
+}
+
+uint64_t hashState(const State8080 *state){
+    uint8_t regs[12] = {
+        state->a, state->b, state->c, state->d, state->e, state->h, state->l,
+        packFlags(state), state->int_enable,
+        state->sp & 0xff, state->sp >> 8,
+        0
+    };
+    uint8_t pc[2] = {state->pc & 0xff, state->pc >> 8};
+    uint64_t hash = fnv1a(FNV_OFFSET, regs, sizeof(regs));
+    hash = fnv1a(hash, pc, sizeof(pc));
+
+    return fnv1a(hash, state->memory, 0x10000);
+}
+
+// the condition of a conditional CALL: flags are as they were, since CALL leaves them alone
+static int conditionHolds(const State8080 *state, uint8_t opcode){
+    switch ((opcode >> 3) & 7){
+        case 0: return !state->cc.z;
+        case 1: return state->cc.z;
+        case 2: return !state->cc.cy;
+        case 3: return state->cc.cy;
+        case 4: return !state->cc.p;
+        case 5: return state->cc.p;
+        case 6: return !state->cc.s;
+        default: return state->cc.s;
+    }
+}
+
+/*
+ * What the instruction at `pc` stored, worked out from the state after it
+ * @return the bytes stored (0-2), the lowest address in *address
+ */
+static int storedBytes(const State8080 *state, uint16_t pc, uint8_t opcode, uint16_t *address){
+    const uint8_t *operand = &state->memory[(uint16_t)(pc + 1)];
+
+    switch (opcode){
+        case 0x02: *address = state->b << 8 | state->c; return 1;          // STAX B
+        case 0x12: *address = state->d << 8 | state->e; return 1;          // STAX D
+        case 0x22: *address = operand[1] << 8 | operand[0]; return 2;      // SHLD
+        case 0x32: *address = operand[1] << 8 | operand[0]; return 1;      // STA
+        case 0x34: case 0x35: case 0x36:                                    // INR/DCR/MVI M
+        case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75: case 0x77:    // MOV M, r
+            *address = state->h << 8 | state->l;
+            return 1;
+        case 0xc5: case 0xd5: case 0xe5: case 0xf5:                         // PUSH
+        case 0xcd:                                                          // CALL
+        case 0xe3:                                                          // XTHL
+            *address = state->sp;
+            return 2;
+    }
+    if ((opcode & 0xc7) == 0xc7 || ((opcode & 0xc7) == 0xc4 && conditionHolds(state, opcode))){    // RST, CALL taken
+        *address = state->sp;
+        return 2;
+    }
+    return 0;
+}
+
+void makeTraceRecord(TraceRecord *rec, const State8080 *state, uint16_t pc, uint8_t opcode){
+    memset(rec, 0, sizeof(*rec));
+    rec->pc = pc;
+    rec->sp = state->sp;
+    rec->opcode = opcode;
+    rec->a = state->a;
+    rec->b = state->b;
+    rec->c = state->c;
+    rec->d = state->d;
+    rec->e = state->e;
+    rec->h = state->h;
+    rec->l = state->l;
+    rec->flags = packFlags(state);
+    rec->store_count = storedBytes(state, pc, opcode, &rec->store_address);
+    for (int i = 0; i < rec->store_count; i++)
+        rec->store[i] = state->memory[(uint16_t)(rec->store_address + i)];
+    if (!rec->store_count)
+        rec->store_address = 0;
+}
+
+static void writeCheckpoint(TraceWriter *tw, const State8080 *state){
+    TraceCheckpoint ck = {tw->count, hashState(state)};
+    fwrite(&ck, sizeof(ck), 1, tw->f);
+}
+
+TraceWriter *traceOpen(const char *path, uint32_t interval, const State8080 *state){
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return NULL;
+
+    TraceWriter *tw = (TraceWriter *)calloc(1, sizeof(TraceWriter));
+    tw->f = f;
+    tw->interval = interval ? interval : TRACE_DEFAULT_INTERVAL;
+
+    // traces are written one record at a time, so let stdio batch them
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    TraceHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    hdr.version = TRACE_VERSION;
+    hdr.interval = tw->interval;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    writeCheckpoint(tw, state);
+
+    return tw;
+}
+
+/*
+ * Append one instruction to the trace
+ * @param state The state after the instruction executed
+ * @param pc The address the instruction was fetched from
+ * @param opcode The opcode that was executed
+ */
+void traceRecord(TraceWriter *tw, const State8080 *state, uint16_t pc, uint8_t opcode){
+    TraceRecord rec;
+    makeTraceRecord(&rec, state, pc, opcode);
+    fwrite(&rec, sizeof(rec), 1, tw->f);
+    tw->count++;
+
+    if (tw->count % tw->interval == 0)
+        writeCheckpoint(tw, state);
+}
+
+void traceClose(TraceWriter *tw){
+    if (!tw)
+        return;
+    fclose(tw->f);
+    free(tw);
+}
+
+/* ---------------- reading ---------------- */
+
+typedef struct TraceFile {
+    FILE       *f;
+    uint32_t   interval;
+    uint64_t   checkpoints;
+    uint64_t   records;
+} TraceFile;
+
+static off_t blockSize(uint32_t interval){
+    return sizeof(TraceCheckpoint) + (off_t)interval * sizeof(TraceRecord);
+}
+
+static off_t checkpointOffset(const TraceFile *tf, uint64_t k){
+    return sizeof(TraceHeader) + (off_t)k * blockSize(tf->interval);
+}
+
+static off_t recordOffset(const TraceFile *tf, uint64_t i){
+    return checkpointOffset(tf, i / tf->interval) + sizeof(TraceCheckpoint)
+        + (off_t)(i % tf->interval) * sizeof(TraceRecord);
+}
+
+static int openTraceFile(TraceFile *tf, FILE *f){
+    TraceHeader hdr;
+
+    tf->f = f;
+    if (fseeko(f, 0, SEEK_SET) != 0 || fread(&hdr, sizeof(hdr), 1, f) != 1)
+        return -1;
+    if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 || hdr.version != TRACE_VERSION)
+        return -1;
+    if (hdr.interval == 0)
+        return -1;
+    tf->interval = hdr.interval;
+
+    fseeko(f, 0, SEEK_END);
+    off_t body = ftello(f) - (off_t)sizeof(TraceHeader);
+    off_t full = body / blockSize(tf->interval);
+    off_t tail = body % blockSize(tf->interval);
+
+    tf->checkpoints = full;
+    tf->records = (uint64_t)full * tf->interval;
+    if (tail >= (off_t)sizeof(TraceCheckpoint)){
+        tf->checkpoints++;
+        tf->records += (tail - sizeof(TraceCheckpoint)) / sizeof(TraceRecord);
+    }
+
+    return 0;
+}
+
+static int readCheckpoint(const TraceFile *tf, uint64_t k, TraceCheckpoint *ck){
+    if (fseeko(tf->f, checkpointOffset(tf, k), SEEK_SET) != 0)
+        return -1;
+    return fread(ck, sizeof(*ck), 1, tf->f) == 1 ? 0 : -1;
+}
+
+// read `n` consecutive records starting at `first`; they never cross a block boundary
+static int readRecords(const TraceFile *tf, uint64_t first, uint64_t n, TraceRecord *out){
+    if (fseeko(tf->f, recordOffset(tf, first), SEEK_SET) != 0)
+        return -1;
+    return fread(out, sizeof(TraceRecord), n, tf->f) == n ? 0 : -1;
+}
+
+static int sameRecord(const TraceRecord *x, const TraceRecord *y){
+    return memcmp(x, y, sizeof(TraceRecord)) == 0;
+}
+
+// the address two records' stores disagree on, or -1 if they stored the same
+static int storeDiffers(const TraceRecord *x, const TraceRecord *y){
+    if (x->store_count == y->store_count && x->store_address == y->store_address &&
+        memcmp(x->store, y->store, x->store_count) == 0)
+        return -1;
+    if (x->store_count && y->store_count && x->store_address == y->store_address)
+        return x->store[0] != y->store[0] ? x->store_address : (uint16_t)(x->store_address + 1);
+    return x->store_count ? x->store_address : y->store_address;
+}
+
+int64_t traceScan(FILE *f, void (*visit)(void *ctx, const TraceRecord *records, uint32_t count), void *ctx){
+    TraceFile tf;
+
+    if (openTraceFile(&tf, f) != 0)
+        return -1;
+
+    TraceRecord *block = (TraceRecord *)malloc((size_t)tf.interval * sizeof(TraceRecord));
+    for (uint64_t first = 0; first < tf.records; first += tf.interval){
+        uint32_t n = tf.records - first < tf.interval ? (uint32_t)(tf.records - first) : tf.interval;
+
+        if (readRecords(&tf, first, n, block) != 0){
+            free(block);
+            return -1;
+        }
+        visit(ctx, block, n);
+    }
+    free(block);
+
+    return (int64_t)tf.records;
+}
+
+int traceFindDivergence(FILE *fa, FILE *fb, TraceDivergence *div){
+    TraceFile ta, tb;
+    TraceCheckpoint ca, cb;
+
+    memset(div, 0, sizeof(*div));
+    div->memory_addr = -1;
+
+    if (openTraceFile(&ta, fa) != 0 || openTraceFile(&tb, fb) != 0)
+        return -1;
+    if (ta.interval != tb.interval)
+        return -1;
+
+    uint32_t interval = ta.interval;
+    uint64_t common = ta.checkpoints < tb.checkpoints ? ta.checkpoints : tb.checkpoints;
+    uint64_t nrec = ta.records < tb.records ? ta.records : tb.records;
+
+    div->interval = interval;
+    div->length_a = ta.records;
+    div->length_b = tb.records;
+    if (common == 0)
+        return -1;
+
+    // Bisect for the first checkpoint whose hashes differ. Once two runs diverge
+    // their hashes stay different, so the "equal" checkpoints form a prefix.
+    uint64_t lo = 0, hi = common;
+    while (lo < hi){
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (readCheckpoint(&ta, mid, &ca) != 0 || readCheckpoint(&tb, mid, &cb) != 0)
+            return -1;
+        if (ca.hash == cb.hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    // Records to compare one by one: the block ending at the bad checkpoint,
+    // or the tail after the last checkpoint both traces share.
+    uint64_t first, last;
+    if (lo == 0){
+        // the runs did not even start from the same state
+        div->found = 1;
+        div->initial = 1;
+        div->index = 0;
+        return 0;
+    }
+    else if (lo < common){
+        first = (lo - 1) * interval;
+        last = lo * interval;
+    }
+    else{
+        first = (common - 1) * interval;
+        last = first + interval;
+    }
+    if (last > nrec)
+        last = nrec;
+
+    if (first < last){
+        uint64_t n = last - first;
+        TraceRecord *ra = (TraceRecord *)malloc(n * sizeof(TraceRecord));
+        TraceRecord *rb = (TraceRecord *)malloc(n * sizeof(TraceRecord));
+        int rc = 0;
+
+        if (readRecords(&ta, first, n, ra) != 0 || readRecords(&tb, first, n, rb) != 0)
+            rc = -1;
+
+        for (uint64_t i = 0; rc == 0 && i < n; i++){
+            if (!sameRecord(&ra[i], &rb[i])){
+                div->found = 1;
+                div->index = first + i;
+                div->a = ra[i];
+                div->b = rb[i];
+                div->memory_addr = storeDiffers(&ra[i], &rb[i]);
+                break;
+            }
+        }
+
+        free(ra);
+        free(rb);
+        if (rc != 0)
+            return -1;
+        if (div->found)
+            return 0;
+    }
+
+    if (lo < common){
+        // every register and store matched, so the host or an interrupt wrote memory differently
+        div->found = 1;
+        div->memory_only = 1;
+        div->index = first;
+    }
+
+    return 0;
+}
+
+int traceLockstep(State8080 *a, Step8080Fn step_a, State8080 *b, Step8080Fn step_b,
+                  uint64_t limit, uint32_t interval, TraceDivergence *div){
+    memset(div, 0, sizeof(*div));
+    div->memory_addr = -1;
+    div->interval = interval ? interval : TRACE_DEFAULT_INTERVAL;
+
+    for (uint64_t i = 0; i < limit; i++){
+        uint16_t pc_a = a->pc, pc_b = b->pc;
+        uint8_t op_a = a->memory[pc_a], op_b = b->memory[pc_b];
+
+        step_a(a);
+        step_b(b);
+        makeTraceRecord(&div->a, a, pc_a, op_a);
+        makeTraceRecord(&div->b, b, pc_b, op_b);
+        div->length_a = div->length_b = i + 1;
+
+        // one core stopping (e.g. on an unimplemented opcode) while the other runs on also counts
+        if (!sameRecord(&div->a, &div->b) || a->stop != b->stop){
+            div->found = 1;
+            div->index = i;
+            div->memory_addr = storeDiffers(&div->a, &div->b);
+            return 0;
+        }
+
+        if ((i + 1) % div->interval == 0 && memcmp(a->memory, b->memory, 0x10000) != 0){
+            int addr = 0;
+            while (a->memory[addr] == b->memory[addr])
+                addr++;
+            div->found = 1;
+            div->memory_only = 1;
+            div->memory_addr = addr;
+            div->index = i + 1 - div->interval;
+            return 0;
+        }
+
+        if (a->stop)
+            break;
+    }
+
+    return 0;
+}
+
+void printTraceRecord(const TraceRecord *rec){
+    printf("PC %04x OP %02x A $%02x B $%02x C $%02x D $%02x E $%02x H $%02x L $%02x SP %04x F %02x",
+           rec->pc, rec->opcode, rec->a, rec->b, rec->c, rec->d, rec->e, rec->h, rec->l,
+           rec->sp, rec->flags);
+    if (rec->store_count == 1)
+        printf(" [$%04x] = $%02x", rec->store_address, rec->store[0]);
+    else if (rec->store_count == 2)
+        printf(" [$%04x] = $%02x $%02x", rec->store_address, rec->store[0], rec->store[1]);
+    printf("\n");
+}
+
+void printTraceDivergence(const TraceDivergence *div){
+    if (!div->found){
+        printf("no divergence in %llu common instructions",
+               (unsigned long long)(div->length_a < div->length_b ? div->length_a : div->length_b));
+        if (div->length_a != div->length_b)
+            printf(" (lengths differ: %llu vs %llu)",
+                   (unsigned long long)div->length_a, (unsigned long long)div->length_b);
+        printf("\n");
+        return;
+    }
+
+    if (div->initial){
+        printf("states differ before the first instruction\n");
+        return;
+    }
+
+    if (div->memory_only){
+        printf("memory diverged within instructions %llu-%llu",
+               (unsigned long long)div->index,
+               (unsigned long long)(div->index + div->interval - 1));
+        if (div->memory_addr >= 0)
+            printf(", first differing address $%04x", div->memory_addr);
+        printf("\n");
+        return;
+    }
+
+    printf("first divergence at instruction %llu\n", (unsigned long long)div->index);
+    printf("  A: "); printTraceRecord(&div->a);
+    printf("  B: "); printTraceRecord(&div->b);
+
+    const char *names[] = {"PC", "SP", "OP", "A", "B", "C", "D", "E", "H", "L", "F"};
+    unsigned va[] = {div->a.pc, div->a.sp, div->a.opcode, div->a.a, div->a.b, div->a.c,
+                     div->a.d, div->a.e, div->a.h, div->a.l, div->a.flags};
+    unsigned vb[] = {div->b.pc, div->b.sp, div->b.opcode, div->b.a, div->b.b, div->b.c,
+                     div->b.d, div->b.e, div->b.h, div->b.l, div->b.flags};
+    printf("  differs:");
+    for (int i = 0; i < 11; i++)
+        if (va[i] != vb[i])
+            printf(" %s", names[i]);
+    if (div->memory_addr >= 0)
+        printf(" store to $%04x", div->memory_addr);
+    printf("\n");
+}
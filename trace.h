@@ -0,0 +1,116 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdio.h>
+#include <stdint.h>
+#include "emulator.h"
+
+/*
+ * Binary execution trace.
+ *
+ * File layout (host endian):
+ *   TraceHeader
+ *   block 0: TraceCheckpoint, up to `interval` TraceRecords
+ *   block 1: TraceCheckpoint, up to `interval` TraceRecords
+ *   ...
+ * Checkpoint k holds the hash of the machine after k * interval instructions,
+ * so every record and checkpoint sits at a computable offset and two traces
+ * can be bisected over their checkpoints without reading the records. Each
+ * record also has the bytes its instruction stored, so a run whose memory
+ * diverges through a store is caught at that instruction. Only stores made by
+ * the host or by an interrupt (the PC pushed by an RST) are left to the
+ * checkpoint hash.
+ */
+
+#define TRACE_MAGIC     "8080TRC"
+#define TRACE_VERSION   2      // 2: records carry the instruction's stores
+#define TRACE_DEFAULT_INTERVAL  16384
+#define FNV_OFFSET  0xcbf29ce484222325ULL
+
+typedef struct TraceHeader {
+    char       magic[8];
+    uint32_t   version;
+    uint32_t   interval;    // instructions between checkpoints
+} TraceHeader;
+
+typedef struct TraceCheckpoint {
+    uint64_t   index;       // instructions executed before this checkpoint
+    uint64_t   hash;        // hashState() at that point
+} TraceCheckpoint;
+
+// registers after the instruction at `pc` has executed, and what it stored
+typedef struct TraceRecord {
+    uint16_t   pc;
+    uint16_t   sp;
+    uint16_t   store_address;   // lowest address stored to, 0 if nothing was
+    uint8_t    opcode;
+    uint8_t    a;
+    uint8_t    b;
+    uint8_t    c;
+    uint8_t    d;
+    uint8_t    e;
+    uint8_t    h;
+    uint8_t    l;
+    uint8_t    flags;       // same layout as the PSW byte pushed by PUSH PSW
+    uint8_t    store_count;     // bytes stored: 0, 1, or 2 at store_address and the next address
+    uint8_t    store[2];        // their values
+    uint8_t    pad[2];
+} TraceRecord;
+
+typedef struct TraceWriter {
+    FILE       *f;
+    uint32_t   interval;
+    uint64_t   count;
+} TraceWriter;
+
+// where two runs first disagree
+typedef struct TraceDivergence {
+    int        found;
+    int        initial;     // the runs already differ before the first instruction
+    uint64_t   index;       // instruction number (0-based) of the first bad record
+    TraceRecord  a;
+    TraceRecord  b;
+    int        memory_only; // registers and stores agree, only the memory hash differs
+    int        memory_addr; // the differing store's or first differing address, -1 if unknown
+    uint32_t   interval;    // width of the window a memory-only divergence lies in
+    uint64_t   length_a;    // instructions compared/available on each side
+    uint64_t   length_b;
+} TraceDivergence;
+
+// FNV-1a, continuing from `hash` (start with FNV_OFFSET)
+uint64_t fnv1a(uint64_t hash, const uint8_t *data, size_t len);
+uint8_t packFlags(const State8080 *state);
+void unpackFlags(State8080 *state, uint8_t psw);
+uint64_t hashState(const State8080 *state);
+void makeTraceRecord(TraceRecord *rec, const State8080 *state, uint16_t pc, uint8_t opcode);
+
+TraceWriter *traceOpen(const char *path, uint32_t interval, const State8080 *state);
+void traceRecord(TraceWriter *tw, const State8080 *state, uint16_t pc, uint8_t opcode);
+void traceClose(TraceWriter *tw);
+
+/*
+ * Find the first instruction at which two trace files disagree.
+ * Bisects over the checkpoint hashes, then compares the records of a single block.
+ * @return 0 on success (check div->found), -1 if a file is unreadable or the traces are incompatible
+ */
+int traceFindDivergence(FILE *fa, FILE *fb, TraceDivergence *div);
+
+/*
+ * Read every record of a trace file in order, one block at a time
+ * @param visit Called with each block's records
+ * @return the number of records, or -1 if the file is not a trace
+ */
+int64_t traceScan(FILE *f, void (*visit)(void *ctx, const TraceRecord *records, uint32_t count), void *ctx);
+
+/*
+ * Run two cores side by side from their current states and stop at the first
+ * instruction where their registers or stores differ, or where their memory differs at a checkpoint.
+ * For programs comparing two cores; tracediff only compares trace files.
+ */
+typedef void (*Step8080Fn)(State8080 *state);
+int traceLockstep(State8080 *a, Step8080Fn step_a, State8080 *b, Step8080Fn step_b,
+                  uint64_t limit, uint32_t interval, TraceDivergence *div);
+
+void printTraceRecord(const TraceRecord *rec);
+void printTraceDivergence(const TraceDivergence *div);
+
+#endif
@@ -0,0 +1,53 @@
+/*
+ * Find the first instruction where two binary traces (written by main.c) disagree.
+ *
+ * usage: tracediff <a.trace> <b.trace> [rom]
+ * When the ROM is given, the diverging instruction is also disassembled.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "trace.h"
+#include "disassembler.h"
+
+int main(int argc, char *argv[]) {
+    TraceDivergence div;
+
+    if (argc != 3 && argc != 4){
+        printf("usage: %s <a.trace> <b.trace> [rom]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *fa = fopen(argv[1], "rb");
+    FILE *fb = fopen(argv[2], "rb");
+    if (!fa || !fb){
+        printf("cannot open trace file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (traceFindDivergence(fa, fb, &div) != 0){
+        printf("traces are unreadable or were written with different checkpoint intervals\n");
+        exit(EXIT_FAILURE);
+    }
+    fclose(fa);
+    fclose(fb);
+
+    printTraceDivergence(&div);
+
+    if (argc == 4 && div.found && !div.memory_only && !div.initial){
+        FILE *f = fopen(argv[3], "rb");
+        uint8_t *rom = (uint8_t *)calloc(0x10000 + 2, 1);  // room for operand bytes past $ffff
+
+        if (f){
+            fread(rom, 1, 0x10000, f);
+            fclose(f);
+            printf("  A: "); Disassemble8080Op(rom, div.a.pc);
+            if (div.b.pc != div.a.pc){
+                printf("  B: "); Disassemble8080Op(rom, div.b.pc);
+            }
+        }
+        free(rom);
+    }
+
+    // exit status follows diff(1): 0 identical, 1 different
+    return div.found ? 1 : 0;
+}